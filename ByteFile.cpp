@@ -1,11 +1,14 @@
 #include "ByteFile.h"
 #include "Error.h"
+#include "Value.h"
 #include <fstream>
 
 using namespace lama;
 
 ByteFile::ByteFile(std::unique_ptr<const uint8_t[]> data, size_t sizeBytes)
     : data(std::move(data)), sizeBytes(sizeBytes) {
+  // Frame records and closures keep code addresses in values
+  checkAddressable(this->data.get(), sizeBytes);
   init();
 }
 
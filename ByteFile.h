@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 namespace lama {
 
@@ -14,7 +16,7 @@ public:
   static ByteFile load(std::string path);
 
   const uint8_t *getCode() const { return code; }
-  size_t getCodeSizeBytes() { return codeSizeBytes; }
+  size_t getCodeSizeBytes() const { return codeSizeBytes; }
 
   const char *getStringTable() const { return stringTable; }
   size_t getStringTableSize() const { return stringTableSizeBytes; }
@@ -24,6 +26,16 @@ public:
 
   size_t getGlobalAreaSize() const { return globalAreaSizeWords; }
 
+  /// Offset in the bytefile as loaded of the instruction at \p ioffset, the
+  /// one errors are reported at. They differ in rewritten code.
+  int32_t sourceOffsetOf(int32_t ioffset) const {
+    return sourceOffsets.empty() ? ioffset : sourceOffsets[ioffset];
+  }
+  /// \param offsets source offsets by instruction offset
+  void setSourceOffsets(std::vector<int32_t> offsets) {
+    sourceOffsets = std::move(offsets);
+  }
+
 private:
   void init();
 
@@ -41,6 +53,9 @@ private:
   size_t codeSizeBytes;
 
   size_t globalAreaSizeWords;
+
+  /// Empty if the code is the one loaded
+  std::vector<int32_t> sourceOffsets;
 };
 
 } // namespace lama
@@ -0,0 +1,1041 @@
+#include "CEmitter.h"
+#include "ByteFile.h"
+#include "Error.h"
+#include "Inst.h"
+#include "Runtime.h"
+#include "Stack.h"
+#include "Value.h"
+#include "Verifier.h"
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+using namespace lama;
+
+/// Declarations and helpers the emitted functions rely on, the helpers
+/// follow their counterparts in Runtime.h and Stack.cpp. Preceded by the
+/// stack sizes.
+static const char prelude[] = R"C(
+#include "gc.h"
+#include "runtime_common.h"
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+typedef int32_t Value;
+typedef Value (*lama_function)(void);
+
+extern size_t __gc_stack_top, __gc_stack_bottom;
+extern Value __start_custom_data[], __stop_custom_data[];
+#define lama_globals __start_custom_data
+
+extern Value Lread(void);
+extern int Lwrite(Value boxedInt);
+extern int Llength(void *p);
+extern void *Lstring(void *p);
+extern void *Belem(void *p, int i);
+extern void *Bstring(void *cstr);
+extern void *Bsta(void *v, int i, void *x);
+extern void Bmatch_failure(void *v, char *fname, int line, int col)
+    __attribute__((noreturn));
+extern int Bstring_patt(void *x, void *y);
+
+/* Lowest address of the Lama stack, right above its guard area */
+static Value *lama_stack;
+/* Lowest address of the native stack, right above its guard area */
+static char *lama_native_stack;
+
+/* Tail calls to a function other than the caller must not grow the
+   native stack at any optimization level. Where the compiler cannot be
+   made to jump, the caller returns and the trampoline in lama_call()
+   makes the call. */
+#ifdef __has_attribute
+#if __has_attribute(musttail)
+#define LAMA_MUSTTAIL 1
+#endif
+#endif
+#ifdef LAMA_MUSTTAIL
+#define LAMA_TAIL_CALL(callee) __attribute__((musttail)) return (callee)()
+#define lama_call(callee) ((callee)())
+#else
+static lama_function lama_tail_callee;
+
+#define LAMA_TAIL_CALL(callee) return lama_tail_callee = (callee), 0
+
+static inline Value lama_call(lama_function callee) {
+  Value result = callee();
+  while (lama_tail_callee) {
+    callee = lama_tail_callee;
+    lama_tail_callee = NULL;
+    result = callee();
+  }
+  return result;
+}
+#endif
+
+static inline Value lama_box(int32_t n) {
+  return (Value)(((uint32_t)n << 1) | 1);
+}
+
+static inline Value *lama_words(Value object) {
+  return (Value *)VALUE_TO_PTR(object);
+}
+
+static inline data *lama_data(Value object) {
+  return TO_DATA(VALUE_TO_PTR(object));
+}
+
+/* The error helpers go unused by programs that can not fail that way */
+__attribute__((noreturn, cold, unused)) static void
+lama_error(int32_t ioffset, const char *message) {
+  fprintf(stderr, "runtime error at 0x%x: %s\n", ioffset, message);
+  exit(255);
+}
+
+__attribute__((noreturn, cold, unused)) static void
+lama_not_int(int32_t ioffset, Value value) {
+  fprintf(stderr,
+          "runtime error at 0x%x: expected a (boxed) number at the operand "
+          "stack top, found %s0x%x\n",
+          ioffset, value < 0 ? "-" : "",
+          value < 0 ? -(uint32_t)value : (uint32_t)value);
+  exit(255);
+}
+
+/* Reports the right-hand side first, as if it was taken from the stack
+   first */
+__attribute__((noreturn, cold, unused)) static void
+lama_not_ints(int32_t ioffset, Value lhs, Value rhs) {
+  lama_not_int(ioffset, rhs & 1 ? lhs : rhs);
+}
+
+/* Arithmetic on boxed numbers, see Value.h */
+static inline Value lama_add(Value lhs, Value rhs) {
+  return (Value)((uint32_t)lhs + (uint32_t)rhs - 1);
+}
+
+static inline Value lama_sub(Value lhs, Value rhs) {
+  return (Value)((uint32_t)lhs - (uint32_t)rhs + 1);
+}
+
+static inline Value lama_mul(Value lhs, Value rhs) {
+  return (Value)((uint32_t)(lhs >> 1) * ((uint32_t)rhs - 1) + 1);
+}
+
+static inline int lama_is_object_of(Value value, int tag) {
+  return !(value & 1) && TAG(lama_data(value)->data_header) == tag;
+}
+
+static inline int lama_is_sexp_of(Value value, int32_t tag, int32_t nfields) {
+  return lama_is_object_of(value, SEXP_TAG) &&
+         TO_SEXP(VALUE_TO_PTR(value))->tag == tag &&
+         (int32_t)LEN(lama_data(value)->data_header) == nfields;
+}
+
+static inline int lama_is_array_of(Value value, int32_t nelems) {
+  return lama_is_object_of(value, ARRAY_TAG) &&
+         (int32_t)LEN(lama_data(value)->data_header) == nelems;
+}
+
+/* Belem for an index proven to be a number */
+static inline Value lama_elem_at_int(Value aggregate, Value index) {
+  if (aggregate & 1)
+    return PTR_TO_VALUE(Belem(VALUE_TO_PTR(aggregate), index));
+  int32_t i = index >> 1;
+  switch (TAG(lama_data(aggregate)->data_header)) {
+  case STRING_TAG:
+    return lama_box(((char *)VALUE_TO_PTR(aggregate))[i]);
+  case SEXP_TAG:
+    return lama_words(aggregate)[i + 1];
+  default:
+    return lama_words(aggregate)[i];
+  }
+}
+
+static inline data *lama_allocate(size_t size) {
+  data *object = (data *)alloc_uncleared(BYTES_TO_WORDS(size));
+  object->forward_address = 0;
+  return object;
+}
+
+/* Copies n operands from the stack top into fields in the order they were
+   pushed, the last one is on top */
+static inline void lama_copy_pushed(size_t n, int *fields) {
+  const Value *operand = (const Value *)__gc_stack_top + n;
+  for (size_t i = 0; i < n; ++i)
+    fields[i] = *operand--;
+}
+
+static inline Value lama_array(size_t n) {
+  data *array = lama_allocate(DATA_HEADER_SZ + n * MEMBER_SIZE);
+  array->data_header = ARRAY_TAG | (n << 3);
+  lama_copy_pushed(n, (int *)array->contents);
+  return PTR_TO_VALUE(array->contents);
+}
+
+static inline Value lama_sexp(int32_t tag, size_t n) {
+  sexp *object =
+      (sexp *)lama_allocate(DATA_HEADER_SZ + (n + 1) * MEMBER_SIZE);
+  object->data_header = SEXP_TAG | (n << 3);
+  object->tag = tag;
+  lama_copy_pushed(n, object->contents);
+  return PTR_TO_VALUE(&object->tag);
+}
+
+/* Captured values are taken from the stack top, the first one on top */
+static inline Value lama_closure(lama_function entry, size_t n) {
+  data *closure = lama_allocate(DATA_HEADER_SZ + (n + 1) * MEMBER_SIZE);
+  closure->data_header = CLOSURE_TAG | ((n + 1) << 3);
+  STORE_PTR(closure->contents, entry);
+  memcpy(closure->contents + MEMBER_SIZE, (Value *)__gc_stack_top + 1,
+         n * MEMBER_SIZE);
+  return PTR_TO_VALUE(closure->contents);
+}
+
+static struct sigaction lama_previous_segv_action;
+/* Where an access to a guard area jumps to, out of the program's context */
+static sigjmp_buf lama_overflow;
+
+static void lama_handle_segv(int signal, siginfo_t *info, void *context) {
+  (void)signal;
+  (void)context;
+  char *address = (char *)info->si_addr;
+  char *stack = (char *)lama_stack;
+  if ((address < stack &&
+       address >= stack - LAMA_STACK_GUARD_SIZE * sizeof(Value)) ||
+      (address < lama_native_stack &&
+       address >= lama_native_stack - LAMA_NATIVE_STACK_GUARD_SIZE)) {
+    siglongjmp(lama_overflow, 1);
+  }
+  /* Faulting again runs the previous handler */
+  sigaction(SIGSEGV, &lama_previous_segv_action, NULL);
+}
+
+/* Maps a stack of size bytes with a guard area of guard bytes below it */
+static char *lama_map_stack(size_t size, size_t guard, int flags) {
+  char *mapping = mmap(NULL, guard + size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | flags,
+                       -1, 0);
+  if (mapping == MAP_FAILED || mprotect(mapping, guard, PROT_NONE) != 0) {
+    perror("failed to map a stack");
+    exit(255);
+  }
+  return mapping + guard;
+}
+
+static ucontext_t lama_main_context, lama_program_context;
+static lama_function lama_main_function;
+static int32_t lama_main_nargs;
+
+static void lama_run(void) {
+  Value *top = (Value *)__gc_stack_bottom - 1;
+  for (int32_t i = 0; i < lama_main_nargs; ++i)
+    *top-- = lama_box(0);
+  __gc_stack_top = (size_t)top;
+  lama_call(lama_main_function);
+}
+
+/* Runs main on a native stack of its own, deep enough for the recursion
+   the Lama stack has room for */
+static int lama_start(lama_function entry, int32_t nargs) {
+  for (Value *global = lama_globals; global < __stop_custom_data; ++global)
+    *global = lama_box(0);
+  __gc_init();
+  /* Stack addresses are kept in values */
+  lama_stack = (Value *)lama_map_stack(LAMA_STACK_SIZE * sizeof(Value),
+                                       LAMA_STACK_GUARD_SIZE * sizeof(Value),
+                                       MAP_32BIT);
+  /* The collector reads one word past the bottom when fixing references */
+  __gc_stack_bottom = (size_t)(lama_stack + LAMA_STACK_SIZE - 1);
+  lama_native_stack = lama_map_stack(LAMA_NATIVE_STACK_SIZE,
+                                     LAMA_NATIVE_STACK_GUARD_SIZE, 0);
+
+  if (sigsetjmp(lama_overflow, 1)) {
+    fprintf(stderr, "runtime error: stack exhausted\n");
+    exit(255);
+  }
+  /* Overflowing the native stack leaves no room for the handler there */
+  stack_t handlerStack;
+  handlerStack.ss_sp = malloc(SIGSTKSZ);
+  handlerStack.ss_size = SIGSTKSZ;
+  handlerStack.ss_flags = 0;
+  sigaltstack(&handlerStack, NULL);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = lama_handle_segv;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &lama_previous_segv_action);
+
+  lama_main_function = entry;
+  lama_main_nargs = nargs;
+  getcontext(&lama_program_context);
+  lama_program_context.uc_stack.ss_sp = lama_native_stack;
+  lama_program_context.uc_stack.ss_size = LAMA_NATIVE_STACK_SIZE;
+  lama_program_context.uc_link = &lama_main_context;
+  makecontext(&lama_program_context, lama_run, 0);
+  swapcontext(&lama_main_context, &lama_program_context);
+  return 0;
+}
+)C";
+
+/// Bytes of the native stack the emitted program runs on. Native frames
+/// of the emitted functions are a few times larger than their frames on
+/// the Lama stack.
+static constexpr size_t NativeStackSize = STACK_SIZE * sizeof(Value) * 4;
+static constexpr size_t NativeStackGuardSize = 1 << 20;
+
+namespace {
+
+class Emitter {
+public:
+  Emitter(const ByteFile &byteFile, const CodeInfo &codeInfo,
+          std::ostream &out);
+
+  void emit();
+
+private:
+  void emitGlobalArea();
+  void emitStringTable();
+  void emitFunction(const FunctionInfo &function);
+  /// Collects the instructions reachable from the function BEGIN, also
+  /// those shared with other functions, in the order they are emitted, and
+  /// marks the ones jumped to
+  void collectInsts(const FunctionInfo &function);
+  /// \return the instruction following #ip
+  const uint8_t *skipInst(std::vector<int32_t> &jumpTargets,
+                          bool &fallsThrough, int32_t &npushed);
+  /// \pre #ip points to a reachable instruction
+  /// \post #ip points right after the instruction
+  /// \return whether control may fall through to the next instruction
+  bool emitInst();
+  void emitPrologue();
+  /// Moves \p noperands topmost operands in place of the arguments of the
+  /// current function, so that the function called next returns to its
+  /// caller
+  void emitTailCall(int32_t depth, int32_t noperands);
+  /// Stores the operands into their slots and sets the stack top right
+  /// below them, so that the GC and the runtime see them
+  void spill(int32_t depth);
+  /// Loads the operands from their slots, as the GC may have moved what
+  /// they refer to
+  void reload(int32_t depth);
+  void prefillLocals();
+
+  /// C local holding the operand at \p depth
+  std::string operand(int32_t depth) const {
+    return fmt::format("s{}", depth);
+  }
+  /// Slot of the operand at \p depth on the Lama stack, right below the
+  /// locals
+  std::string slot(int32_t depth) const {
+    return fmt::format("b[{}]", -(nlocals + 1 + depth));
+  }
+  std::string var(uint8_t designation, int32_t index) const;
+  std::string label(int32_t ioffset) const {
+    return fmt::format("l_{:x}", ioffset);
+  }
+  std::string functionName(int32_t ioffset) const {
+    return fmt::format("f_{:x}", ioffset);
+  }
+  /// Checks \p operand is a number unless the verifier has proven it
+  void checkInt(const std::string &operand);
+
+  template <typename... A> void line(A &&...args) {
+    out << "  " << fmt::format(std::forward<A>(args)...) << '\n';
+  }
+
+  uint8_t readByte();
+  int32_t readWord();
+
+  int32_t ioffsetOf(const uint8_t *ip) const {
+    return ip - byteFile.getCode();
+  }
+  int32_t depthAt(int32_t ioffset) const {
+    return codeInfo.instInfo[ioffset].operandStackSize;
+  }
+  /// Offset errors of the current instruction are reported at, the one in
+  /// the bytefile as loaded
+  int32_t errorOffset() const {
+    return byteFile.sourceOffsetOf(currentInstOffset);
+  }
+
+private:
+  const ByteFile &byteFile;
+  const CodeInfo &codeInfo;
+  std::ostream &out;
+
+  std::vector<const uint8_t *> insts;
+  /// Index of the last function the instruction was collected for
+  std::vector<int32_t> collectedBy;
+  /// Index of the last function the instruction was labelled in
+  std::vector<int32_t> labelledBy;
+  int32_t functionIndex = -1;
+  int32_t beginOffset;
+  int32_t nargs;
+  int32_t nlocals;
+  int32_t nprefilledLocals;
+  bool isClosure;
+  /// Operands kept in C locals at once
+  int32_t maxOperands;
+  /// Operand slots used on the Lama stack, with the captured values of
+  /// CLOSURE
+  int32_t maxDepth;
+  /// Whether the function calls itself as a tail call, which jumps back to
+  /// its start
+  bool loopsToStart;
+
+  const uint8_t *ip;
+  int32_t currentInstOffset;
+};
+
+} // namespace
+
+Emitter::Emitter(const ByteFile &byteFile, const CodeInfo &codeInfo,
+                 std::ostream &out)
+    : byteFile(byteFile), codeInfo(codeInfo), out(out),
+      collectedBy(byteFile.getCodeSizeBytes(), -1),
+      labelledBy(byteFile.getCodeSizeBytes(), -1) {}
+
+uint8_t Emitter::readByte() { return *ip++; }
+
+int32_t Emitter::readWord() {
+  int32_t word;
+  memcpy(&word, ip, sizeof(int32_t));
+  ip += sizeof(int32_t);
+  return word;
+}
+
+const uint8_t *Emitter::skipInst(std::vector<int32_t> &jumpTargets,
+                                 bool &fallsThrough, int32_t &npushed) {
+  const uint8_t *inst = ip;
+  jumpTargets.clear();
+  fallsThrough = true;
+  npushed = 1;
+  uint8_t byte = readByte();
+  switch (byte) {
+  case I_CONST:
+  case I_STRING:
+  case I_LD_Global:
+  case I_LD_Local:
+  case I_LD_Arg:
+  case I_LD_Access:
+  case I_ST_Global:
+  case I_ST_Local:
+  case I_ST_Arg:
+  case I_ST_Access:
+  case I_CALLC:
+  case I_ARRAY:
+  case I_LINE:
+  case I_CALL_Barray:
+    readWord();
+    break;
+  case I_LDA_Global:
+  case I_LDA_Local:
+  case I_LDA_Arg:
+  case I_LDA_Access:
+    readWord();
+    npushed = 2;
+    break;
+  case I_SEXP:
+  case I_BEGIN:
+  case I_BEGINcl:
+  case I_TAG:
+    readWord();
+    readWord();
+    break;
+  case I_CALL: {
+    int32_t target = readWord();
+    readWord();
+    if (codeInfo.instInfo[ioffsetOf(inst)].isTailCall()) {
+      fallsThrough = false;
+      loopsToStart |= target == beginOffset && !isClosure;
+    }
+    break;
+  }
+  case I_JMP:
+    jumpTargets.push_back(readWord());
+    fallsThrough = false;
+    break;
+  case I_CJMPz:
+  case I_CJMPnz:
+    jumpTargets.push_back(readWord());
+    break;
+  case I_TAGSWITCH: {
+    int32_t narms = readWord();
+    jumpTargets.push_back(readWord());
+    for (int32_t i = 0; i < narms; ++i) {
+      readWord();
+      readWord();
+      jumpTargets.push_back(readWord());
+    }
+    fallsThrough = false;
+    break;
+  }
+  case I_END:
+    fallsThrough = false;
+    break;
+  case I_FAIL:
+    readWord();
+    readWord();
+    fallsThrough = false;
+    break;
+  case I_CLOSURE: {
+    readWord();
+    int32_t n = readWord();
+    ip += n * (1 + sizeof(int32_t));
+    npushed = std::max(n, 1);
+    break;
+  }
+  }
+  return ip;
+}
+
+void Emitter::collectInsts(const FunctionInfo &function) {
+  insts.clear();
+  maxOperands = 0;
+  maxDepth = 0;
+  loopsToStart = false;
+  std::vector<const uint8_t *> stack{function.beginIp};
+  collectedBy[ioffsetOf(function.beginIp)] = functionIndex;
+  std::vector<int32_t> jumpTargets;
+  while (!stack.empty()) {
+    ip = stack.back();
+    stack.pop_back();
+    insts.push_back(ip);
+    int32_t depth = depthAt(ioffsetOf(ip));
+    bool fallsThrough;
+    int32_t npushed;
+    const uint8_t *next = skipInst(jumpTargets, fallsThrough, npushed);
+    // Results are counted at the instructions they are left to
+    maxOperands = std::max(maxOperands, depth);
+    maxDepth = std::max(maxDepth, depth + npushed);
+    for (int32_t target : jumpTargets)
+      labelledBy[target] = functionIndex;
+    if (fallsThrough)
+      jumpTargets.push_back(ioffsetOf(next));
+    for (int32_t successor : jumpTargets) {
+      if (collectedBy[successor] == functionIndex)
+        continue;
+      collectedBy[successor] = functionIndex;
+      stack.push_back(byteFile.getCode() + successor);
+    }
+  }
+  std::sort(insts.begin(), insts.end());
+  // The prologue comes first, also when shared code lies before the BEGIN
+  auto begin = std::find(insts.begin(), insts.end(), function.beginIp);
+  std::rotate(insts.begin(), begin, begin + 1);
+  // Falling through to an instruction emitted elsewhere jumps to it
+  for (size_t i = 0; i < insts.size(); ++i) {
+    ip = insts[i];
+    bool fallsThrough;
+    int32_t npushed;
+    const uint8_t *next = skipInst(jumpTargets, fallsThrough, npushed);
+    if (fallsThrough && (i + 1 == insts.size() || insts[i + 1] != next))
+      labelledBy[ioffsetOf(next)] = functionIndex;
+  }
+}
+
+std::string Emitter::var(uint8_t designation, int32_t index) const {
+  switch (designation) {
+  case LOC_Global:
+    return fmt::format("lama_globals[{}]", index);
+  case LOC_Local:
+    return fmt::format("b[{}]", -(index + 1));
+  case LOC_Arg:
+    return fmt::format("b[{}]", nargs - 1 - index);
+  case LOC_Access:
+    return fmt::format("lama_words(b[{}])[{}]", nargs, index + 1);
+  }
+  runtimeError("unsupported variable designation {:#x} at {:#x}",
+               designation, currentInstOffset);
+}
+
+void Emitter::checkInt(const std::string &operand) {
+  if (codeInfo.instInfo[currentInstOffset].hasIntOperands())
+    return;
+  line("if (!({} & 1))", operand);
+  line("  lama_not_int({:#x}, {});", errorOffset(), operand);
+}
+
+void Emitter::spill(int32_t depth) {
+  for (int32_t i = 0; i < depth; ++i)
+    line("{} = {};", slot(i), operand(i));
+  line("__gc_stack_top = (size_t)&{};", slot(depth));
+}
+
+void Emitter::reload(int32_t depth) {
+  for (int32_t i = 0; i < depth; ++i)
+    line("{} = {};", operand(i), slot(i));
+}
+
+void Emitter::prefillLocals() {
+  // Fill with some boxed values so that GC will skip these, the rest of
+  // the locals is assigned before anything may see it
+  for (int32_t i = 0; i < nprefilledLocals; ++i)
+    line("b[{}] = {};", -(i + 1), boxInt(0));
+}
+
+void Emitter::emitPrologue() {
+  line("Value *const b = (Value *)__gc_stack_top + 1;");
+  int32_t needed = nlocals + maxDepth;
+  if (Stack::needsRoomCheck(nlocals, maxDepth)) {
+    line("if (b - {} < lama_stack)", needed);
+    line("  lama_error({:#x}, \"might exhaust stack\");", errorOffset());
+  } else if (needed > 0) {
+    // Frames leave no record on the stack, so touch the lowest slot, an
+    // overflow then faults in the guard area instead of skipping it
+    line("b[{}] = {};", -needed, boxInt(0));
+  }
+  prefillLocals();
+  if (loopsToStart)
+    out << "start:;\n";
+}
+
+void Emitter::emitTailCall(int32_t depth, int32_t noperands) {
+  int32_t newBase = nargs + isClosure - noperands;
+  for (int32_t i = 0; i < noperands; ++i)
+    line("b[{}] = {};", newBase + i, operand(depth - 1 - i));
+  line("__gc_stack_top = (size_t)&b[{}];", newBase - 1);
+}
+
+bool Emitter::emitInst() {
+  currentInstOffset = ioffsetOf(ip);
+  if (labelledBy[currentInstOffset] == functionIndex)
+    out << label(currentInstOffset) << ":;\n";
+  int32_t depth = depthAt(currentInstOffset);
+  uint8_t byte = readByte();
+  uint8_t low = 0x0F & byte;
+  switch (byte) {
+  case I_BINOP_Eq: {
+    line("{0} = lama_box({0} == {1});", operand(depth - 2),
+         operand(depth - 1));
+    return true;
+  }
+  case I_BINOP_Add:
+  case I_BINOP_Sub:
+  case I_BINOP_Mul:
+  case I_BINOP_Div:
+  case I_BINOP_Mod:
+  case I_BINOP_Lt:
+  case I_BINOP_Leq:
+  case I_BINOP_Gt:
+  case I_BINOP_Geq:
+  case I_BINOP_Neq:
+  case I_BINOP_And:
+  case I_BINOP_Or: {
+    std::string lhs = operand(depth - 2);
+    std::string rhs = operand(depth - 1);
+    if (!codeInfo.instInfo[currentInstOffset].hasIntOperands()) {
+      line("if (!({} & {} & 1))", lhs, rhs);
+      line("  lama_not_ints({:#x}, {}, {});", errorOffset(), lhs, rhs);
+    }
+    if (byte == I_BINOP_Div || byte == I_BINOP_Mod) {
+      line("if ({} == {})", rhs, boxInt(0));
+      line("  lama_error({:#x}, \"division by zero\");", errorOffset());
+    }
+    // Operands stay boxed where possible, see Value.h
+    const char *expression = nullptr;
+    switch (byte) {
+    case I_BINOP_Add:
+      expression = "lama_add({0}, {1})";
+      break;
+    case I_BINOP_Sub:
+      expression = "lama_sub({0}, {1})";
+      break;
+    case I_BINOP_Mul:
+      expression = "lama_mul({0}, {1})";
+      break;
+    case I_BINOP_Div:
+      expression = "lama_box(({0} >> 1) / ({1} >> 1))";
+      break;
+    case I_BINOP_Mod:
+      expression = "lama_box(({0} >> 1) % ({1} >> 1))";
+      break;
+    case I_BINOP_Lt:
+      expression = "lama_box({0} < {1})";
+      break;
+    case I_BINOP_Leq:
+      expression = "lama_box({0} <= {1})";
+      break;
+    case I_BINOP_Gt:
+      expression = "lama_box({0} > {1})";
+      break;
+    case I_BINOP_Geq:
+      expression = "lama_box({0} >= {1})";
+      break;
+    case I_BINOP_Neq:
+      expression = "lama_box({0} != {1})";
+      break;
+    case I_BINOP_And:
+      expression = "lama_box({0} != 1 && {1} != 1)";
+      break;
+    case I_BINOP_Or:
+      expression = "lama_box({0} != 1 || {1} != 1)";
+      break;
+    }
+    line("{} = {};", lhs, fmt::format(expression, lhs, rhs));
+    return true;
+  }
+  case I_CONST: {
+    line("{} = {};", operand(depth), boxInt(readWord()));
+    return true;
+  }
+  case I_STRING: {
+    int32_t offset = readWord();
+    std::string string = fmt::format("(char *)&lama_strings[{}]", offset);
+    if (codeInfo.instInfo[currentInstOffset].isSharedString()) {
+      // Only the first execution creates the string
+      std::string cache = var(
+          LOC_Global, codeInfo.sharedStringGlobals.at(offset));
+      line("if ({} & 1) {{", cache);
+      spill(depth);
+      line("{} = PTR_TO_VALUE(Bstring({}));", cache, string);
+      reload(depth);
+      line("}}");
+      line("{} = {};", operand(depth), cache);
+      return true;
+    }
+    spill(depth);
+    line("{} = PTR_TO_VALUE(Bstring({}));", operand(depth), string);
+    reload(depth);
+    return true;
+  }
+  case I_SEXP: {
+    readWord();
+    int32_t n = readWord();
+    spill(depth);
+    line("{} = lama_sexp({}, {});", operand(depth - n),
+         unboxInt(codeInfo.tagHashes.at(currentInstOffset)), n);
+    reload(depth - n);
+    return true;
+  }
+  case I_STA: {
+    line("{} = PTR_TO_VALUE(Bsta(VALUE_TO_PTR({}), {}, VALUE_TO_PTR({})));",
+         operand(depth - 3), operand(depth - 1), operand(depth - 2),
+         operand(depth - 3));
+    return true;
+  }
+  case I_JMP: {
+    line("goto {};", label(readWord()));
+    return false;
+  }
+  case I_END: {
+    line("return {};", operand(depth - 1));
+    return false;
+  }
+  case I_DROP: {
+    return true;
+  }
+  case I_DUP: {
+    line("{} = {};", operand(depth), operand(depth - 1));
+    return true;
+  }
+  case I_SWAP: {
+    line("{{");
+    line("  Value swapped = {};", operand(depth - 1));
+    line("  {} = {};", operand(depth - 1), operand(depth - 2));
+    line("  {} = swapped;", operand(depth - 2));
+    line("}}");
+    return true;
+  }
+  case I_ELEM: {
+    std::string aggregate = operand(depth - 2);
+    std::string index = operand(depth - 1);
+    if (codeInfo.instInfo[currentInstOffset].hasIntOperands())
+      line("{0} = lama_elem_at_int({0}, {1});", aggregate, index);
+    else
+      line("{0} = PTR_TO_VALUE(Belem(VALUE_TO_PTR({0}), {1}));", aggregate,
+           index);
+    return true;
+  }
+  case I_LD_Global:
+  case I_LD_Local:
+  case I_LD_Arg:
+  case I_LD_Access: {
+    line("{} = {};", operand(depth), var(low, readWord()));
+    return true;
+  }
+  case I_LDA_Global:
+  case I_LDA_Local:
+  case I_LDA_Arg:
+  case I_LDA_Access: {
+    line("{} = {} = PTR_TO_VALUE(&{});", operand(depth), operand(depth + 1),
+         var(low, readWord()));
+    return true;
+  }
+  case I_ST_Global:
+  case I_ST_Local:
+  case I_ST_Arg:
+  case I_ST_Access: {
+    line("{} = {};", var(low, readWord()), operand(depth - 1));
+    return true;
+  }
+  case I_CJMPz:
+  case I_CJMPnz: {
+    int32_t target = readWord();
+    checkInt(operand(depth - 1));
+    line("if ({} {} {})", operand(depth - 1), byte == I_CJMPz ? "==" : "!=",
+         boxInt(0));
+    line("  goto {};", label(target));
+    return true;
+  }
+  case I_BEGIN:
+  case I_BEGINcl: {
+    // Arguments and locals are already known from emitFunction
+    readWord();
+    readWord();
+    emitPrologue();
+    return true;
+  }
+  case I_CLOSURE: {
+    int32_t target = readWord();
+    int32_t n = readWord();
+    spill(depth);
+    for (int32_t i = 0; i < n; ++i) {
+      uint8_t designation = readByte();
+      int32_t index = readWord();
+      line("{} = {};", slot(depth + n - 1 - i), var(designation, index));
+    }
+    line("__gc_stack_top = (size_t)&{};", slot(depth + n));
+    line("{} = lama_closure({}, {});", operand(depth), functionName(target),
+         n);
+    reload(depth);
+    return true;
+  }
+  case I_CALLC: {
+    int32_t n = readWord();
+    std::string closure = operand(depth - n - 1);
+    if (codeInfo.instInfo[currentInstOffset].isTailCall()) {
+      line("{{");
+      line("  lama_function callee = "
+           "(lama_function)LOAD_PTR(VALUE_TO_PTR({}));",
+           closure);
+      emitTailCall(depth, n + 1);
+      line("  LAMA_TAIL_CALL(callee);");
+      line("}}");
+      return false;
+    }
+    spill(depth);
+    line("{0} = lama_call((lama_function)LOAD_PTR(VALUE_TO_PTR({0})));",
+         closure);
+    reload(depth - n - 1);
+    return true;
+  }
+  case I_CALL: {
+    int32_t target = readWord();
+    int32_t n = readWord();
+    if (codeInfo.instInfo[currentInstOffset].isTailCall()) {
+      if (target == beginOffset && !isClosure) {
+        // The frame stays, see Stack::tailCallSelf()
+        for (int32_t i = 0; i < n; ++i)
+          line("b[{}] = {};", nargs - 1 - i, operand(depth - n + i));
+        prefillLocals();
+        line("goto start;");
+        return false;
+      }
+      emitTailCall(depth, n);
+      line("LAMA_TAIL_CALL({});", functionName(target));
+      return false;
+    }
+    spill(depth);
+    line("{} = lama_call({});", operand(depth - n), functionName(target));
+    reload(depth - n);
+    return true;
+  }
+  case I_TAG: {
+    readWord();
+    int32_t nfields = readWord();
+    line("{0} = lama_box(lama_is_sexp_of({0}, {1}, {2}));",
+         operand(depth - 1),
+         unboxInt(codeInfo.tagHashes.at(currentInstOffset)), nfields);
+    return true;
+  }
+  case I_ARRAY: {
+    int32_t nelems = readWord();
+    line("{0} = lama_box(lama_is_array_of({0}, {1}));", operand(depth - 1),
+         nelems);
+    return true;
+  }
+  case I_FAIL: {
+    int32_t lineNumber = readWord();
+    int32_t column = readWord();
+    line("Bmatch_failure(VALUE_TO_PTR({}), \"{}\", {}, {});",
+         operand(depth - 1), unknownFile, lineNumber, column);
+    return false;
+  }
+  case I_LINE: {
+    readWord();
+    return true;
+  }
+  case I_TAGSWITCH: {
+    int32_t narms = readWord();
+    int32_t defaultTarget = readWord();
+    std::string scrutinee = operand(depth - 1);
+    line("if (!({} & 1)) {{", scrutinee);
+    // The header of a sexp is its field count and SEXP_TAG, so it is
+    // compared whole
+    line("  int header = lama_data({})->data_header;", scrutinee);
+    for (int32_t i = 0; i < narms; ++i) {
+      Value tagHash = codeInfo.tagHashes.at(ioffsetOf(ip));
+      readWord();
+      int32_t nfields = readWord();
+      int32_t target = readWord();
+      if (nfields > (INT32_MAX >> 3))
+        continue;
+      line("  if (header == {} && TO_SEXP(VALUE_TO_PTR({}))->tag == {})",
+           (nfields << 3) | SEXP_TAG, scrutinee, unboxInt(tagHash));
+      line("    goto {};", label(target));
+    }
+    line("}}");
+    line("goto {};", label(defaultTarget));
+    return false;
+  }
+  case I_PATT_StrCmp: {
+    line("{0} = Bstring_patt(VALUE_TO_PTR({1}), VALUE_TO_PTR({0}));",
+         operand(depth - 2), operand(depth - 1));
+    return true;
+  }
+  case I_PATT_String:
+  case I_PATT_Array:
+  case I_PATT_Sexp:
+  case I_PATT_Boxed:
+  case I_PATT_UnBoxed:
+  case I_PATT_Closure: {
+    static const char *const tests[] = {
+        "lama_is_object_of({0}, STRING_TAG)",
+        "lama_is_object_of({0}, ARRAY_TAG)",
+        "lama_is_object_of({0}, SEXP_TAG)",
+        "!({0} & 1)",
+        "{0} & 1",
+        "lama_is_object_of({0}, CLOSURE_TAG)",
+    };
+    std::string value = operand(depth - 1);
+    line("{} = lama_box({});", value,
+         fmt::format(tests[byte - I_PATT_String], value));
+    return true;
+  }
+  case I_CALL_Lread: {
+    line("{} = Lread();", operand(depth));
+    return true;
+  }
+  case I_CALL_Lwrite: {
+    line("Lwrite({});", operand(depth - 1));
+    line("{} = {};", operand(depth - 1), boxInt(0));
+    return true;
+  }
+  case I_CALL_Llength: {
+    line("{0} = Llength(VALUE_TO_PTR({0}));", operand(depth - 1));
+    return true;
+  }
+  case I_CALL_Lstring: {
+    spill(depth);
+    line("{0} = PTR_TO_VALUE(Lstring(VALUE_TO_PTR({0})));",
+         operand(depth - 1));
+    reload(depth - 1);
+    return true;
+  }
+  case I_CALL_Barray: {
+    int32_t n = readWord();
+    spill(depth);
+    line("{} = lama_array({});", operand(depth - n), n);
+    reload(depth - n);
+    return true;
+  }
+  }
+  runtimeError("unsupported instruction code {:#04x} at {:#x}", byte,
+               currentInstOffset);
+}
+
+void Emitter::emitFunction(const FunctionInfo &function) {
+  beginOffset = ioffsetOf(function.beginIp);
+  nargs = function.nargs;
+  nlocals = function.nlocals;
+  nprefilledLocals = function.nprefilledLocals;
+  isClosure = function.isClosure();
+  collectInsts(function);
+
+  out << fmt::format("\nstatic Value {}(void) {{\n",
+                     functionName(beginOffset));
+  for (int32_t i = 0; i < maxOperands; ++i)
+    line("Value {};", operand(i));
+  for (size_t i = 0; i < insts.size(); ++i) {
+    ip = insts[i];
+    bool fallsThrough = emitInst();
+    if (fallsThrough && (i + 1 == insts.size() || insts[i + 1] != ip))
+      line("goto {};", label(ioffsetOf(ip)));
+  }
+  out << "}\n";
+}
+
+void Emitter::emitGlobalArea() {
+  size_t nglobals = byteFile.getGlobalAreaSize();
+  for (const auto &[offset, global] : codeInfo.sharedStringGlobals)
+    nglobals = std::max<size_t>(nglobals, global + 1);
+  // The collector finds the globals between these two symbols
+  out << "__asm__(\".pushsection .bss\\n\"\n"
+         "        \".balign 16\\n\"\n"
+         "        \".globl __start_custom_data\\n\"\n"
+         "        \"__start_custom_data:\\n\"\n";
+  if (nglobals > 0)
+    out << fmt::format("        \".zero {}\\n\"\n", nglobals * sizeof(Value));
+  out << "        \".globl __stop_custom_data\\n\"\n"
+         "        \"__stop_custom_data:\\n\"\n"
+         "        \".popsection\");\n";
+}
+
+void Emitter::emitStringTable() {
+  out << "\nstatic const char lama_strings[] __attribute__((unused)) =\n"
+         "    \"";
+  const char *table = byteFile.getStringTable();
+  for (size_t i = 0; i < byteFile.getStringTableSize(); ++i) {
+    unsigned char c = table[i];
+    if (i > 0 && i % 64 == 0)
+      out << "\"\n    \"";
+    if (c == '"' || c == '\\' || c == '?')
+      out << '\\' << c;
+    else if (c >= ' ' && c < 0x7f)
+      out << c;
+    else
+      out << fmt::format("\\{:03o}", c);
+  }
+  out << "\";\n";
+}
+
+void Emitter::emit() {
+  if (codeInfo.functionIndex[0] == InvalidFunctionIndex) {
+    runtimeError("no function to start from at {:#x}", 0);
+  }
+  out << "/* Generated by rapidlama --emit-c */\n";
+  out << "#define _GNU_SOURCE 1\n";
+  out << fmt::format("#define LAMA_STACK_SIZE {}\n", STACK_SIZE);
+  out << fmt::format("#define LAMA_STACK_GUARD_SIZE {}\n", STACK_GUARD_SIZE);
+  out << fmt::format("#define LAMA_NATIVE_STACK_SIZE {}\n", NativeStackSize);
+  out << fmt::format("#define LAMA_NATIVE_STACK_GUARD_SIZE {}\n",
+                     NativeStackGuardSize);
+  out << prelude << '\n';
+  emitGlobalArea();
+  emitStringTable();
+  out << '\n';
+  for (const FunctionInfo &function : codeInfo.functions)
+    out << fmt::format("static Value {}(void);\n",
+                       functionName(ioffsetOf(function.beginIp)));
+  int32_t nfunctions = codeInfo.functions.size();
+  for (functionIndex = 0; functionIndex < nfunctions; ++functionIndex)
+    emitFunction(codeInfo.functions[functionIndex]);
+  const FunctionInfo &main = codeInfo.functions[codeInfo.functionIndex[0]];
+  out << fmt::format("\nint main(void) {{ return lama_start({}, {}); }}\n",
+                     functionName(0), main.nargs);
+}
+
+void lama::emitC(const ByteFile &byteFile, const CodeInfo &codeInfo,
+                 std::ostream &out) {
+  Emitter emitter(byteFile, codeInfo, out);
+  emitter.emit();
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <iosfwd>
+
+namespace lama {
+
+class ByteFile;
+struct CodeInfo;
+
+/// Translates a verified bytefile ahead of time into a C program, to be
+/// compiled and linked against runtime/runtime.o and runtime/gc.o.
+///
+/// Each function becomes a C function and calls become C calls. A tail call
+/// to itself jumps back to the start, any other returns to a trampoline in
+/// the caller's lama_call() that makes it. Operands are kept in C locals, one per operand stack slot
+/// known from the verifier. The Lama stack stays the shadow stack the GC
+/// scans: it holds the arguments and the locals, and the operands are
+/// spilled into their slots below the locals, the way the JIT keeps them,
+/// before anything that may allocate or call, and reloaded after it.
+void emitC(const ByteFile &byteFile, const CodeInfo &codeInfo,
+           std::ostream &out);
+
+} // namespace lama
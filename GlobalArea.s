@@ -6,3 +6,5 @@
 .align 1024
 __start_custom_data: .fill 1024 * 1024
 __stop_custom_data:
+
+    .section .note.GNU-stack,"",@progbits
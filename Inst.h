@@ -62,6 +62,8 @@ enum InstCode {
   I_ARRAY = 0x58,
   I_FAIL = 0x59,
   I_LINE = 0x5a,
+  /// Not produced by lamac, see lama::optimize
+  I_TAGSWITCH = 0x5b,
 
   I_PATT_StrCmp = 0x60,
   I_PATT_String = 0x61,
@@ -3,7 +3,12 @@
 namespace lama {
 
 class ByteFile;
+class OpcodeProfile;
+struct CodeInfo;
 
-void interpret(ByteFile &byteFile);
+/// Interprets the verified bytefile directly, recording executed opcodes
+/// into \p profile if given
+void interpret(ByteFile &byteFile, const CodeInfo &codeInfo,
+               OpcodeProfile *profile = nullptr);
 
 } // namespace lama
@@ -0,0 +1,998 @@
+#include "Jit.h"
+#include "ByteFile.h"
+#include "Error.h"
+#include "Inst.h"
+#include "Runtime.h"
+#include "Stack.h"
+#include "Value.h"
+#include "Verifier.h"
+#include "X86Assembler.h"
+#include <algorithm>
+#include <csetjmp>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unordered_map>
+
+using namespace lama;
+
+enum JitErrorKind : int32_t {
+  JE_NotInt,
+  JE_DivisionByZero,
+  JE_StackExhausted,
+  JE_NativeStackExhausted,
+};
+
+/// Compiled code has no unwind information, so errors raised from it leave
+/// through a longjmp back into run()
+static jmp_buf errorJmpBuf;
+static std::string errorMessage;
+
+/// Calls are not allowed below this native stack address
+static const char *nativeStackLimit;
+static constexpr size_t NATIVE_STACK_RESERVE = 1 << 18;
+
+static std::string describeError(int32_t kind, Value value) {
+  switch (kind) {
+  case JE_NotInt:
+    return fmt::format(
+        "expected a (boxed) number at the operand stack top, found {:#x}",
+        value);
+  case JE_DivisionByZero:
+    return "division by zero";
+  case JE_StackExhausted:
+    return "might exhaust stack";
+  case JE_NativeStackExhausted:
+    return "stack exhausted";
+  }
+  return "unknown error";
+}
+
+[[noreturn]] static void raiseError(int32_t kind, int32_t ioffset,
+                                    Value value) {
+  errorMessage = fmt::format("runtime error at {:#x}: {}", ioffset,
+                             describeError(kind, value));
+  longjmp(errorJmpBuf, 1);
+}
+
+/// The operand stack top is synced before the call
+static Value createSexpHelper(Value tagHash, int32_t nargs) {
+  return createSexp(tagHash, nargs);
+}
+
+static Value createSharedStringHelper(Value *cache, const char *string) {
+  return createSharedString(*cache, string);
+}
+
+/// The operand stack top is synced before the call
+static Value createArrayHelper(int32_t nargs) { return createArray(nargs); }
+
+/// The operand stack top is synced before the call
+static Value createClosureHelper(const void *entry, int32_t nvars) {
+  return createClosure(entry, nvars);
+}
+
+template <typename F> static const void *helper(F *function) {
+  return reinterpret_cast<const void *>(function);
+}
+
+namespace {
+
+class Compiler {
+public:
+  Compiler(ByteFile &byteFile, const CodeInfo &codeInfo);
+
+  JitCode compile();
+
+private:
+  /// Collects the instructions reachable from the function BEGIN, together
+  /// with those the verifier has recorded in other functions
+  void collectInsts(const FunctionInfo &function);
+  /// \return the instruction following #ip
+  const uint8_t *skipInst(std::vector<const uint8_t *> &jumpTargets,
+                          bool &fallsThrough, int32_t &npushed);
+
+  void compileFunction(const FunctionInfo &function);
+  /// \pre #ip points to a reachable instruction
+  /// \post #ip points right after the instruction
+  /// \return whether control may fall through to the next instruction
+  bool compileInst();
+  void compilePrologue();
+  /// \param isTail whether the epilogue leaves the function by a jump
+  /// instead of returning
+  void compileEpilogue(bool isTail = false);
+  /// Moves \p noperands topmost operands in place of the arguments of the
+  /// current function and leaves it, so that the function entered next
+  /// returns to its caller
+  void compileTailCall(int32_t depth, int32_t noperands);
+  void compileErrorStubs();
+  void resolveJumps();
+
+  /// Operands live right below the locals
+  int32_t slotDisp(int32_t depth) const { return -4 * (nlocals + 1 + depth); }
+  void loadSlot(X86Reg reg, int32_t depth);
+  void storeSlot(int32_t depth, X86Reg reg);
+  /// Makes the stack top visible to the GC and the runtime
+  void syncTop(int32_t depth);
+
+  void loadVar(X86Reg reg, uint8_t designation, int32_t index);
+  void storeVar(uint8_t designation, int32_t index, X86Reg reg);
+  void loadVarAddress(X86Reg reg, uint8_t designation, int32_t index);
+
+  void argSlot(int i, int32_t depth);
+  void argReg(int i, X86Reg reg);
+  void argImm(int i, int32_t imm);
+  void argPointer(int i, const void *pointer);
+  void argEntry(int i, int32_t beginOffset);
+  void callHelper(const void *function);
+
+  void jumpTo(size_t position, int32_t targetOffset);
+  void jumpToError(X86Cond cond, JitErrorKind kind, X86Reg valueReg = EAX);
+  void checkInt(X86Reg reg);
+  /// Checks both operands of a binary operation with a single branch on
+  /// the fast path, clobbers EDX
+  void checkInts(X86Reg lhs, X86Reg rhs);
+  void boxFlag(X86Cond cond);
+
+  uint8_t readByte();
+  int32_t readWord();
+
+  int32_t ioffsetOf(const uint8_t *ip) const {
+    return ip - byteFile.getCode();
+  }
+  /// Such a function can only fail on entry
+  bool isFrameTooLarge() const {
+    return static_cast<int64_t>(nlocals) + maxDepth >= STACK_SIZE;
+  }
+  int32_t depthAt(int32_t ioffset) const {
+    return codeInfo.instInfo[ioffset].operandStackSize;
+  }
+
+private:
+  ByteFile &byteFile;
+  const CodeInfo &codeInfo;
+  X86Assembler as;
+
+  /// Native offset of each function entry, by its bytecode offset
+  std::unordered_map<int32_t, size_t> entries;
+
+  struct Fixup {
+    size_t position;
+    int32_t targetOffset;
+  };
+  /// rel32 of calls and tail jumps to function entries
+  std::vector<Fixup> calls;
+  /// imm32 of absolute function entries
+  std::vector<Fixup> entryRelocs;
+  /// rel32 of direct calls to runtime helpers, 32-bit only
+  std::vector<std::pair<size_t, const void *>> helperRelocs;
+
+  /// Of the current function
+  struct ErrorStub {
+    size_t position;
+    JitErrorKind kind;
+    int32_t ioffset;
+    X86Reg valueReg;
+  };
+  std::vector<const uint8_t *> insts;
+  std::vector<Fixup> jumps;
+  std::vector<ErrorStub> errorStubs;
+  /// Native offset of each instruction of the current function
+  std::vector<int32_t> labels;
+  /// Index of the last function the instruction was collected for
+  std::vector<int32_t> collectedBy;
+  int32_t functionIndex = -1;
+  int32_t nargs;
+  int32_t nlocals;
+  int32_t nprefilledLocals;
+  bool isClosure;
+  int32_t maxDepth;
+
+  const uint8_t *ip;
+  int32_t currentInstOffset;
+};
+
+} // namespace
+
+Compiler::Compiler(ByteFile &byteFile, const CodeInfo &codeInfo)
+    : byteFile(byteFile), codeInfo(codeInfo),
+      labels(byteFile.getCodeSizeBytes(), -1),
+      collectedBy(byteFile.getCodeSizeBytes(), -1) {}
+
+uint8_t Compiler::readByte() { return *ip++; }
+
+int32_t Compiler::readWord() {
+  int32_t word;
+  memcpy(&word, ip, sizeof(int32_t));
+  ip += sizeof(int32_t);
+  return word;
+}
+
+const uint8_t *Compiler::skipInst(std::vector<const uint8_t *> &jumpTargets,
+                                  bool &fallsThrough, int32_t &npushed) {
+  jumpTargets.clear();
+  fallsThrough = true;
+  npushed = 1;
+  uint8_t byte = readByte();
+  switch (byte) {
+  case I_CONST:
+  case I_STRING:
+  case I_LD_Global:
+  case I_LD_Local:
+  case I_LD_Arg:
+  case I_LD_Access:
+  case I_ST_Global:
+  case I_ST_Local:
+  case I_ST_Arg:
+  case I_ST_Access:
+  case I_CALLC:
+  case I_ARRAY:
+  case I_LINE:
+  case I_CALL_Barray:
+    readWord();
+    break;
+  case I_LDA_Global:
+  case I_LDA_Local:
+  case I_LDA_Arg:
+  case I_LDA_Access:
+    readWord();
+    npushed = 2;
+    break;
+  case I_SEXP:
+  case I_BEGIN:
+  case I_BEGINcl:
+  case I_CALL:
+  case I_TAG:
+    readWord();
+    readWord();
+    break;
+  case I_JMP:
+    jumpTargets.push_back(byteFile.getCode() + readWord());
+    fallsThrough = false;
+    break;
+  case I_CJMPz:
+  case I_CJMPnz:
+    jumpTargets.push_back(byteFile.getCode() + readWord());
+    break;
+  case I_TAGSWITCH: {
+    int32_t narms = readWord();
+    jumpTargets.push_back(byteFile.getCode() + readWord());
+    for (int32_t i = 0; i < narms; ++i) {
+      readWord();
+      readWord();
+      jumpTargets.push_back(byteFile.getCode() + readWord());
+    }
+    fallsThrough = false;
+    break;
+  }
+  case I_END:
+    fallsThrough = false;
+    break;
+  case I_FAIL:
+    readWord();
+    readWord();
+    fallsThrough = false;
+    break;
+  case I_CLOSURE: {
+    readWord();
+    int32_t n = readWord();
+    ip += n * (1 + sizeof(int32_t));
+    npushed = std::max(n, 1);
+    break;
+  }
+  }
+  return ip;
+}
+
+void Compiler::collectInsts(const FunctionInfo &function) {
+  insts.clear();
+  maxDepth = 0;
+  std::vector<const uint8_t *> stack{function.beginIp};
+  collectedBy[ioffsetOf(function.beginIp)] = functionIndex;
+  std::vector<const uint8_t *> successors;
+  while (!stack.empty()) {
+    ip = stack.back();
+    stack.pop_back();
+    insts.push_back(ip);
+    int32_t depth = depthAt(ioffsetOf(ip));
+    bool fallsThrough;
+    int32_t npushed;
+    const uint8_t *next = skipInst(successors, fallsThrough, npushed);
+    maxDepth = std::max(maxDepth, depth + npushed);
+    if (fallsThrough)
+      successors.push_back(next);
+    for (const uint8_t *successor : successors) {
+      if (collectedBy[ioffsetOf(successor)] == functionIndex)
+        continue;
+      collectedBy[ioffsetOf(successor)] = functionIndex;
+      stack.push_back(successor);
+    }
+  }
+  std::sort(insts.begin(), insts.end());
+}
+
+void Compiler::loadSlot(X86Reg reg, int32_t depth) {
+  as.movLoad(reg, EBX, slotDisp(depth));
+}
+
+void Compiler::storeSlot(int32_t depth, X86Reg reg) {
+  as.movStore(EBX, slotDisp(depth), reg);
+}
+
+void Compiler::syncTop(int32_t depth) {
+  as.lea(EAX, EBX, slotDisp(depth));
+  as.movStoreAbs(&__gc_stack_top, EAX);
+}
+
+void Compiler::loadVar(X86Reg reg, uint8_t designation, int32_t index) {
+  switch (designation) {
+  case LOC_Global:
+    as.movLoadAbs(reg, &accessGlobal(index));
+    return;
+  case LOC_Local:
+    as.movLoad(reg, EBX, -4 * (index + 1));
+    return;
+  case LOC_Arg:
+    as.movLoad(reg, EBX, 4 * (nargs - 1 - index));
+    return;
+  case LOC_Access:
+    as.movLoad(reg, EBX, 4 * nargs);
+    as.movLoad(reg, reg, 4 * (index + 1));
+    return;
+  }
+}
+
+void Compiler::storeVar(uint8_t designation, int32_t index, X86Reg reg) {
+  switch (designation) {
+  case LOC_Global:
+    as.movStoreAbs(&accessGlobal(index), reg);
+    return;
+  case LOC_Local:
+    as.movStore(EBX, -4 * (index + 1), reg);
+    return;
+  case LOC_Arg:
+    as.movStore(EBX, 4 * (nargs - 1 - index), reg);
+    return;
+  case LOC_Access:
+    as.movLoad(ECX, EBX, 4 * nargs);
+    as.movStore(ECX, 4 * (index + 1), reg);
+    return;
+  }
+}
+
+void Compiler::loadVarAddress(X86Reg reg, uint8_t designation,
+                              int32_t index) {
+  switch (designation) {
+  case LOC_Global:
+    as.movImm(reg, static_cast<Value>(
+                       reinterpret_cast<uintptr_t>(&accessGlobal(index))));
+    return;
+  case LOC_Local:
+    as.lea(reg, EBX, -4 * (index + 1));
+    return;
+  case LOC_Arg:
+    as.lea(reg, EBX, 4 * (nargs - 1 - index));
+    return;
+  case LOC_Access:
+    as.movLoad(reg, EBX, 4 * nargs);
+    as.lea(reg, reg, 4 * (index + 1));
+    return;
+  }
+}
+
+void Compiler::argSlot(int i, int32_t depth) {
+  loadSlot(EAX, depth);
+  as.movStore(ESP, 4 * i, EAX);
+}
+
+void Compiler::argReg(int i, X86Reg reg) { as.movStore(ESP, 4 * i, reg); }
+
+void Compiler::argImm(int i, int32_t imm) { as.movStoreImm(ESP, 4 * i, imm); }
+
+void Compiler::argPointer(int i, const void *pointer) {
+  as.movStoreImm(ESP, 4 * i,
+                 static_cast<int32_t>(reinterpret_cast<uintptr_t>(pointer)));
+}
+
+void Compiler::argEntry(int i, int32_t beginOffset) {
+  as.movStoreImm(ESP, 4 * i, 0);
+  entryRelocs.push_back({as.size() - sizeof(int32_t), beginOffset});
+}
+
+void Compiler::callHelper(const void *function) {
+  helperRelocs.emplace_back(as.call(), function);
+}
+
+void Compiler::jumpTo(size_t position, int32_t targetOffset) {
+  jumps.push_back({position, targetOffset});
+}
+
+void Compiler::jumpToError(X86Cond cond, JitErrorKind kind, X86Reg valueReg) {
+  errorStubs.push_back({as.jcc(cond), kind, currentInstOffset, valueReg});
+}
+
+void Compiler::checkInt(X86Reg reg) {
+  as.testImm8(reg, 1);
+  jumpToError(CC_E, JE_NotInt, reg);
+}
+
+void Compiler::checkInts(X86Reg lhs, X86Reg rhs) {
+  as.mov(EDX, lhs);
+  as.alu(ALU_And, EDX, rhs);
+  as.testImm8(EDX, 1);
+  size_t bothInts = as.jcc(CC_NE);
+  // Find out which one to report
+  checkInt(rhs);
+  checkInt(lhs);
+  as.patchRel32(bothInts, as.size());
+}
+
+void Compiler::boxFlag(X86Cond cond) {
+  as.setcc(cond, EAX);
+  as.movzx8(EAX, EAX);
+  as.lea(EAX, EAX, EAX, 1);
+}
+
+void Compiler::compilePrologue() {
+  as.push(EBX);
+  // Keep the native stack 16-byte aligned with room for helper arguments
+  as.subImm(ESP, 24);
+
+  as.movPtrImm(ECX, &nativeStackLimit);
+  as.cmpLoad(ESP, ECX, 0);
+  jumpToError(CC_B, JE_NativeStackExhausted);
+
+  as.movLoadAbs(EBX, &__gc_stack_top);
+  as.addImm(EBX, sizeof(Value));
+
+  if (isFrameTooLarge()) {
+    errorStubs.push_back(
+        {as.jmp(), JE_StackExhausted, currentInstOffset, EAX});
+    return;
+  }
+  int32_t needed = nlocals + maxDepth;
+  if (Stack::needsRoomCheck(nlocals, maxDepth)) {
+    as.lea(EAX, EBX, -4 * needed);
+    as.movPtrImm(ECX, Stack::limit());
+    as.alu(ALU_Cmp, EAX, ECX);
+    jumpToError(CC_B, JE_StackExhausted);
+  } else if (needed > 0) {
+    // Native frames leave no record on the stack, so touch the lowest
+    // slot, an overflow then faults in the guard area instead of
+    // skipping it
+    as.movStoreImm(EBX, -4 * needed, boxInt(0));
+  }
+
+  // Fill with some boxed values so that GC will skip these, the rest of
+  // the locals is assigned before anything may see it
+  if (nprefilledLocals <= 8) {
+    for (int32_t i = 0; i < nprefilledLocals; ++i)
+      as.movStoreImm(EBX, -4 * (i + 1), boxInt(0));
+    return;
+  }
+  as.movImm(ECX, nprefilledLocals);
+  size_t loop = as.size();
+  as.movStoreImmIndexed(EBX, ECX, -4 * (nprefilledLocals + 1), boxInt(0));
+  as.dec(ECX);
+  as.patchRel32(as.jcc(CC_NE), loop);
+}
+
+void Compiler::compileEpilogue(bool isTail) {
+  as.addImm(ESP, 24);
+  as.pop(EBX);
+  if (!isTail)
+    as.ret();
+}
+
+void Compiler::compileTailCall(int32_t depth, int32_t noperands) {
+  int32_t newBaseDisp = 4 * (nargs + isClosure - noperands);
+  // Moving up, the highest first does not overwrite unmoved ones
+  for (int32_t i = noperands - 1; i >= 0; --i) {
+    loadSlot(EAX, depth - 1 - i);
+    as.movStore(EBX, newBaseDisp + 4 * i, EAX);
+  }
+  as.lea(EAX, EBX, newBaseDisp - 4);
+  as.movStoreAbs(&__gc_stack_top, EAX);
+  compileEpilogue(true);
+}
+
+bool Compiler::compileInst() {
+  currentInstOffset = ioffsetOf(ip);
+  labels[currentInstOffset] = as.size();
+  int32_t depth = depthAt(currentInstOffset);
+  uint8_t byte = readByte();
+  uint8_t low = 0x0F & byte;
+  switch (byte) {
+  case I_BINOP_Eq: {
+    loadSlot(EAX, depth - 2);
+    loadSlot(ECX, depth - 1);
+    as.alu(ALU_Cmp, EAX, ECX);
+    boxFlag(CC_E);
+    storeSlot(depth - 2, EAX);
+    return true;
+  }
+  case I_BINOP_Add:
+  case I_BINOP_Sub:
+  case I_BINOP_Mul:
+  case I_BINOP_Div:
+  case I_BINOP_Mod:
+  case I_BINOP_Lt:
+  case I_BINOP_Leq:
+  case I_BINOP_Gt:
+  case I_BINOP_Geq:
+  case I_BINOP_Neq:
+  case I_BINOP_And:
+  case I_BINOP_Or: {
+    loadSlot(EAX, depth - 2);
+    loadSlot(ECX, depth - 1);
+    if (!codeInfo.instInfo[currentInstOffset].hasIntOperands())
+      checkInts(EAX, ECX);
+    // Most operations are done on boxed operands directly
+    switch (byte) {
+    case I_BINOP_Add:
+      as.lea(EAX, EAX, ECX, -1);
+      break;
+    case I_BINOP_Sub:
+      as.alu(ALU_Sub, EAX, ECX);
+      as.inc(EAX);
+      break;
+    case I_BINOP_Mul:
+      as.dec(EAX);
+      as.sar1(ECX);
+      as.imul(EAX, ECX);
+      as.inc(EAX);
+      break;
+    case I_BINOP_Div:
+    case I_BINOP_Mod: {
+      as.sar1(EAX);
+      as.sar1(ECX);
+      as.cmpImm(ECX, 0);
+      jumpToError(CC_E, JE_DivisionByZero);
+      as.cdq();
+      as.idiv(ECX);
+      X86Reg result = byte == I_BINOP_Div ? EAX : EDX;
+      as.lea(EAX, result, result, 1);
+      break;
+    }
+    case I_BINOP_Lt:
+      as.alu(ALU_Cmp, EAX, ECX);
+      boxFlag(CC_L);
+      break;
+    case I_BINOP_Leq:
+      as.alu(ALU_Cmp, EAX, ECX);
+      boxFlag(CC_LE);
+      break;
+    case I_BINOP_Gt:
+      as.alu(ALU_Cmp, EAX, ECX);
+      boxFlag(CC_G);
+      break;
+    case I_BINOP_Geq:
+      as.alu(ALU_Cmp, EAX, ECX);
+      boxFlag(CC_GE);
+      break;
+    case I_BINOP_Neq:
+      as.alu(ALU_Cmp, EAX, ECX);
+      boxFlag(CC_NE);
+      break;
+    case I_BINOP_And:
+    case I_BINOP_Or:
+      as.cmpImm(EAX, boxInt(0));
+      as.setcc(CC_NE, EAX);
+      as.cmpImm(ECX, boxInt(0));
+      as.setcc(CC_NE, ECX);
+      as.alu(byte == I_BINOP_And ? ALU_And : ALU_Or, EAX, ECX);
+      as.movzx8(EAX, EAX);
+      as.lea(EAX, EAX, EAX, 1);
+      break;
+    }
+    storeSlot(depth - 2, EAX);
+    return true;
+  }
+  case I_CONST: {
+    as.movStoreImm(EBX, slotDisp(depth), boxInt(readWord()));
+    return true;
+  }
+  case I_STRING: {
+    int32_t offset = readWord();
+    const char *string = byteFile.getStringTable() + offset;
+    syncTop(depth);
+    if (codeInfo.instInfo[currentInstOffset].isSharedString()) {
+      argPointer(0, &accessGlobal(codeInfo.sharedStringGlobals.at(offset)));
+      argPointer(1, string);
+      callHelper(helper(createSharedStringHelper));
+    } else {
+      argPointer(0, string);
+      callHelper(helper(Bstring));
+    }
+    storeSlot(depth, EAX);
+    return true;
+  }
+  case I_SEXP: {
+    readWord();
+    int32_t nargs = readWord();
+    syncTop(depth);
+    argImm(0, codeInfo.tagHashes.at(currentInstOffset));
+    argImm(1, nargs);
+    callHelper(helper(createSexpHelper));
+    storeSlot(depth - nargs, EAX);
+    return true;
+  }
+  case I_STA: {
+    argSlot(0, depth - 1);
+    argSlot(1, depth - 2);
+    argSlot(2, depth - 3);
+    callHelper(helper(Bsta));
+    storeSlot(depth - 3, EAX);
+    return true;
+  }
+  case I_JMP: {
+    jumpTo(as.jmp(), readWord());
+    return false;
+  }
+  case I_END: {
+    loadSlot(EAX, depth - 1);
+    compileEpilogue();
+    return false;
+  }
+  case I_DROP: {
+    return true;
+  }
+  case I_DUP: {
+    loadSlot(EAX, depth - 1);
+    storeSlot(depth, EAX);
+    return true;
+  }
+  case I_SWAP: {
+    loadSlot(EAX, depth - 1);
+    loadSlot(ECX, depth - 2);
+    storeSlot(depth - 2, EAX);
+    storeSlot(depth - 1, ECX);
+    return true;
+  }
+  case I_ELEM: {
+    argSlot(0, depth - 2);
+    argSlot(1, depth - 1);
+    if (codeInfo.instInfo[currentInstOffset].hasIntOperands())
+      callHelper(helper(elementAtIntIndex));
+    else
+      callHelper(helper(Belem));
+    storeSlot(depth - 2, EAX);
+    return true;
+  }
+  case I_LD_Global:
+  case I_LD_Local:
+  case I_LD_Arg:
+  case I_LD_Access: {
+    loadVar(EAX, low, readWord());
+    storeSlot(depth, EAX);
+    return true;
+  }
+  case I_LDA_Global:
+  case I_LDA_Local:
+  case I_LDA_Arg:
+  case I_LDA_Access: {
+    loadVarAddress(EAX, low, readWord());
+    storeSlot(depth, EAX);
+    storeSlot(depth + 1, EAX);
+    return true;
+  }
+  case I_ST_Global:
+  case I_ST_Local:
+  case I_ST_Arg:
+  case I_ST_Access: {
+    int32_t index = readWord();
+    loadSlot(EAX, depth - 1);
+    storeVar(low, index, EAX);
+    return true;
+  }
+  case I_CJMPz:
+  case I_CJMPnz: {
+    int32_t target = readWord();
+    loadSlot(EAX, depth - 1);
+    if (!codeInfo.instInfo[currentInstOffset].hasIntOperands())
+      checkInt(EAX);
+    as.cmpImm(EAX, boxInt(0));
+    jumpTo(as.jcc(byte == I_CJMPz ? CC_E : CC_NE), target);
+    return true;
+  }
+  case I_BEGIN:
+  case I_BEGINcl: {
+    // Arguments and locals are already known from compileFunction
+    readWord();
+    readWord();
+    compilePrologue();
+    return true;
+  }
+  case I_CLOSURE: {
+    int32_t target = readWord();
+    int32_t n = readWord();
+    for (int i = 0; i < n; ++i) {
+      uint8_t designation = readByte();
+      int32_t index = readWord();
+      loadVar(EAX, designation, index);
+      storeSlot(depth + n - 1 - i, EAX);
+    }
+    syncTop(depth + n);
+    argEntry(0, target);
+    argImm(1, n);
+    callHelper(helper(createClosureHelper));
+    storeSlot(depth, EAX);
+    return true;
+  }
+  case I_CALLC: {
+    int32_t nargs = readWord();
+    if (codeInfo.instInfo[currentInstOffset].isTailCall()) {
+      loadSlot(EDX, depth - nargs - 1);
+      as.movLoad(EDX, EDX, 0);
+      compileTailCall(depth, nargs + 1);
+      as.jmpReg(EDX);
+      return false;
+    }
+    syncTop(depth);
+    loadSlot(EAX, depth - nargs - 1);
+    as.movLoad(EAX, EAX, 0);
+    as.callReg(EAX);
+    storeSlot(depth - nargs - 1, EAX);
+    return true;
+  }
+  case I_CALL: {
+    int32_t target = readWord();
+    int32_t nargs = readWord();
+    if (codeInfo.instInfo[currentInstOffset].isTailCall()) {
+      compileTailCall(depth, nargs);
+      calls.push_back({as.jmp(), target});
+      return false;
+    }
+    syncTop(depth);
+    calls.push_back({as.call(), target});
+    storeSlot(depth - nargs, EAX);
+    return true;
+  }
+  case I_TAG: {
+    readWord();
+    int32_t nargs = readWord();
+    argSlot(0, depth - 1);
+    argImm(1, codeInfo.tagHashes.at(currentInstOffset));
+    argImm(2, boxInt(nargs));
+    callHelper(helper(Btag));
+    storeSlot(depth - 1, EAX);
+    return true;
+  }
+  case I_ARRAY: {
+    int32_t nelems = readWord();
+    argSlot(0, depth - 1);
+    argImm(1, boxInt(nelems));
+    callHelper(helper(Barray_patt));
+    storeSlot(depth - 1, EAX);
+    return true;
+  }
+  case I_FAIL: {
+    int32_t line = readWord();
+    int32_t col = readWord();
+    argSlot(0, depth - 1);
+    argPointer(1, unknownFile);
+    argImm(2, line);
+    argImm(3, col);
+    callHelper(helper(Bmatch_failure));
+    return false;
+  }
+  case I_LINE: {
+    readWord();
+    return true;
+  }
+  case I_TAGSWITCH: {
+    int32_t narms = readWord();
+    int32_t defaultTarget = readWord();
+    loadSlot(EAX, depth - 1);
+    as.testImm8(EAX, 1);
+    jumpTo(as.jcc(CC_NE), defaultTarget);
+    // The header of a sexp is its field count and SEXP_TAG, so it is
+    // compared whole
+    as.movLoad(ECX, EAX, -static_cast<int32_t>(DATA_HEADER_SZ));
+    for (int32_t i = 0; i < narms; ++i) {
+      int32_t tagHash = codeInfo.tagHashes.at(ioffsetOf(ip));
+      readWord();
+      int32_t nfields = readWord();
+      int32_t target = readWord();
+      if (nfields > (INT32_MAX >> 3))
+        continue;
+      as.cmpImm(ECX, (nfields << 3) | SEXP_TAG);
+      size_t otherShape = as.jcc(CC_NE);
+      as.movLoad(EDX, EAX, offsetof(sexp, tag) - DATA_HEADER_SZ);
+      as.cmpImm(EDX, unboxInt(tagHash));
+      jumpTo(as.jcc(CC_E), target);
+      as.patchRel32(otherShape, as.size());
+    }
+    jumpTo(as.jmp(), defaultTarget);
+    return false;
+  }
+  case I_PATT_StrCmp: {
+    argSlot(0, depth - 1);
+    argSlot(1, depth - 2);
+    callHelper(helper(Bstring_patt));
+    storeSlot(depth - 2, EAX);
+    return true;
+  }
+  case I_PATT_String:
+  case I_PATT_Array:
+  case I_PATT_Sexp:
+  case I_PATT_Boxed:
+  case I_PATT_UnBoxed:
+  case I_PATT_Closure: {
+    static const void *const functions[] = {
+        helper(Bstring_tag_patt), helper(Barray_tag_patt),
+        helper(Bsexp_tag_patt),   helper(Bboxed_patt),
+        helper(Bunboxed_patt),    helper(Bclosure_tag_patt),
+    };
+    argSlot(0, depth - 1);
+    callHelper(functions[byte - I_PATT_String]);
+    storeSlot(depth - 1, EAX);
+    return true;
+  }
+  case I_CALL_Lread: {
+    callHelper(helper(Lread));
+    storeSlot(depth, EAX);
+    return true;
+  }
+  case I_CALL_Lwrite: {
+    argSlot(0, depth - 1);
+    callHelper(helper(Lwrite));
+    as.movStoreImm(EBX, slotDisp(depth - 1), boxInt(0));
+    return true;
+  }
+  case I_CALL_Llength: {
+    argSlot(0, depth - 1);
+    callHelper(helper(Llength));
+    storeSlot(depth - 1, EAX);
+    return true;
+  }
+  case I_CALL_Lstring: {
+    syncTop(depth);
+    argSlot(0, depth - 1);
+    callHelper(helper(Lstring));
+    storeSlot(depth - 1, EAX);
+    return true;
+  }
+  case I_CALL_Barray: {
+    int32_t nargs = readWord();
+    syncTop(depth);
+    argImm(0, nargs);
+    callHelper(helper(createArrayHelper));
+    storeSlot(depth - nargs, EAX);
+    return true;
+  }
+  }
+  runtimeError("unsupported instruction code {:#04x} at {:#x}", byte,
+               currentInstOffset);
+}
+
+void Compiler::compileErrorStubs() {
+  for (const ErrorStub &stub : errorStubs) {
+    as.patchRel32(stub.position, as.size());
+    argReg(2, stub.valueReg);
+    argImm(1, byteFile.sourceOffsetOf(stub.ioffset));
+    argImm(0, stub.kind);
+    callHelper(helper(raiseError));
+  }
+  errorStubs.clear();
+}
+
+void Compiler::resolveJumps() {
+  for (const Fixup &jump : jumps)
+    as.patchRel32(jump.position, labels[jump.targetOffset]);
+  jumps.clear();
+}
+
+void Compiler::compileFunction(const FunctionInfo &function) {
+  nargs = function.nargs;
+  nlocals = function.nlocals;
+  nprefilledLocals = function.nprefilledLocals;
+  isClosure = function.isClosure();
+  collectInsts(function);
+
+  entries[ioffsetOf(function.beginIp)] = as.size();
+  for (size_t i = 0; i < insts.size(); ++i) {
+    ip = insts[i];
+    bool fallsThrough = compileInst();
+    if (isFrameTooLarge())
+      break;
+    if (fallsThrough && (i + 1 == insts.size() || insts[i + 1] != ip))
+      jumpTo(as.jmp(), ioffsetOf(ip));
+  }
+  resolveJumps();
+  compileErrorStubs();
+  for (const uint8_t *inst : insts)
+    labels[ioffsetOf(inst)] = -1;
+}
+
+JitCode Compiler::compile() {
+  int32_t nfunctions = codeInfo.functions.size();
+  for (functionIndex = 0; functionIndex < nfunctions; ++functionIndex)
+    compileFunction(codeInfo.functions[functionIndex]);
+  auto entry = entries.find(0);
+  if (entry == entries.end()) {
+    runtimeError("no function to start from at {:#x}", 0);
+  }
+  for (const Fixup &call : calls)
+    as.patchRel32(call.position, entries.at(call.targetOffset));
+
+  const std::vector<uint8_t> &code = as.getCode();
+  void *memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    runtimeError("failed to allocate {} bytes of executable memory",
+                 code.size());
+  }
+  uint8_t *base = static_cast<uint8_t *>(memory);
+  memcpy(base, code.data(), code.size());
+  for (const Fixup &reloc : entryRelocs) {
+    int32_t address = static_cast<int32_t>(
+        reinterpret_cast<uintptr_t>(base + entries.at(reloc.targetOffset)));
+    memcpy(base + reloc.position, &address, sizeof(address));
+  }
+  for (const auto &[position, function] : helperRelocs) {
+    int32_t rel = static_cast<int32_t>(
+        reinterpret_cast<uintptr_t>(function) -
+        reinterpret_cast<uintptr_t>(base + position + sizeof(int32_t)));
+    memcpy(base + position, &rel, sizeof(rel));
+  }
+  if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, code.size());
+    runtimeError("failed to make the compiled code executable");
+  }
+  return JitCode(memory, code.size(), base + entry->second);
+}
+
+JitCode::JitCode(void *memory, size_t sizeBytes, const void *entry)
+    : memory(memory), sizeBytes(sizeBytes), entry(entry) {}
+
+JitCode::JitCode(JitCode &&other) noexcept
+    : memory(other.memory), sizeBytes(other.sizeBytes), entry(other.entry) {
+  other.memory = nullptr;
+}
+
+JitCode &JitCode::operator=(JitCode &&other) noexcept {
+  std::swap(memory, other.memory);
+  std::swap(sizeBytes, other.sizeBytes);
+  std::swap(entry, other.entry);
+  return *this;
+}
+
+JitCode::~JitCode() {
+  if (memory)
+    munmap(memory, sizeBytes);
+}
+
+JitCode lama::compile(ByteFile &byteFile, const CodeInfo &codeInfo) {
+  if (sizeof(void *) != sizeof(Value)) {
+    runtimeError("the JIT emits IA-32 code, it needs a 32-bit build");
+  }
+  Compiler compiler(byteFile, codeInfo);
+  return compiler.compile();
+}
+
+static void initNativeStackLimit() {
+  size_t size = 8 << 20;
+  rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    size = limit.rlim_cur;
+  const char *here = static_cast<const char *>(__builtin_frame_address(0));
+  nativeStackLimit = here - size + NATIVE_STACK_RESERVE;
+}
+
+void lama::run(const JitCode &code) {
+  initGlobalArea();
+  __gc_init();
+  if (sigsetjmp(Stack::overflowJmpBuf, 1)) {
+    runtimeError("runtime error: stack exhausted");
+  }
+  Stack::init();
+  initNativeStackLimit();
+  if (setjmp(errorJmpBuf)) {
+    throw std::runtime_error(errorMessage);
+  }
+  auto entry = reinterpret_cast<Value (*)()>(
+      const_cast<void *>(code.getEntry()));
+  entry();
+}
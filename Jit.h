@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+
+namespace lama {
+
+class ByteFile;
+struct CodeInfo;
+
+/// Verified bytecode compiled to native x86 code.
+class JitCode {
+public:
+  JitCode() = default;
+  JitCode(void *memory, size_t sizeBytes, const void *entry);
+  JitCode(JitCode &&other) noexcept;
+  JitCode &operator=(JitCode &&other) noexcept;
+  ~JitCode();
+
+  /// Native code of the function at bytecode offset 0
+  const void *getEntry() const { return entry; }
+
+private:
+  void *memory = nullptr;
+  size_t sizeBytes = 0;
+  const void *entry = nullptr;
+};
+
+/// Compiles all reachable functions of a verified bytefile.
+///
+/// Each bytecode instruction is expanded into a fixed template, operands
+/// are kept in the Lama stack at offsets known from the verifier.
+JitCode compile(ByteFile &byteFile, const CodeInfo &codeInfo);
+
+void run(const JitCode &code);
+
+} // namespace lama
@@ -1,35 +1,157 @@
 #include "ByteFile.h"
+#include "CEmitter.h"
 #include "Interpreter.h"
+#include "Jit.h"
+#include "Optimizer.h"
+#include "Profile.h"
+#include "ThreadedCode.h"
 #include "Verifier.h"
 #include "fmt/chrono.h"
 #include "fmt/format.h"
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <malloc.h>
 
 using namespace lama;
 
+/// Keeps the back-off of loops failing to trace from overflowing
+static constexpr long MaxHotLoopIterations = 1 << 20;
+
+enum class Engine {
+  Threaded,
+  Switch,
+  Jit,
+  Profile,
+  EmitC,
+};
+
+static void printUsage() {
+  std::cerr << "usage: rapidlama [--switch | --jit | --profile | --emit-c] "
+               "[--no-optimize] [--hot-loop-iterations N] <BYTECODE.bc>"
+            << std::endl;
+  std::cerr << "  --switch  use the switch-based interpreter instead of the "
+               "threaded one"
+            << std::endl;
+  std::cerr << "  --jit     compile the bytecode to native code" << std::endl;
+  std::cerr << "  --profile use the switch-based interpreter and print the "
+               "most frequent instruction sequences"
+            << std::endl;
+  std::cerr << "  --emit-c  print the bytecode translated into C, to be linked "
+               "against the runtime"
+            << std::endl;
+  std::cerr << "  --no-optimize run the bytecode as it is, without rewriting "
+               "it first"
+            << std::endl;
+  std::cerr << "  --hot-loop-iterations N trace loops of the threaded code "
+            << "after N iterations rather than " << HotLoopIterations
+            << ", up to " << MaxHotLoopIterations << std::endl;
+}
+
 int main(int argc, const char **argv) {
-  if (argc != 2) {
+  if (sizeof(void *) > sizeof(Value)) {
+    // Closures and frame records keep code addresses in values. Serve all
+    // allocations from the break, which is in the low 4 GiB of a non-PIE
+    // executable, rather than from mappings anywhere in the address space.
+    mallopt(M_MMAP_MAX, 0);
+  }
+  Engine engine = Engine::Threaded;
+  bool optimizing = true;
+  int32_t hotLoopIterations = HotLoopIterations;
+  const char *byteFilePathArg = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--switch") == 0) {
+      engine = Engine::Switch;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      engine = Engine::Jit;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      engine = Engine::Profile;
+    } else if (strcmp(argv[i], "--emit-c") == 0) {
+      engine = Engine::EmitC;
+    } else if (strcmp(argv[i], "--no-optimize") == 0) {
+      optimizing = false;
+    } else if (strcmp(argv[i], "--hot-loop-iterations") == 0 &&
+               i + 1 < argc) {
+      char *end;
+      long iterations = strtol(argv[++i], &end, 10);
+      if (*end || iterations < 1 || iterations > MaxHotLoopIterations) {
+        printUsage();
+        return 1;
+      }
+      hotLoopIterations = iterations;
+    } else if (argv[i][0] == '-' || byteFilePathArg) {
+      printUsage();
+      return 1;
+    } else {
+      byteFilePathArg = argv[i];
+    }
+  }
+  if (!byteFilePathArg) {
     std::cerr << "Please provide one argument: path to bytecode file"
               << std::endl;
+    printUsage();
     return 1;
   }
   auto startTime = std::chrono::steady_clock::now();
-  std::string byteFilePath = argv[1];
+  std::string byteFilePath = byteFilePathArg;
   try {
     ByteFile byteFile = ByteFile::load(byteFilePath);
-    verify(byteFile);
+    CodeInfo codeInfo = verify(byteFile);
+    if (optimizing) {
+      byteFile = optimize(byteFile, codeInfo);
+      codeInfo = verify(byteFile);
+    }
     std::cerr << "finished verification" << std::endl;
     auto verifiedTime = std::chrono::steady_clock::now();
     auto verificationDuration = verifiedTime - startTime;
-    interpret(byteFile);
+    auto translatedTime = verifiedTime;
+    switch (engine) {
+    case Engine::Threaded: {
+      ThreadedCode code = translate(byteFile, codeInfo, hotLoopIterations);
+      translatedTime = std::chrono::steady_clock::now();
+      interpret(code);
+      break;
+    }
+    case Engine::Switch: {
+      interpret(byteFile, codeInfo);
+      break;
+    }
+    case Engine::Jit: {
+      JitCode code = compile(byteFile, codeInfo);
+      translatedTime = std::chrono::steady_clock::now();
+      run(code);
+      break;
+    }
+    case Engine::Profile: {
+      OpcodeProfile profile;
+      interpret(byteFile, codeInfo, &profile);
+      profile.print(std::cerr, 20);
+      break;
+    }
+    case Engine::EmitC: {
+      emitC(byteFile, codeInfo, std::cout);
+      translatedTime = std::chrono::steady_clock::now();
+      break;
+    }
+    }
     auto finishedTime = std::chrono::steady_clock::now();
-    auto interpretationDuration = finishedTime - verifiedTime;
+    auto translationDuration = translatedTime - verifiedTime;
+    auto interpretationDuration = finishedTime - translatedTime;
     std::cerr << fmt::format("verification time: {:%S}", verificationDuration)
               << std::endl;
-    std::cerr << fmt::format("interpretation time: {:%S}",
-                             interpretationDuration)
-              << std::endl;
+    if (engine == Engine::Threaded || engine == Engine::EmitC) {
+      std::cerr << fmt::format("translation time: {:%S}", translationDuration)
+                << std::endl;
+    } else if (engine == Engine::Jit) {
+      std::cerr << fmt::format("compilation time: {:%S}", translationDuration)
+                << std::endl;
+    }
+    if (engine != Engine::EmitC) {
+      std::cerr << fmt::format("interpretation time: {:%S}",
+                               interpretationDuration)
+                << std::endl;
+    }
   } catch (InvalidByteFileError &e) {
     std::cerr << fmt::format("invalid bytefile at {}:", byteFilePath)
               << std::endl;
@@ -0,0 +1,905 @@
+#include "Optimizer.h"
+#include "ByteFile.h"
+#include "Inst.h"
+#include "Value.h"
+#include "Verifier.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace lama;
+
+namespace {
+
+/// Not an instruction: control falls through to the next op
+constexpr uint8_t I_REMOVED = 0x00;
+
+/// Size of BEGIN and CBEGIN
+constexpr size_t BeginSize = 1 + 2 * sizeof(int32_t);
+
+/// Bounds the chains of jumps to jumps followed, as they may form a loop
+constexpr int MaxThreadedJumps = 8;
+
+/// Largest body, in bytes, of a function inlined at any CALL
+constexpr size_t MaxInlinedSize = 32;
+
+/// Largest body, in bytes, of a function inlined at a CALL inside a loop
+constexpr size_t MaxHotInlinedSize = 96;
+
+/// Bounds the bytes of inlined bodies in one function
+constexpr size_t MaxInlinedGrowth = 1024;
+
+/// Fewest TAG tests in a row worth a TAGSWITCH
+constexpr size_t MinTagSwitchArms = 2;
+
+/// Size of a TAGSWITCH arm: the tag, the field count and the target
+constexpr size_t TagSwitchArmSize = 3 * sizeof(int32_t);
+
+int32_t readWordAt(const uint8_t *ip) {
+  int32_t word;
+  memcpy(&word, ip, sizeof(word));
+  return word;
+}
+
+/// \pre \p ip is a verified instruction
+size_t instSize(const uint8_t *ip) {
+  switch (*ip) {
+  case I_CONST:
+  case I_STRING:
+  case I_JMP:
+  case I_LD_Global:
+  case I_LD_Local:
+  case I_LD_Arg:
+  case I_LD_Access:
+  case I_LDA_Global:
+  case I_LDA_Local:
+  case I_LDA_Arg:
+  case I_LDA_Access:
+  case I_ST_Global:
+  case I_ST_Local:
+  case I_ST_Arg:
+  case I_ST_Access:
+  case I_CJMPz:
+  case I_CJMPnz:
+  case I_CALLC:
+  case I_ARRAY:
+  case I_LINE:
+  case I_CALL_Barray:
+    return 1 + sizeof(int32_t);
+  case I_SEXP:
+  case I_BEGIN:
+  case I_BEGINcl:
+  case I_CALL:
+  case I_TAG:
+  case I_FAIL:
+    return 1 + 2 * sizeof(int32_t);
+  case I_CLOSURE:
+    return 1 + 2 * sizeof(int32_t) +
+           readWordAt(ip + 1 + sizeof(int32_t)) * (1 + sizeof(int32_t));
+  case I_TAGSWITCH:
+    return 1 + 2 * sizeof(int32_t) + readWordAt(ip + 1) * TagSwitchArmSize;
+  default:
+    return 1;
+  }
+}
+
+bool isJump(uint8_t code) {
+  return code == I_JMP || code == I_CJMPz || code == I_CJMPnz;
+}
+
+/// Whether control never falls through to the next instruction
+bool stops(uint8_t code) {
+  return code == I_JMP || code == I_END || code == I_FAIL ||
+         code == I_TAGSWITCH;
+}
+
+bool isVarAccess(uint8_t code) {
+  return code >= I_LD_Global && code <= I_ST_Access;
+}
+
+/// Loads without side effects, dropping their result undoes them
+bool isPureLoad(uint8_t code) {
+  return code == I_CONST || code == I_DUP ||
+         (code >= I_LD_Global && code <= I_LD_Access);
+}
+
+/// Computes \p code on numbers the way the engines do.
+/// \return false if it fails at run time or the result is no CONST operand
+bool foldBinop(uint8_t code, int32_t lhs, int32_t rhs, int32_t &result) {
+  if ((code == I_BINOP_Div || code == I_BINOP_Mod) && rhs == 0)
+    return false;
+  Value l = boxInt(lhs), r = boxInt(rhs);
+  Value boxed;
+  switch (code) {
+  case I_BINOP_Add:
+    boxed = boxedAdd(l, r);
+    break;
+  case I_BINOP_Sub:
+    boxed = boxedSub(l, r);
+    break;
+  case I_BINOP_Mul:
+    boxed = boxedMul(l, r);
+    break;
+  case I_BINOP_Div:
+    boxed = boxedDiv(l, r);
+    break;
+  case I_BINOP_Mod:
+    boxed = boxedMod(l, r);
+    break;
+  case I_BINOP_Lt:
+    boxed = boxInt(l < r);
+    break;
+  case I_BINOP_Leq:
+    boxed = boxInt(l <= r);
+    break;
+  case I_BINOP_Gt:
+    boxed = boxInt(l > r);
+    break;
+  case I_BINOP_Geq:
+    boxed = boxInt(l >= r);
+    break;
+  case I_BINOP_Eq:
+    boxed = boxInt(l == r);
+    break;
+  case I_BINOP_Neq:
+    boxed = boxInt(l != r);
+    break;
+  case I_BINOP_And:
+    boxed = boxedAnd(l, r);
+    break;
+  case I_BINOP_Or:
+    boxed = boxedOr(l, r);
+    break;
+  default:
+    return false;
+  }
+  result = unboxInt(boxed);
+  return result >= LAMA_INT_MIN && result < LAMA_INT_MAX;
+}
+
+/// A sexp shape a TAGSWITCH dispatches on
+struct Arm {
+  /// The TAG testing for the shape
+  const uint8_t *tag;
+  /// Op index
+  int32_t target;
+};
+
+/// An instruction of a function being optimized
+struct Op {
+  uint8_t code;
+  /// The CONST value, the variable index, or the jump target as an op index,
+  /// for a TAGSWITCH the target if no arm matches
+  int32_t operand = 0;
+  /// Encoding in the original code, nullptr if the op is made up here
+  const uint8_t *ip = nullptr;
+  /// Of a TAGSWITCH, in the order they are tried
+  std::vector<Arm> arms = {};
+};
+
+/// Operands \p op takes from the stack and pushes to it.
+/// \return false for ops whose effect on the stack is not listed here
+bool stackEffect(const Op &op, int32_t &npops, int32_t &npushes) {
+  npushes = 1;
+  if (op.code >= I_BINOP_Add && op.code <= I_BINOP_Or) {
+    npops = 2;
+    return true;
+  }
+  if (op.code >= I_LD_Global && op.code <= I_LD_Access) {
+    npops = 0;
+    return true;
+  }
+  if ((op.code >= I_ST_Global && op.code <= I_ST_Access) ||
+      (op.code >= I_PATT_String && op.code <= I_PATT_Closure)) {
+    npops = 1;
+    return true;
+  }
+  switch (op.code) {
+  case I_CONST:
+  case I_STRING:
+  case I_CALL_Lread:
+    npops = 0;
+    return true;
+  case I_DROP:
+    npops = 1;
+    npushes = 0;
+    return true;
+  case I_DUP:
+    npops = 1;
+    npushes = 2;
+    return true;
+  case I_SWAP:
+    npops = npushes = 2;
+    return true;
+  case I_ELEM:
+  case I_PATT_StrCmp:
+    npops = 2;
+    return true;
+  case I_STA:
+    npops = 3;
+    return true;
+  case I_TAG:
+  case I_ARRAY:
+  case I_CALL_Lwrite:
+  case I_CALL_Llength:
+  case I_CALL_Lstring:
+    npops = 1;
+    return true;
+  case I_CALL_Barray:
+    npops = readWordAt(op.ip + 1);
+    return true;
+  case I_SEXP:
+  case I_CALL:
+    npops = readWordAt(op.ip + 1 + sizeof(int32_t));
+    return true;
+  case I_CALLC:
+    npops = readWordAt(op.ip + 1) + 1;
+    return true;
+  default:
+    return false;
+  }
+}
+
+/// Fields of the array or sexp BARRAY or SEXP \p op creates
+int32_t fieldsOf(const Op &op) {
+  return readWordAt(op.ip + 1 + (op.code == I_SEXP ? sizeof(int32_t) : 0));
+}
+
+/// Optimizes the code of one function, from the instruction after its
+/// BEGIN. Removed ops are kept in place as I_REMOVED, so jump targets stay
+/// valid op indices: a jump to a removed op goes to the next op kept.
+class FunctionOptimizer {
+public:
+  FunctionOptimizer(const CodeInfo &codeInfo, const FunctionInfo &function,
+                    const uint8_t *code)
+      : codeInfo(codeInfo), function(function), code(code),
+        nlocals(function.nlocals) {}
+
+  /// \return false if the function is not laid out the way lamac does it:
+  /// its reachable instructions right after its BEGIN, falling through
+  /// only to each other, and jumps staying inside
+  bool decode();
+
+  /// \return the size of the code after the BEGIN, or 0 if CALLs to the
+  /// function may not be replaced by it
+  size_t inlinableSize() const;
+
+  /// Replaces CALLs to small functions by their code, their arguments and
+  /// locals becoming locals of this function. Functions are inlined at
+  /// any CALL up to MaxInlinedSize, and inside loops, where the calls are
+  /// likely to be hot, up to MaxHotInlinedSize.
+  /// \param calleeOf maps the offset of a function to its optimizer as
+  /// decoded, or nullptr
+  template <typename F> void inlineCalls(F calleeOf);
+
+  void run();
+
+  /// Places the function at \p beginOffset
+  /// \return the offset right after the function
+  int32_t layOut(int32_t beginOffset);
+
+  /// \param sourceOffsets receives the original offset of each instruction,
+  /// by its offset in the rewritten code. Ops made up here take the one of
+  /// the op before them.
+  /// \param newFunctionOffset maps an offset of a function in the original
+  /// code to its offset in the rewritten code
+  template <typename F>
+  void emit(uint8_t *out, int32_t *sourceOffsets, F newFunctionOffset) const;
+
+private:
+  /// \return the first op kept from \p index on
+  size_t resolve(size_t index) const;
+  size_t next(size_t index) const { return resolve(index + 1); }
+  /// Whether the original instruction had its expected number operands
+  /// proven by the verifier
+  bool hasIntOperands(const Op &op) const {
+    return op.ip && codeInfo.instInfo[op.ip - code].hasIntOperands();
+  }
+  size_t sizeOf(const Op &op) const {
+    if (op.code == I_REMOVED)
+      return 0;
+    if (op.ip)
+      return instSize(op.ip);
+    if (op.code == I_TAGSWITCH)
+      return 1 + 2 * sizeof(int32_t) + op.arms.size() * TagSwitchArmSize;
+    return op.code == I_CONST || op.code == I_JMP || isVarAccess(op.code)
+               ? 1 + sizeof(int32_t)
+               : 1;
+  }
+  void remove(size_t index) {
+    ops[index] = Op{I_REMOVED};
+    changed = true;
+  }
+  void replace(size_t index, Op op) {
+    ops[index] = std::move(op);
+    changed = true;
+  }
+
+  void findLabels();
+  void threadJumps();
+  void foldConstants();
+  void simplifyShuffles();
+  void removeUnreachable();
+  /// Whether ARRAY or TAG \p test matches what BARRAY or SEXP \p alloc
+  /// creates
+  bool matchesShape(const Op &test, const Op &alloc) const;
+  /// Finds how the result of BARRAY or SEXP \p alloc is used, if it is
+  /// only taken apart right away and dropped
+  /// \param fieldBase is the first local the fields would be stored in
+  /// \param rewrites receives the ops replacing the uses, by op index
+  bool findLocalUses(size_t alloc, int32_t fieldBase,
+                     std::vector<std::pair<size_t, Op>> &rewrites) const;
+  /// Replaces the arrays and sexps found by findLocalUses() by locals
+  /// holding their fields, so they are not allocated at all
+  void replaceAllocations();
+  /// Matches DUP; TAG; CJMPz/CJMPnz at \p index
+  /// \param failure receives the op index control goes to on no match
+  bool matchTagTest(size_t index, Arm &arm, size_t &failure) const;
+  /// Replaces tests of one operand against several sexp shapes, as lamac
+  /// compiles `case`, by a TAGSWITCH reading the shape only once. Runs
+  /// last, the other passes do not know TAGSWITCH.
+  void formTagSwitches();
+
+private:
+  const CodeInfo &codeInfo;
+  const FunctionInfo &function;
+  const uint8_t *code;
+  std::vector<Op> ops;
+  int32_t nlocals;
+  /// Whether a jump leads to the op, indexed like #ops
+  std::vector<bool> isLabel;
+  /// Offsets in the rewritten code, indexed like #ops, with the end last
+  std::vector<int32_t> offsets;
+  bool changed = false;
+};
+
+} // namespace
+
+bool FunctionOptimizer::decode() {
+  std::vector<const uint8_t *> insts = function.insts;
+  std::sort(insts.begin(), insts.end());
+  if (insts.empty() || insts.front() != function.beginIp + BeginSize)
+    return false;
+  auto indexOf = [&](const uint8_t *ip) -> int32_t {
+    auto it = std::lower_bound(insts.begin(), insts.end(), ip);
+    return it != insts.end() && *it == ip ? it - insts.begin() : -1;
+  };
+  for (size_t i = 0; i < insts.size(); ++i) {
+    const uint8_t *ip = insts[i];
+    Op op{*ip, 0, ip};
+    if (isJump(op.code)) {
+      op.operand = indexOf(code + readWordAt(ip + 1));
+      if (op.operand < 0)
+        return false;
+    } else if (op.code == I_CONST || isVarAccess(op.code)) {
+      op.operand = readWordAt(ip + 1);
+    }
+    if (!stops(op.code) &&
+        (i + 1 == insts.size() || insts[i + 1] != ip + instSize(ip)))
+      return false;
+    if (op.code == I_LINE)
+      op = Op{I_REMOVED};
+    else if (op.code == I_TAGSWITCH)
+      return false;
+    ops.push_back(op);
+  }
+  return true;
+}
+
+size_t FunctionOptimizer::inlinableSize() const {
+  // Prefilled locals would keep what the previous call left in them
+  if (function.isClosure() || function.nprefilledLocals != 0)
+    return 0;
+  size_t size = 0;
+  for (const Op &op : ops) {
+    // The variables it captures would have to be renamed
+    if (op.code == I_CLOSURE)
+      return 0;
+    size += sizeOf(op);
+  }
+  return size;
+}
+
+template <typename F> void FunctionOptimizer::inlineCalls(F calleeOf) {
+  // A backward jump closes a loop over the ops from its target on
+  std::vector<bool> isInLoop(ops.size(), false);
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (isJump(ops[i].code) && static_cast<size_t>(ops[i].operand) <= i)
+      std::fill(isInLoop.begin() + ops[i].operand, isInLoop.begin() + i, true);
+  }
+  std::vector<Op> inlined;
+  std::vector<int32_t> newIndex(ops.size());
+  // Jumps whose operand is still an index into ops
+  std::vector<size_t> unresolvedJumps;
+  size_t growth = 0;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    newIndex[i] = inlined.size();
+    const Op &op = ops[i];
+    const FunctionOptimizer *callee =
+        op.code == I_CALL ? calleeOf(readWordAt(op.ip + 1)) : nullptr;
+    size_t size = callee ? callee->inlinableSize() : 0;
+    size_t maxSize = isInLoop[i] ? MaxHotInlinedSize : MaxInlinedSize;
+    if (size == 0 || size > maxSize || growth + size > MaxInlinedGrowth ||
+        callee->function.beginIp == function.beginIp) {
+      if (isJump(op.code))
+        unresolvedJumps.push_back(inlined.size());
+      inlined.push_back(op);
+      continue;
+    }
+    growth += size;
+    // The inlined code of every call uses the same locals, after our own
+    int32_t base = function.nlocals;
+    int32_t nargs = callee->function.nargs;
+    nlocals = std::max(nlocals, base + nargs + callee->function.nlocals);
+    for (int32_t arg = nargs - 1; arg >= 0; --arg) {
+      inlined.push_back(Op{I_ST_Local, base + arg});
+      inlined.push_back(Op{I_DROP});
+    }
+    size_t start = inlined.size();
+    for (Op calleeOp : callee->ops) {
+      if (isJump(calleeOp.code)) {
+        calleeOp.operand += start;
+      } else if (calleeOp.code == I_END) {
+        // Leaves the result on the stack of the caller, as END would
+        unresolvedJumps.push_back(inlined.size());
+        calleeOp = Op{I_JMP, static_cast<int32_t>(i + 1)};
+      } else if (isVarAccess(calleeOp.code)) {
+        uint8_t designation = 0x0F & calleeOp.code;
+        if (designation == LOC_Arg || designation == LOC_Local) {
+          int32_t local = base + calleeOp.operand;
+          if (designation == LOC_Local)
+            local += nargs;
+          uint8_t code = (0xF0 & calleeOp.code) | LOC_Local;
+          calleeOp = Op{code, local};
+        }
+      }
+      inlined.push_back(calleeOp);
+    }
+  }
+  for (size_t jump : unresolvedJumps)
+    inlined[jump].operand = newIndex[inlined[jump].operand];
+  ops = std::move(inlined);
+}
+
+void FunctionOptimizer::run() {
+  do {
+    changed = false;
+    threadJumps();
+    foldConstants();
+    simplifyShuffles();
+    replaceAllocations();
+    removeUnreachable();
+  } while (changed);
+  formTagSwitches();
+  removeUnreachable();
+}
+
+size_t FunctionOptimizer::resolve(size_t index) const {
+  while (index < ops.size() && ops[index].code == I_REMOVED)
+    ++index;
+  return index;
+}
+
+void FunctionOptimizer::findLabels() {
+  isLabel.assign(ops.size(), false);
+  for (const Op &op : ops) {
+    if (isJump(op.code))
+      isLabel[resolve(op.operand)] = true;
+  }
+}
+
+void FunctionOptimizer::threadJumps() {
+  for (size_t i = resolve(0); i < ops.size(); i = next(i)) {
+    Op &op = ops[i];
+    if (!isJump(op.code))
+      continue;
+    size_t target = resolve(op.operand);
+    for (int n = 0; n < MaxThreadedJumps && ops[target].code == I_JMP &&
+                    target != i;
+         ++n)
+      target = resolve(ops[target].operand);
+    if (target != static_cast<size_t>(op.operand)) {
+      op.operand = target;
+      changed = true;
+    }
+    if (op.code == I_JMP && ops[target].code == I_END) {
+      // The operand stack size is the same at the END
+      replace(i, Op{I_END});
+    } else if (target == next(i)) {
+      if (op.code == I_JMP)
+        remove(i);
+      else if (hasIntOperands(op))
+        replace(i, Op{I_DROP});
+    }
+  }
+}
+
+void FunctionOptimizer::foldConstants() {
+  findLabels();
+  for (size_t i = resolve(0); i < ops.size(); i = next(i)) {
+    if (ops[i].code != I_CONST)
+      continue;
+    size_t j = next(i);
+    if (j == ops.size() || isLabel[j])
+      continue;
+    if (ops[j].code == I_CJMPz || ops[j].code == I_CJMPnz) {
+      bool taken = (ops[i].operand == 0) == (ops[j].code == I_CJMPz);
+      remove(i);
+      if (taken)
+        replace(j, Op{I_JMP, ops[j].operand});
+      else
+        remove(j);
+      continue;
+    }
+    size_t k = next(j);
+    if (ops[j].code != I_CONST || k == ops.size() || isLabel[k])
+      continue;
+    int32_t result;
+    if (foldBinop(ops[k].code, ops[i].operand, ops[j].operand, result)) {
+      remove(i);
+      remove(j);
+      replace(k, Op{I_CONST, result});
+    }
+  }
+}
+
+void FunctionOptimizer::simplifyShuffles() {
+  findLabels();
+  for (size_t i = resolve(0); i < ops.size(); i = next(i)) {
+    size_t j = next(i);
+    if (j == ops.size() || isLabel[j])
+      continue;
+    uint8_t first = ops[i].code, second = ops[j].code;
+    if ((isPureLoad(first) && second == I_DROP) ||
+        (first == I_SWAP && second == I_SWAP)) {
+      remove(i);
+      remove(j);
+      continue;
+    }
+    // ST x; DROP; LD x leaves the stored value on the stack already
+    size_t k = next(j);
+    if (first >= I_ST_Global && first <= I_ST_Access && second == I_DROP &&
+        k != ops.size() && !isLabel[k] &&
+        ops[k].code == first - I_ST_Global + I_LD_Global &&
+        ops[k].operand == ops[i].operand) {
+      remove(j);
+      remove(k);
+    }
+  }
+}
+
+void FunctionOptimizer::removeUnreachable() {
+  std::vector<bool> isReached(ops.size(), false);
+  std::vector<size_t> worklist{resolve(0)};
+  while (!worklist.empty()) {
+    size_t i = worklist.back();
+    worklist.pop_back();
+    if (isReached[i])
+      continue;
+    isReached[i] = true;
+    if (isJump(ops[i].code) || ops[i].code == I_TAGSWITCH)
+      worklist.push_back(resolve(ops[i].operand));
+    for (const Arm &arm : ops[i].arms)
+      worklist.push_back(resolve(arm.target));
+    if (!stops(ops[i].code))
+      worklist.push_back(next(i));
+  }
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (!isReached[i] && ops[i].code != I_REMOVED)
+      remove(i);
+  }
+}
+
+bool FunctionOptimizer::matchesShape(const Op &test, const Op &alloc) const {
+  if (test.code == I_ARRAY) {
+    return alloc.code == I_CALL_Barray &&
+           readWordAt(test.ip + 1) == readWordAt(alloc.ip + 1);
+  }
+  return alloc.code == I_SEXP &&
+         readWordAt(test.ip + 1 + sizeof(int32_t)) ==
+             readWordAt(alloc.ip + 1 + sizeof(int32_t)) &&
+         codeInfo.tagHashes.at(test.ip - code) ==
+             codeInfo.tagHashes.at(alloc.ip - code);
+}
+
+bool FunctionOptimizer::findLocalUses(
+    size_t alloc, int32_t fieldBase,
+    std::vector<std::pair<size_t, Op>> &rewrites) const {
+  const Op &allocOp = ops[alloc];
+  int32_t nfields = fieldsOf(allocOp);
+  // The op at the index unless it is the end or other code jumps to it
+  auto inRegion = [&](size_t index) -> const Op * {
+    return index != ops.size() && !isLabel[index] ? &ops[index] : nullptr;
+  };
+  // CONST; ELEM loading a field
+  auto fieldLoad = [&](size_t index, size_t &elem) -> const Op * {
+    const Op *op = inRegion(index);
+    if (!op || op->code != I_CONST || op->operand < 0 ||
+        op->operand >= nfields)
+      return nullptr;
+    elem = next(index);
+    const Op *elemOp = inRegion(elem);
+    return elemOp && elemOp->code == I_ELEM ? op : nullptr;
+  };
+  // Operands pushed above the value
+  int32_t depth = 0;
+  for (size_t i = next(alloc);; i = next(i)) {
+    const Op *op = inRegion(i);
+    if (!op)
+      return false;
+    if (depth == 0) {
+      size_t elem;
+      if (op->code == I_DROP) {
+        rewrites.emplace_back(i, Op{I_REMOVED});
+        return true;
+      }
+      if (const Op *index = fieldLoad(i, elem)) {
+        rewrites.emplace_back(i, Op{I_LD_Local, fieldBase + index->operand});
+        rewrites.emplace_back(elem, Op{I_REMOVED});
+        return true;
+      }
+      if (op->code == I_ARRAY || op->code == I_TAG) {
+        rewrites.emplace_back(i, Op{I_CONST, matchesShape(*op, allocOp)});
+        return true;
+      }
+    }
+    if (depth == 0 && op->code == I_DUP) {
+      // The copy is taken apart, the value stays
+      size_t test = next(i), elem;
+      if (const Op *index = fieldLoad(test, elem)) {
+        rewrites.emplace_back(i, Op{I_LD_Local, fieldBase + index->operand});
+        rewrites.emplace_back(test, Op{I_REMOVED});
+        rewrites.emplace_back(elem, Op{I_REMOVED});
+        depth = 1;
+        i = elem;
+        continue;
+      }
+      const Op *testOp = inRegion(test);
+      if (!testOp || (testOp->code != I_ARRAY && testOp->code != I_TAG))
+        return false;
+      bool matches = matchesShape(*testOp, allocOp);
+      size_t jump = next(test);
+      const Op *jumpOp = inRegion(jump);
+      if (jumpOp &&
+          (jumpOp->code == I_CJMPz || jumpOp->code == I_CJMPnz)) {
+        // The value would be needed where the jump goes
+        if (matches == (jumpOp->code == I_CJMPnz))
+          return false;
+        rewrites.emplace_back(i, Op{I_REMOVED});
+        rewrites.emplace_back(test, Op{I_REMOVED});
+        rewrites.emplace_back(jump, Op{I_REMOVED});
+        i = jump;
+      } else {
+        rewrites.emplace_back(i, Op{I_CONST, matches});
+        rewrites.emplace_back(test, Op{I_REMOVED});
+        depth = 1;
+        i = test;
+      }
+      continue;
+    }
+    int32_t npops, npushes;
+    if (!stackEffect(*op, npops, npushes) || npops > depth)
+      return false;
+    depth += npushes - npops;
+  }
+}
+
+void FunctionOptimizer::replaceAllocations() {
+  findLabels();
+  for (size_t i = resolve(0); i < ops.size(); i = next(i)) {
+    uint8_t allocCode = ops[i].code;
+    if (allocCode != I_CALL_Barray && allocCode != I_SEXP)
+      continue;
+    std::vector<std::pair<size_t, Op>> rewrites;
+    if (!findLocalUses(i, nlocals, rewrites))
+      continue;
+    for (auto &[index, op] : rewrites)
+      replace(index, std::move(op));
+    // The fields are on the stack, the last one on top
+    int32_t nfields = fieldsOf(ops[i]);
+    std::vector<Op> stores;
+    for (int32_t field = nfields - 1; field >= 0; --field) {
+      stores.push_back(Op{I_ST_Local, nlocals + field});
+      stores.push_back(Op{I_DROP});
+    }
+    nlocals += nfields;
+    if (stores.empty()) {
+      remove(i);
+      continue;
+    }
+    // Everything after the allocation moves down by the added ops
+    size_t added = stores.size() - 1;
+    for (Op &op : ops) {
+      if (isJump(op.code) && static_cast<size_t>(op.operand) > i)
+        op.operand += added;
+    }
+    replace(i, std::move(stores.front()));
+    ops.insert(ops.begin() + i + 1, std::make_move_iterator(stores.begin() + 1),
+               std::make_move_iterator(stores.end()));
+    isLabel.insert(isLabel.begin() + i + 1, added, false);
+    i += added;
+  }
+}
+
+bool FunctionOptimizer::matchTagTest(size_t index, Arm &arm,
+                                     size_t &failure) const {
+  if (index == ops.size() || ops[index].code != I_DUP)
+    return false;
+  size_t tag = next(index);
+  if (tag == ops.size() || ops[tag].code != I_TAG)
+    return false;
+  size_t jump = next(tag);
+  if (jump == ops.size() ||
+      (ops[jump].code != I_CJMPz && ops[jump].code != I_CJMPnz))
+    return false;
+  size_t target = resolve(ops[jump].operand);
+  size_t fallThrough = next(jump);
+  bool jumpsOnMatch = ops[jump].code == I_CJMPnz;
+  arm = Arm{ops[tag].ip,
+            static_cast<int32_t>(jumpsOnMatch ? target : fallThrough)};
+  failure = jumpsOnMatch ? fallThrough : target;
+  return true;
+}
+
+void FunctionOptimizer::formTagSwitches() {
+  for (size_t i = resolve(0); i < ops.size(); i = next(i)) {
+    // The tests only read the operand, so skipping to the first one
+    // matching changes nothing else
+    std::vector<size_t> tests;
+    std::vector<Arm> arms;
+    size_t test = i;
+    Arm arm;
+    size_t failure;
+    while (std::find(tests.begin(), tests.end(), test) == tests.end() &&
+           matchTagTest(test, arm, failure)) {
+      tests.push_back(test);
+      arms.push_back(arm);
+      test = failure;
+    }
+    if (arms.size() < MinTagSwitchArms)
+      continue;
+    // Tests jumped to from elsewhere, e.g. when a nested pattern fails,
+    // stay as they are
+    Op tagSwitch{I_TAGSWITCH, static_cast<int32_t>(test)};
+    tagSwitch.arms = std::move(arms);
+    replace(i, std::move(tagSwitch));
+  }
+}
+
+int32_t FunctionOptimizer::layOut(int32_t beginOffset) {
+  offsets.resize(ops.size() + 1);
+  int32_t offset = beginOffset + BeginSize;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    offsets[i] = offset;
+    offset += sizeOf(ops[i]);
+  }
+  offsets[ops.size()] = offset;
+  return offset;
+}
+
+template <typename F>
+void FunctionOptimizer::emit(uint8_t *out, int32_t *sourceOffsets,
+                             F newFunctionOffset) const {
+  auto writeWord = [](uint8_t *at, int32_t word) {
+    memcpy(at, &word, sizeof(word));
+  };
+  uint8_t *begin = out + offsets[0] - BeginSize;
+  memcpy(begin, function.beginIp, BeginSize);
+  writeWord(begin + 1 + sizeof(int32_t), nlocals);
+  int32_t sourceOffset = function.beginIp - code;
+  sourceOffsets[offsets[0] - BeginSize] = sourceOffset;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const Op &op = ops[i];
+    if (op.code == I_REMOVED)
+      continue;
+    uint8_t *at = out + offsets[i];
+    if (op.ip)
+      sourceOffset = op.ip - code;
+    sourceOffsets[offsets[i]] = sourceOffset;
+    if (op.ip) {
+      memcpy(at, op.ip, sizeOf(op));
+    } else {
+      *at = op.code;
+      if (op.code == I_CONST || isVarAccess(op.code))
+        writeWord(at + 1, op.operand);
+      if (op.code == I_TAGSWITCH) {
+        writeWord(at + 1, op.arms.size());
+        writeWord(at + 1 + sizeof(int32_t), offsets[op.operand]);
+        uint8_t *armAt = at + 1 + 2 * sizeof(int32_t);
+        for (const Arm &arm : op.arms) {
+          // The tag and the field count as the TAG has them
+          memcpy(armAt, arm.tag + 1, 2 * sizeof(int32_t));
+          writeWord(armAt + 2 * sizeof(int32_t), offsets[arm.target]);
+          armAt += TagSwitchArmSize;
+        }
+      }
+    }
+    if (isJump(op.code))
+      writeWord(at + 1, offsets[op.operand]);
+    else if (op.code == I_CALL || op.code == I_CLOSURE)
+      writeWord(at + 1, newFunctionOffset(readWordAt(at + 1)));
+  }
+}
+
+/// A copy of \p file with \p code and \p publicSymbols instead of its own
+static ByteFile rebuild(const ByteFile &file,
+                        const std::vector<int32_t> &publicSymbols,
+                        const uint8_t *code, size_t codeSizeBytes) {
+  int32_t header[] = {static_cast<int32_t>(file.getStringTableSize()),
+                      static_cast<int32_t>(file.getGlobalAreaSize()),
+                      static_cast<int32_t>(file.getPublicSymbolNum())};
+  size_t symbolsSizeBytes = publicSymbols.size() * sizeof(int32_t);
+  size_t sizeBytes = sizeof(header) + symbolsSizeBytes +
+                     file.getStringTableSize() + codeSizeBytes;
+  std::unique_ptr<uint8_t[]> data(new uint8_t[sizeBytes]);
+  uint8_t *out = data.get();
+  memcpy(out, header, sizeof(header));
+  out += sizeof(header);
+  memcpy(out, publicSymbols.data(), symbolsSizeBytes);
+  out += symbolsSizeBytes;
+  memcpy(out, file.getStringTable(), file.getStringTableSize());
+  out += file.getStringTableSize();
+  memcpy(out, code, codeSizeBytes);
+  return ByteFile(std::move(data), sizeBytes);
+}
+
+ByteFile lama::optimize(const ByteFile &file, const CodeInfo &codeInfo) {
+  const uint8_t *code = file.getCode();
+  std::vector<int32_t> publicSymbols(
+      file.getPublicSymbolTable(),
+      file.getPublicSymbolTable() + 2 * file.getPublicSymbolNum());
+
+  std::vector<FunctionIndex> order(codeInfo.functions.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](FunctionIndex a, FunctionIndex b) {
+    return codeInfo.functions[a].beginIp < codeInfo.functions[b].beginIp;
+  });
+  std::vector<FunctionOptimizer> optimizers;
+  optimizers.reserve(order.size());
+  for (FunctionIndex index : order) {
+    optimizers.emplace_back(codeInfo, codeInfo.functions[index], code);
+    if (!optimizers.back().decode()) {
+      // Not code lamac produces, leave it alone
+      return rebuild(file, publicSymbols, code, file.getCodeSizeBytes());
+    }
+  }
+
+  // Functions are inlined as they are decoded, not with calls inlined
+  const std::vector<FunctionOptimizer> decoded = optimizers;
+  std::vector<const FunctionOptimizer *> decodedAt(codeInfo.functions.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    decodedAt[order[i]] = &decoded[i];
+  for (FunctionOptimizer &optimizer : optimizers) {
+    optimizer.inlineCalls([&](int32_t offset) {
+      return decodedAt[codeInfo.functionIndex[offset]];
+    });
+  }
+
+  std::vector<int32_t> newBeginOffsets(codeInfo.functions.size());
+  int32_t offset = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    optimizers[i].run();
+    newBeginOffsets[order[i]] = offset;
+    offset = optimizers[i].layOut(offset);
+  }
+  auto newFunctionOffset = [&](int32_t oldOffset) {
+    return newBeginOffsets[codeInfo.functionIndex[oldOffset]];
+  };
+  std::vector<uint8_t> newCode(offset);
+  std::vector<int32_t> sourceOffsets(offset, -1);
+  for (const FunctionOptimizer &optimizer : optimizers)
+    optimizer.emit(newCode.data(), sourceOffsets.data(), newFunctionOffset);
+  for (size_t i = 0; i < file.getPublicSymbolNum(); ++i)
+    publicSymbols[2 * i + 1] = newFunctionOffset(publicSymbols[2 * i + 1]);
+  // Errors name the offsets of the bytefile as loaded
+  for (int32_t &sourceOffset : sourceOffsets) {
+    if (sourceOffset >= 0)
+      sourceOffset = file.sourceOffsetOf(sourceOffset);
+  }
+  ByteFile optimized =
+      rebuild(file, publicSymbols, newCode.data(), newCode.size());
+  optimized.setSourceOffsets(std::move(sourceOffsets));
+  return optimized;
+}
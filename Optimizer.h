@@ -0,0 +1,21 @@
+#pragma once
+
+namespace lama {
+
+class ByteFile;
+struct CodeInfo;
+
+/// Rewrites the code of a verified bytefile into code doing the same with
+/// fewer instructions.
+///
+/// Small functions are inlined at their CALLs, LINEs stripped, operations on
+/// constants folded, jumps to jumps threaded, stack shuffles undoing each
+/// other and unreachable code removed. Arrays and sexps only taken apart
+/// right after they are created, as the result of an inlined function often
+/// is, are not created at all, their fields are kept in locals instead.
+/// Chains of TAG tests become TAGSWITCHes. Functions are kept in their
+/// order, the string table and the globals as they are. The result has to
+/// be verified again.
+ByteFile optimize(const ByteFile &file, const CodeInfo &codeInfo);
+
+} // namespace lama
@@ -0,0 +1,190 @@
+#include "Profile.h"
+#include "Inst.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <ostream>
+#include <vector>
+
+using namespace lama;
+
+static const char *opcodeName(uint8_t opcode) {
+  switch (opcode) {
+  case I_BINOP_Add:
+    return "BINOP +";
+  case I_BINOP_Sub:
+    return "BINOP -";
+  case I_BINOP_Mul:
+    return "BINOP *";
+  case I_BINOP_Div:
+    return "BINOP /";
+  case I_BINOP_Mod:
+    return "BINOP %";
+  case I_BINOP_Lt:
+    return "BINOP <";
+  case I_BINOP_Leq:
+    return "BINOP <=";
+  case I_BINOP_Gt:
+    return "BINOP >";
+  case I_BINOP_Geq:
+    return "BINOP >=";
+  case I_BINOP_Eq:
+    return "BINOP ==";
+  case I_BINOP_Neq:
+    return "BINOP !=";
+  case I_BINOP_And:
+    return "BINOP &&";
+  case I_BINOP_Or:
+    return "BINOP !!";
+  case I_CONST:
+    return "CONST";
+  case I_STRING:
+    return "STRING";
+  case I_SEXP:
+    return "SEXP";
+  case I_STA:
+    return "STA";
+  case I_JMP:
+    return "JMP";
+  case I_END:
+    return "END";
+  case I_DROP:
+    return "DROP";
+  case I_DUP:
+    return "DUP";
+  case I_SWAP:
+    return "SWAP";
+  case I_ELEM:
+    return "ELEM";
+  case I_LD_Global:
+    return "LD G";
+  case I_LD_Local:
+    return "LD L";
+  case I_LD_Arg:
+    return "LD A";
+  case I_LD_Access:
+    return "LD C";
+  case I_LDA_Global:
+    return "LDA G";
+  case I_LDA_Local:
+    return "LDA L";
+  case I_LDA_Arg:
+    return "LDA A";
+  case I_LDA_Access:
+    return "LDA C";
+  case I_ST_Global:
+    return "ST G";
+  case I_ST_Local:
+    return "ST L";
+  case I_ST_Arg:
+    return "ST A";
+  case I_ST_Access:
+    return "ST C";
+  case I_CJMPz:
+    return "CJMPz";
+  case I_CJMPnz:
+    return "CJMPnz";
+  case I_BEGIN:
+    return "BEGIN";
+  case I_BEGINcl:
+    return "CBEGIN";
+  case I_CLOSURE:
+    return "CLOSURE";
+  case I_CALLC:
+    return "CALLC";
+  case I_CALL:
+    return "CALL";
+  case I_TAG:
+    return "TAG";
+  case I_ARRAY:
+    return "ARRAY";
+  case I_FAIL:
+    return "FAIL";
+  case I_LINE:
+    return "LINE";
+  case I_TAGSWITCH:
+    return "TAGSWITCH";
+  case I_PATT_StrCmp:
+    return "PATT =str";
+  case I_PATT_String:
+    return "PATT #string";
+  case I_PATT_Array:
+    return "PATT #array";
+  case I_PATT_Sexp:
+    return "PATT #sexp";
+  case I_PATT_Boxed:
+    return "PATT #ref";
+  case I_PATT_UnBoxed:
+    return "PATT #val";
+  case I_PATT_Closure:
+    return "PATT #fun";
+  case I_CALL_Lread:
+    return "CALL Lread";
+  case I_CALL_Lwrite:
+    return "CALL Lwrite";
+  case I_CALL_Llength:
+    return "CALL Llength";
+  case I_CALL_Lstring:
+    return "CALL Lstring";
+  case I_CALL_Barray:
+    return "CALL Barray";
+  }
+  return "?";
+}
+
+/// Whether control may leave an instruction other than by falling through
+static bool endsSequence(uint8_t opcode) {
+  switch (opcode) {
+  case I_JMP:
+  case I_END:
+  case I_CJMPz:
+  case I_CJMPnz:
+  case I_CALL:
+  case I_CALLC:
+  case I_FAIL:
+  case I_TAGSWITCH:
+    return true;
+  }
+  return false;
+}
+
+void OpcodeProfile::record(uint8_t opcode) {
+  // Translated to nothing, so never separates fused instructions
+  if (opcode == I_LINE)
+    return;
+  ++executed;
+  history = (history << 8) | opcode;
+  historyLength = std::min(historyLength + 1, MaxLength);
+  for (int length = 2; length <= historyLength; ++length) {
+    uint32_t mask = (1u << (8 * length)) - 1;
+    ++counts[(static_cast<SequenceKey>(length) << 24) | (history & mask)];
+  }
+  if (endsSequence(opcode))
+    historyLength = 0;
+}
+
+void OpcodeProfile::print(std::ostream &out, size_t top) const {
+  out << fmt::format("executed {} instructions", executed) << std::endl;
+  for (int length = 2; length <= MaxLength; ++length) {
+    std::vector<std::pair<uint64_t, SequenceKey>> sequences;
+    for (auto [key, count] : counts) {
+      if (static_cast<int>(key >> 24) == length)
+        sequences.emplace_back(count, key);
+    }
+    std::sort(sequences.rbegin(), sequences.rend());
+    if (sequences.size() > top)
+      sequences.resize(top);
+    out << fmt::format("most frequent sequences of {} instructions:", length)
+        << std::endl;
+    for (auto [count, key] : sequences) {
+      std::string names;
+      for (int i = length - 1; i >= 0; --i) {
+        if (!names.empty())
+          names += "; ";
+        names += opcodeName((key >> (8 * i)) & 0xFF);
+      }
+      out << fmt::format("{:>12} {:5.2f}% {}", count,
+                         100.0 * count / executed, names)
+          << std::endl;
+    }
+  }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+
+namespace lama {
+
+/// Frequencies of opcode sequences executed one right after another.
+///
+/// Control transfers end a sequence, so the counted sequences are exactly
+/// the ones which may be fused into a superinstruction.
+class OpcodeProfile {
+public:
+  static constexpr int MaxLength = 3;
+
+  /// Called for each executed instruction with its opcode
+  void record(uint8_t opcode);
+
+  /// Prints \p top most frequent sequences of each length from 2 up to
+  /// #MaxLength
+  void print(std::ostream &out, size_t top) const;
+
+private:
+  /// Opcodes of a sequence packed into bytes, with the length in the top one
+  using SequenceKey = uint32_t;
+
+  std::unordered_map<SequenceKey, uint64_t> counts;
+  uint64_t executed = 0;
+  /// The last executed opcodes of the current sequence, the latest in the
+  /// lowest byte
+  uint32_t history = 0;
+  int historyLength = 0;
+};
+
+} // namespace lama
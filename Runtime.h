@@ -0,0 +1,175 @@
+#pragma once
+
+#include "Stack.h"
+#include "Value.h"
+#include "runtime/runtime_common.h"
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include "runtime/gc.h"
+
+extern lama::Value __start_custom_data;
+extern lama::Value __stop_custom_data;
+
+void __gc_init();
+
+extern lama::Value Lread();
+extern int32_t Lwrite(lama::Value boxedInt);
+extern int32_t Llength(void *p);
+extern void *Lstring(void *p);
+
+extern void *Belem(void *p, int i);
+extern void *Bstring(void *cstr);
+extern void *Bsta(void *v, int i, void *x);
+extern int Btag(void *d, int t, int n);
+[[noreturn]] extern void Bmatch_failure(void *v, char *fname, int line,
+                                        int col);
+extern int Bstring_patt(void *x, void *y);
+extern int Bclosure_tag_patt(void *x);
+extern int Bboxed_patt(void *x);
+extern int Bunboxed_patt(void *x);
+extern int Barray_tag_patt(void *x);
+extern int Bstring_tag_patt(void *x);
+extern int Bsexp_tag_patt(void *x);
+extern int Barray_patt(void *d, int n);
+}
+
+namespace lama {
+
+inline void initGlobalArea() {
+  for (Value *p = &__start_custom_data; p < &__stop_custom_data; ++p)
+    *p = 1;
+}
+
+inline Value &accessGlobal(uint32_t index) {
+  return (&__start_custom_data)[index];
+}
+
+/// Number of global variables the global area can hold
+inline size_t globalAreaCapacity() {
+  return &__stop_custom_data - &__start_custom_data;
+}
+
+inline Value renderToString(Value value) {
+  return pointerToValue(Lstring(valueToPointer(value)));
+}
+
+inline Value createString(const char *cstr) {
+  return pointerToValue(Bstring(const_cast<char *>(cstr)));
+}
+
+/// \return the string kept in the global \p cache, created on first use.
+/// Globals hold boxed zeros initially.
+inline Value createSharedString(Value &cache, const char *cstr) {
+  if (valueIsInt(cache))
+    cache = createString(cstr);
+  return cache;
+}
+
+/// Header of the object \p object refers to
+inline data *dataOf(Value object) { return TO_DATA(valueToPointer(object)); }
+
+/// Whether \p value refers to an object tagged with \p tag, e.g. ARRAY_TAG
+inline bool isObjectOf(Value value, int tag) {
+  return valueIsPtr(value) && TAG(dataOf(value)->data_header) == tag;
+}
+
+/// Elements of an array, or the tag hash followed by the fields of a sexp
+inline Value *wordsOf(Value object) {
+  return valueToPointer<Value>(object);
+}
+
+inline char *charsOf(Value string) { return valueToPointer<char>(string); }
+
+/// Btag without the runtime call
+inline bool isSexpOf(Value value, Value tagHash, int32_t nfields) {
+  return isObjectOf(value, SEXP_TAG) &&
+         TO_SEXP(valueToPointer(value))->tag == unboxInt(tagHash) &&
+         static_cast<int32_t>(LEN(dataOf(value)->data_header)) == nfields;
+}
+
+/// Reads the tag hash and the field count of \p value once, for matching it
+/// against several TAGs
+/// \return false if \p value is no sexp
+inline bool sexpShapeOf(Value value, Value &tagHash, int32_t &nfields) {
+  if (!isObjectOf(value, SEXP_TAG))
+    return false;
+  tagHash = boxInt(TO_SEXP(valueToPointer(value))->tag);
+  nfields = static_cast<int32_t>(LEN(dataOf(value)->data_header));
+  return true;
+}
+
+/// Barray_patt without the runtime call
+inline bool isArrayOf(Value value, int32_t nelems) {
+  return isObjectOf(value, ARRAY_TAG) &&
+         static_cast<int32_t>(LEN(dataOf(value)->data_header)) == nelems;
+}
+
+/// Belem for an \p index proven to be a number, e.g. by the verifier
+inline Value elementAtIntIndex(Value aggregate, Value index) {
+  if (valueIsInt(aggregate)) {
+    // Let the runtime report it
+    return pointerToValue(Belem(valueToPointer(aggregate), index));
+  }
+  int32_t i = unboxInt(index);
+  switch (TAG(dataOf(aggregate)->data_header)) {
+  case STRING_TAG:
+    return boxInt(charsOf(aggregate)[i]);
+  case SEXP_TAG:
+    return wordsOf(aggregate)[i + 1];
+  default:
+    return wordsOf(aggregate)[i];
+  }
+}
+
+/// Allocates an object of \p size bytes, header included, collecting the
+/// garbage first if the heap is full. Only the forward address is set.
+inline data *allocateObject(size_t size) {
+  auto *object = static_cast<data *>(alloc_uncleared(BYTES_TO_WORDS(size)));
+  object->forward_address = 0;
+  return object;
+}
+
+/// Copies \p n operands from the stack top into \p fields in the order they
+/// were pushed, the last one is on top
+inline void copyPushedOperands(size_t n, int *fields) {
+  const Value *operand = Stack::top() + n;
+  for (size_t i = 0; i < n; ++i)
+    fields[i] = *operand--;
+}
+
+/// Elements are taken from the operand stack top, last element on top. They
+/// stay on the stack, so a collection keeps them alive and updates them.
+inline Value createArray(size_t nargs) {
+  data *array = allocateObject(DATA_HEADER_SZ + nargs * MEMBER_SIZE);
+  array->data_header = ARRAY_TAG | (nargs << 3);
+  copyPushedOperands(nargs, reinterpret_cast<int *>(array->contents));
+  return pointerToValue(array->contents);
+}
+
+/// Fields are taken from the operand stack top like the elements of
+/// createArray()
+inline Value createSexp(Value tagHash, size_t nargs) {
+  auto *object = reinterpret_cast<sexp *>(
+      allocateObject(DATA_HEADER_SZ + (nargs + 1) * MEMBER_SIZE));
+  object->data_header = SEXP_TAG | (nargs << 3);
+  object->tag = unboxInt(tagHash);
+  copyPushedOperands(nargs, object->contents);
+  return pointerToValue(&object->tag);
+}
+
+/// Captured values are taken from the operand stack top, the first one on
+/// top
+inline Value createClosure(const void *entry, size_t nvars) {
+  data *closure = allocateObject(DATA_HEADER_SZ + (nvars + 1) * MEMBER_SIZE);
+  closure->data_header = CLOSURE_TAG | ((nvars + 1) << 3);
+  STORE_PTR(closure->contents, entry);
+  memcpy(closure->contents + MEMBER_SIZE, Stack::top() + 1,
+         nvars * MEMBER_SIZE);
+  return pointerToValue(closure->contents);
+}
+
+static constexpr char unknownFile[] = "<unknown file>";
+
+} // namespace lama
@@ -0,0 +1,124 @@
+#include "Stack.h"
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+
+using namespace lama;
+
+Value *Stack::data;
+sigjmp_buf Stack::overflowJmpBuf;
+
+Value *Stack::frame;
+size_t Stack::nargs;
+
+static struct sigaction previousSegvAction;
+
+static void handleSegv(int, siginfo_t *info, void *) {
+  const Value *address = static_cast<const Value *>(info->si_addr);
+  const Value *limit = Stack::limit();
+  if (address < limit && address >= limit - STACK_GUARD_SIZE) {
+    // The engine reports the error once out of the handler
+    siglongjmp(Stack::overflowJmpBuf, 1);
+  }
+  // Faulting again runs the previous handler
+  sigaction(SIGSEGV, &previousSegvAction, nullptr);
+}
+
+void Stack::reserve() {
+  if (data)
+    return;
+  size_t size = (STACK_GUARD_SIZE + STACK_SIZE) * sizeof(Value);
+  // Frame records keep stack addresses in values, so they must fit
+  void *mapping =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0);
+  if (mapping == MAP_FAILED) {
+    runtimeError("failed to map {} bytes for the stack", size);
+  }
+  if (mprotect(mapping, STACK_GUARD_SIZE * sizeof(Value), PROT_NONE) != 0) {
+    runtimeError("failed to protect the stack guard area");
+  }
+  data = static_cast<Value *>(mapping) + STACK_GUARD_SIZE;
+}
+
+const Value *Stack::limit() {
+  reserve();
+  return data;
+}
+
+void Stack::init() {
+  reserve();
+  struct sigaction action = {};
+  action.sa_sigaction = handleSegv;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previousSegvAction);
+
+  // The collector reads one word past the bottom when fixing references
+  __gc_stack_bottom = data + STACK_SIZE - 1;
+  // A record with no caller marks the bottom
+  frame = __gc_stack_bottom - FrameRecordSize;
+  frame[FR_CallerFrame] = boxPointer(nullptr);
+  frame[FR_ReturnAddress] = 0;
+  frame[FR_Nargs] = boxInt(0);
+  nargs = 0;
+  // Two arguments to main: argc and argv
+  __gc_stack_top = frame - 3;
+}
+
+void Stack::beginFunction(const FunctionDescriptor &function,
+                          const void *returnAddress) {
+  Value *record = top() + 1 - FrameRecordSize;
+  if (function.checksRoom)
+    checkRoom(function, record);
+  record[FR_CallerFrame] = boxPointer(frame);
+  record[FR_ReturnAddress] = pointerToValue(returnAddress);
+  enterFrame(function, record);
+}
+
+void Stack::tailCall(const FunctionDescriptor &function) {
+  size_t noperands = function.nargs + function.isClosure;
+  // The caller expects the result right where the current arguments are
+  int32_t current = unboxInt(frame[FR_Nargs]);
+  Value *end = frame + FrameRecordSize + (current >> 1) + (current & 1);
+  Value *record = end - noperands - FrameRecordSize;
+  if (function.checksRoom)
+    checkRoom(function, record);
+  Value callerFrame = frame[FR_CallerFrame];
+  Value returnAddress = frame[FR_ReturnAddress];
+  memmove(record + FrameRecordSize, top() + 1, noperands * sizeof(Value));
+  record[FR_CallerFrame] = callerFrame;
+  record[FR_ReturnAddress] = returnAddress;
+  enterFrame(function, record);
+}
+
+void Stack::checkRoom(const FunctionDescriptor &function,
+                      const Value *record) {
+  if (record - function.nlocals - function.maxOperandStackSize <
+      data) {
+    runtimeError("might exhaust stack");
+  }
+}
+
+void Stack::enterFrame(const FunctionDescriptor &function, Value *record) {
+  record[FR_Nargs] = boxInt((function.nargs << 1) | function.isClosure);
+  frame = record;
+  nargs = function.nargs;
+  top() = record - function.nlocals - 1;
+  prefillLocals(function, record);
+}
+
+const void *Stack::endFunction() {
+  if (isEmpty()) {
+    runtimeError("no function to end");
+  }
+  Value ret = peakOperand();
+  int32_t current = unboxInt(frame[FR_Nargs]);
+  const void *returnAddress = valueToPointer(frame[FR_ReturnAddress]);
+  // The result replaces the arguments
+  top() = frame + FrameRecordSize + (current >> 1) + (current & 1) - 1;
+  frame = unboxPointer(frame[FR_CallerFrame]);
+  nargs = unboxInt(frame[FR_Nargs]) >> 1;
+  pushOperand(ret);
+  return returnAddress;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "Error.h"
+#include "Value.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <setjmp.h>
+#include <sys/types.h>
+
+extern "C" {
+extern lama::Value *__gc_stack_top;
+extern lama::Value *__gc_stack_bottom;
+}
+
+/// Words reserved for the stack, memory is committed as it grows
+#define STACK_SIZE (1 << 24)
+/// Words right below the stack that fault on access
+#define STACK_GUARD_SIZE (1 << 16)
+
+namespace lama {
+
+/// What a call needs to know about the function it enters, so that it
+/// sets up the frame without decoding BEGIN
+struct FunctionDescriptor {
+  /// Code right after the BEGIN, each engine uses its own representation
+  /// of code addresses
+  const void *entry;
+  uint32_t nargs;
+  uint32_t nlocals;
+  /// See FunctionInfo::nprefilledLocals
+  uint32_t nprefilledLocals;
+  /// Operands the function may keep on the stack at once
+  uint32_t maxOperandStackSize;
+  bool isClosure;
+  /// See Stack::needsRoomCheck()
+  bool checksRoom;
+};
+
+/// Lama value stack shared by all execution engines.
+///
+/// The stack grows down, #top() points to the first free slot,
+/// so that the GC scans exactly the live part of it.
+///
+/// Frames live on the stack itself. A call leaves the arguments and the
+/// closure where the caller pushed them, and puts a record of
+/// #FrameRecordSize words right below them, followed by the locals and
+/// the operands. The record holds the frame of the caller and the
+/// return address. The GC skips all of its words: the frame pointer and
+/// the argument count are boxed, and code addresses never point into
+/// the heap.
+///
+/// Overflow is caught by the guard area below the stack rather than by
+/// comparing on every call. Each frame touches its record, so a frame no
+/// larger than the guard area cannot skip over it.
+struct Stack {
+
+  /// Also installs the handler catching overflow, after the runtime has
+  /// installed its own
+  /// \pre #overflowJmpBuf is set
+  static void init();
+
+  /// Where an access to the guard area jumps to, with 1. Set by the engine
+  /// running the program, which reports the exhausted stack from there.
+  static sigjmp_buf overflowJmpBuf;
+
+  /// Whether a frame of that size may reach past the guard area, so that
+  /// entering it has to check the room explicitly
+  static bool needsRoomCheck(size_t nlocals, size_t maxOperandStackSize) {
+    return FrameRecordSize + nlocals + maxOperandStackSize >=
+           STACK_GUARD_SIZE;
+  }
+
+  static bool isEmpty() {
+    return frame == __gc_stack_bottom - FrameRecordSize;
+  }
+  static bool isNotEmpty() { return !isEmpty(); }
+  static Value getClosure() { return frame[FrameRecordSize + nargs]; }
+  /// Identifies the running function until it ends
+  static const Value *currentFrame() { return frame; }
+
+  static Value &accessLocal(ssize_t index) { return frame[-index - 1]; }
+  static Value &accessArg(ssize_t index) {
+    return frame[FrameRecordSize + nargs - 1 - index];
+  }
+
+  static void allocateNOperands(size_t noperands) { top() -= noperands; }
+
+  static void pushOperand(Value value) {
+    *top() = value;
+    --top();
+  }
+  static Value peakOperand() { return top()[1]; }
+  static Value popOperand() {
+    ++top();
+    return *top();
+  }
+  static void popNOperands(size_t noperands) { top() += noperands; }
+
+  static void pushIntOperand(int32_t operand) { pushOperand(boxInt(operand)); }
+  static int32_t popIntOperand() { return unboxIntOperand(popOperand()); }
+  /// Checks an operand taken from the stack top is a number
+  static int32_t unboxIntOperand(Value operand) {
+    if (!valueIsInt(operand)) {
+      runtimeError(
+          "expected a (boxed) number at the operand stack top, found {:#x}",
+          operand);
+    }
+    return unboxInt(operand);
+  }
+
+  /// Checks both operands of a binary operation are numbers, reporting
+  /// the right-hand side first as if it was taken from the stack first
+  static void checkIntOperands(Value lhs, Value rhs) {
+    if (!valuesAreInts(lhs, rhs)) {
+      unboxIntOperand(rhs);
+      unboxIntOperand(lhs);
+    }
+  }
+
+  /// Enters \p function, its arguments and closure are on the stack top
+  /// \param returnAddress is opaque to the stack, see
+  /// FunctionDescriptor::entry
+  static void beginFunction(const FunctionDescriptor &function,
+                            const void *returnAddress);
+  /// Whether beginFunction() of \p function only has to fill in the record
+  static bool isPlain(const FunctionDescriptor &function) {
+    return !function.checksRoom && function.nprefilledLocals == 0;
+  }
+  /// beginFunction() of a function known to be plain, see isPlain(),
+  /// inlined into the call
+  static void beginPlainFunction(const FunctionDescriptor &function,
+                                 const void *returnAddress) {
+    Value *record = top() + 1 - FrameRecordSize;
+    record[FR_CallerFrame] = boxPointer(frame);
+    record[FR_ReturnAddress] = pointerToValue(returnAddress);
+    record[FR_Nargs] = boxInt((function.nargs << 1) | function.isClosure);
+    frame = record;
+    nargs = function.nargs;
+    top() = record - function.nlocals - 1;
+  }
+  /// Replaces the current function with \p function, which returns to
+  /// the caller of the current one. Its arguments and closure are on the
+  /// stack top.
+  static void tailCall(const FunctionDescriptor &function);
+  /// tailCall() of the current function by itself, whose frame stays
+  static void tailCallSelf(const FunctionDescriptor &function) {
+    Value *arguments = frame + FrameRecordSize;
+    for (size_t i = 0; i < function.nargs + function.isClosure; ++i)
+      arguments[i] = top()[i + 1];
+    top() = frame - function.nlocals - 1;
+    prefillLocals(function, frame);
+  }
+  /// \return return address passed by the caller
+  static const void *endFunction();
+
+  static Value *&top() { return __gc_stack_top; }
+  /// Lowest address the stack may grow to
+  static const Value *limit();
+
+private:
+  /// Maps the stack and its guard area unless already mapped
+  static void reserve();
+
+  /// Lowest address of the stack, right above the guard area
+  static Value *data;
+
+  /// Words of a frame record, from its lowest address
+  enum FrameRecordWord {
+    FR_CallerFrame,
+    FR_ReturnAddress,
+    /// Arguments without the closure, shifted left by one, with the
+    /// lowest bit telling whether a closure follows
+    FR_Nargs,
+    FrameRecordSize,
+  };
+
+  /// Stack addresses are word aligned, so the lowest bit is free
+  static Value boxPointer(const Value *pointer) {
+    return pointerToValue(pointer) | 1;
+  }
+  static Value *unboxPointer(Value value) {
+    return valueToPointer<Value>(value & ~1);
+  }
+
+  /// Record of the current function
+  static Value *frame;
+  /// Arguments of the current function, cached from its record
+  static size_t nargs;
+
+  static void checkRoom(const FunctionDescriptor &function,
+                        const Value *record);
+  /// Sets up the locals of \p function whose record is at \p record
+  static void enterFrame(const FunctionDescriptor &function, Value *record);
+  /// Fills the locals of \p function below \p record that may be seen
+  /// before they are assigned with some boxed values, so that the GC skips
+  /// them, the rest of the locals is assigned before anything may see it
+  static void prefillLocals(const FunctionDescriptor &function,
+                            Value *record) {
+    memset(record - function.nprefilledLocals, 1,
+           function.nprefilledLocals * sizeof(Value));
+  }
+};
+
+} // namespace lama
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "Stack.h"
+#include "Value.h"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace lama {
+
+class ByteFile;
+struct CodeInfo;
+
+/// Operations of the threaded code.
+///
+/// Mostly mirror the bytecode instructions, but variable designations
+/// are folded into the operation.
+///
+/// Up to two topmost operands may be cached in registers instead of the
+/// stack, operations with the _Sn suffix expect n operands to be cached.
+/// Operations without the suffix run with nothing cached.
+///
+/// Operations named after several instructions are superinstructions
+/// executing the whole sequence with a single dispatch. They were chosen
+/// after the sequences most frequently executed by the --profile mode.
+///
+/// Operations with the _Int infix do not check the operands the verifier
+/// has proven to be numbers, see InstInfo::hasIntOperands.
+///
+/// ELEM and STA operations are quickened: on the first execution they
+/// rewrite their handler into the variant for the kind of the aggregate
+/// they met, named after the kind. Such a variant only checks the kind,
+/// and on a mismatch rewrites itself into the _Generic variant for good.
+///
+/// CALLC is quickened the same way into a monomorphic inline cache: the
+/// first execution stores the descriptor of the closure it calls in the
+/// operand slot after the argument count. CALLC_Mono compares it with the
+/// descriptor of the closure, on a hit it enters the function with the
+/// inlined Stack::beginPlainFunction(), on a miss it rewrites itself into
+/// CALLC_Generic for good. Functions that are not plain are never cached.
+///
+/// Loop headers, see InstInfo::isLoopHeader, start with a LOOP counting
+/// down the iterations until the loop is hot. A hot loop is traced: one
+/// iteration runs in a copy of its function whose blocks start with a
+/// RECORD noting the path taken, and the path is translated once more into
+/// a trace, see translateTrace(). The LOOP is then quickened into
+/// LOOP_Trace entering the trace, or into LOOP_Cold once tracing the loop
+/// failed too often, and the jumps to the header skip it from then on.
+/// TAIL_CALL_Self closes a loop through a tail call of a function to
+/// itself.
+///
+/// A trace starts with a GUARD_Int for each variable it reads before
+/// assigning it that held a number all through the recorded iteration,
+/// leaving the trace for the code after the LOOP if the variable holds
+/// anything else. Numbers the guards and the trace itself prove flow into
+/// the _Int variants of BINOP, CONST_BINOP and CJMP, and jumps back to the
+/// header skip the guards as long as the guarded variables still hold
+/// numbers.
+#define LAMA_THREADED_OPS(X)                                                   \
+  X(BINOP_Add)                                                                 \
+  X(BINOP_Sub)                                                                 \
+  X(BINOP_Mul)                                                                 \
+  X(BINOP_Div)                                                                 \
+  X(BINOP_Mod)                                                                 \
+  X(BINOP_Lt)                                                                  \
+  X(BINOP_Leq)                                                                 \
+  X(BINOP_Gt)                                                                  \
+  X(BINOP_Geq)                                                                 \
+  X(BINOP_Eq)                                                                  \
+  X(BINOP_Neq)                                                                 \
+  X(BINOP_And)                                                                 \
+  X(BINOP_Or)                                                                  \
+  X(CONST)                                                                     \
+  X(STRING)                                                                    \
+  X(SEXP)                                                                      \
+  X(STA)                                                                       \
+  X(JMP)                                                                       \
+  X(END)                                                                       \
+  X(DROP)                                                                      \
+  X(DUP)                                                                       \
+  X(SWAP)                                                                      \
+  X(ELEM)                                                                      \
+  X(LD_Global)                                                                 \
+  X(LD_Local)                                                                  \
+  X(LD_Arg)                                                                    \
+  X(LD_Access)                                                                 \
+  X(LDA_Global)                                                                \
+  X(LDA_Local)                                                                 \
+  X(LDA_Arg)                                                                   \
+  X(LDA_Access)                                                                \
+  X(ST_Global)                                                                 \
+  X(ST_Local)                                                                  \
+  X(ST_Arg)                                                                    \
+  X(ST_Access)                                                                 \
+  X(CJMPz)                                                                     \
+  X(CJMPnz)                                                                    \
+  X(CLOSURE)                                                                   \
+  X(CALLC)                                                                     \
+  X(CALL)                                                                      \
+  X(TAIL_CALLC)                                                                \
+  X(TAIL_CALL)                                                                 \
+  X(TAG)                                                                       \
+  X(ARRAY)                                                                     \
+  X(FAIL)                                                                      \
+  X(TAGSWITCH)                                                                 \
+  X(PATT_StrCmp)                                                               \
+  X(PATT_String)                                                               \
+  X(PATT_Array)                                                                \
+  X(PATT_Sexp)                                                                 \
+  X(PATT_Boxed)                                                                \
+  X(PATT_UnBoxed)                                                              \
+  X(PATT_Closure)                                                              \
+  X(CALL_Lread)                                                                \
+  X(CALL_Lwrite)                                                               \
+  X(CALL_Llength)                                                              \
+  X(CALL_Lstring)                                                              \
+  X(CALL_Barray)                                                               \
+  X(BINOP_Add_S1)                                                              \
+  X(BINOP_Sub_S1)                                                              \
+  X(BINOP_Mul_S1)                                                              \
+  X(BINOP_Div_S1)                                                              \
+  X(BINOP_Mod_S1)                                                              \
+  X(BINOP_Lt_S1)                                                               \
+  X(BINOP_Leq_S1)                                                              \
+  X(BINOP_Gt_S1)                                                               \
+  X(BINOP_Geq_S1)                                                              \
+  X(BINOP_Eq_S1)                                                               \
+  X(BINOP_Neq_S1)                                                              \
+  X(BINOP_And_S1)                                                              \
+  X(BINOP_Or_S1)                                                               \
+  X(BINOP_Add_S2)                                                              \
+  X(BINOP_Sub_S2)                                                              \
+  X(BINOP_Mul_S2)                                                              \
+  X(BINOP_Div_S2)                                                              \
+  X(BINOP_Mod_S2)                                                              \
+  X(BINOP_Lt_S2)                                                               \
+  X(BINOP_Leq_S2)                                                              \
+  X(BINOP_Gt_S2)                                                               \
+  X(BINOP_Geq_S2)                                                              \
+  X(BINOP_Eq_S2)                                                               \
+  X(BINOP_Neq_S2)                                                              \
+  X(BINOP_And_S2)                                                              \
+  X(BINOP_Or_S2)                                                               \
+  X(CONST_S0)                                                                  \
+  X(CONST_S1)                                                                  \
+  X(CONST_S2)                                                                  \
+  X(LD_Global_S0)                                                              \
+  X(LD_Local_S0)                                                               \
+  X(LD_Arg_S0)                                                                 \
+  X(LD_Access_S0)                                                              \
+  X(LD_Global_S1)                                                              \
+  X(LD_Local_S1)                                                               \
+  X(LD_Arg_S1)                                                                 \
+  X(LD_Access_S1)                                                              \
+  X(LD_Global_S2)                                                              \
+  X(LD_Local_S2)                                                               \
+  X(LD_Arg_S2)                                                                 \
+  X(LD_Access_S2)                                                              \
+  X(ST_Global_S1)                                                              \
+  X(ST_Local_S1)                                                               \
+  X(ST_Arg_S1)                                                                 \
+  X(ST_Access_S1)                                                              \
+  X(DUP_S1)                                                                    \
+  X(DUP_S2)                                                                    \
+  X(DROP_S2)                                                                   \
+  X(SWAP_S2)                                                                   \
+  X(ELEM_S2)                                                                   \
+  X(CJMPz_S1)                                                                  \
+  X(CJMPnz_S1)                                                                 \
+  X(FLUSH_S1)                                                                  \
+  X(FLUSH_S2)                                                                  \
+  X(SPILL_S2)                                                                  \
+  X(CONST_BINOP_Add_S1)                                                        \
+  X(CONST_BINOP_Sub_S1)                                                        \
+  X(CONST_BINOP_Mul_S1)                                                        \
+  X(CONST_BINOP_Div_S1)                                                        \
+  X(CONST_BINOP_Mod_S1)                                                        \
+  X(CONST_BINOP_Lt_S1)                                                         \
+  X(CONST_BINOP_Leq_S1)                                                        \
+  X(CONST_BINOP_Gt_S1)                                                         \
+  X(CONST_BINOP_Geq_S1)                                                        \
+  X(CONST_BINOP_Eq_S1)                                                         \
+  X(CONST_BINOP_Neq_S1)                                                        \
+  X(CONST_BINOP_And_S1)                                                        \
+  X(CONST_BINOP_Or_S1)                                                         \
+  X(CONST_ELEM_S1)                                                             \
+  X(DUP_CONST_ELEM_S0)                                                         \
+  X(DUP_CONST_ELEM_S1)                                                         \
+  X(DUP_CONST_ELEM_S2)                                                         \
+  X(DUP_TAG_CJMPz)                                                             \
+  X(DUP_TAG_CJMPnz)                                                            \
+  X(DUP_TAG_CJMPz_S1)                                                          \
+  X(DUP_TAG_CJMPnz_S1)                                                         \
+  X(ST_Global_DROP)                                                            \
+  X(ST_Local_DROP)                                                             \
+  X(ST_Arg_DROP)                                                               \
+  X(ST_Access_DROP)                                                            \
+  X(DROP_DROP)                                                                 \
+  X(STRING_Shared)                                                             \
+  X(BINOP_Add_Int_S1)                                                          \
+  X(BINOP_Sub_Int_S1)                                                          \
+  X(BINOP_Mul_Int_S1)                                                          \
+  X(BINOP_Div_Int_S1)                                                          \
+  X(BINOP_Mod_Int_S1)                                                          \
+  X(BINOP_Lt_Int_S1)                                                           \
+  X(BINOP_Leq_Int_S1)                                                          \
+  X(BINOP_Gt_Int_S1)                                                           \
+  X(BINOP_Geq_Int_S1)                                                          \
+  X(BINOP_Eq_Int_S1)                                                           \
+  X(BINOP_Neq_Int_S1)                                                          \
+  X(BINOP_And_Int_S1)                                                          \
+  X(BINOP_Or_Int_S1)                                                           \
+  X(BINOP_Add_Int_S2)                                                          \
+  X(BINOP_Sub_Int_S2)                                                          \
+  X(BINOP_Mul_Int_S2)                                                          \
+  X(BINOP_Div_Int_S2)                                                          \
+  X(BINOP_Mod_Int_S2)                                                          \
+  X(BINOP_Lt_Int_S2)                                                           \
+  X(BINOP_Leq_Int_S2)                                                          \
+  X(BINOP_Gt_Int_S2)                                                           \
+  X(BINOP_Geq_Int_S2)                                                          \
+  X(BINOP_Eq_Int_S2)                                                           \
+  X(BINOP_Neq_Int_S2)                                                          \
+  X(BINOP_And_Int_S2)                                                          \
+  X(BINOP_Or_Int_S2)                                                           \
+  X(CONST_BINOP_Add_Int_S1)                                                    \
+  X(CONST_BINOP_Sub_Int_S1)                                                    \
+  X(CONST_BINOP_Mul_Int_S1)                                                    \
+  X(CONST_BINOP_Div_Int_S1)                                                    \
+  X(CONST_BINOP_Mod_Int_S1)                                                    \
+  X(CONST_BINOP_Lt_Int_S1)                                                     \
+  X(CONST_BINOP_Leq_Int_S1)                                                    \
+  X(CONST_BINOP_Gt_Int_S1)                                                     \
+  X(CONST_BINOP_Geq_Int_S1)                                                    \
+  X(CONST_BINOP_Eq_Int_S1)                                                     \
+  X(CONST_BINOP_Neq_Int_S1)                                                    \
+  X(CONST_BINOP_And_Int_S1)                                                    \
+  X(CONST_BINOP_Or_Int_S1)                                                     \
+  X(CJMPz_Int_S1)                                                              \
+  X(CJMPnz_Int_S1)                                                             \
+  X(ELEM_Array)                                                                \
+  X(ELEM_Sexp)                                                                 \
+  X(ELEM_String)                                                               \
+  X(ELEM_Generic)                                                              \
+  X(ELEM_Array_S2)                                                             \
+  X(ELEM_Sexp_S2)                                                              \
+  X(ELEM_String_S2)                                                            \
+  X(ELEM_Generic_S2)                                                           \
+  X(CONST_ELEM_Array_S1)                                                       \
+  X(CONST_ELEM_Sexp_S1)                                                        \
+  X(CONST_ELEM_String_S1)                                                      \
+  X(CONST_ELEM_Generic_S1)                                                     \
+  X(DUP_CONST_ELEM_Array_S0)                                                   \
+  X(DUP_CONST_ELEM_Sexp_S0)                                                    \
+  X(DUP_CONST_ELEM_String_S0)                                                  \
+  X(DUP_CONST_ELEM_Generic_S0)                                                 \
+  X(DUP_CONST_ELEM_Array_S1)                                                   \
+  X(DUP_CONST_ELEM_Sexp_S1)                                                    \
+  X(DUP_CONST_ELEM_String_S1)                                                  \
+  X(DUP_CONST_ELEM_Generic_S1)                                                 \
+  X(DUP_CONST_ELEM_Array_S2)                                                   \
+  X(DUP_CONST_ELEM_Sexp_S2)                                                    \
+  X(DUP_CONST_ELEM_String_S2)                                                  \
+  X(DUP_CONST_ELEM_Generic_S2)                                                 \
+  X(STA_Array)                                                                 \
+  X(STA_Sexp)                                                                  \
+  X(STA_String)                                                                \
+  X(STA_Generic)                                                               \
+  X(CALLC_Mono)                                                                \
+  X(CALLC_Generic)                                                             \
+  X(LOOP)                                                                      \
+  X(LOOP_Trace)                                                                \
+  X(LOOP_Cold)                                                                 \
+  X(RECORD)                                                                    \
+  X(GUARD_Int_Global)                                                          \
+  X(GUARD_Int_Local)                                                           \
+  X(GUARD_Int_Arg)                                                             \
+  X(TAIL_CALL_Self)                                                            \
+  X(TAG_S1)                                                                    \
+  X(TAG_CJMPz_S1)                                                              \
+  X(TAG_CJMPnz_S1)                                                             \
+  X(ARRAY_S1)                                                                  \
+  X(ARRAY_CJMPz_S1)                                                            \
+  X(ARRAY_CJMPnz_S1)                                                           \
+  X(PATT_String_S1)                                                            \
+  X(PATT_String_CJMPz_S1)                                                      \
+  X(PATT_String_CJMPnz_S1)                                                     \
+  X(PATT_Array_S1)                                                             \
+  X(PATT_Array_CJMPz_S1)                                                       \
+  X(PATT_Array_CJMPnz_S1)                                                      \
+  X(PATT_Sexp_S1)                                                              \
+  X(PATT_Sexp_CJMPz_S1)                                                        \
+  X(PATT_Sexp_CJMPnz_S1)                                                       \
+  X(PATT_Boxed_S1)                                                             \
+  X(PATT_Boxed_CJMPz_S1)                                                       \
+  X(PATT_Boxed_CJMPnz_S1)                                                      \
+  X(PATT_UnBoxed_S1)                                                           \
+  X(PATT_UnBoxed_CJMPz_S1)                                                     \
+  X(PATT_UnBoxed_CJMPnz_S1)                                                    \
+  X(PATT_Closure_S1)                                                           \
+  X(PATT_Closure_CJMPz_S1)                                                     \
+  X(PATT_Closure_CJMPnz_S1)
+
+enum ThreadedOp {
+#define LAMA_THREADED_OP_ENUM(name) T_##name,
+  LAMA_THREADED_OPS(LAMA_THREADED_OP_ENUM)
+#undef LAMA_THREADED_OP_ENUM
+  T_Count,
+};
+
+/// A word of threaded code.
+///
+/// Each operation is a handler address followed by its pre-decoded
+/// operands.
+union Slot {
+  const void *handler;
+  int32_t word;
+  Value value;
+  const char *string;
+  const Slot *target;
+  const FunctionDescriptor *function;
+};
+
+static_assert(sizeof(Slot) == sizeof(void *));
+
+/// Iterations a loop runs before it is traced unless told otherwise, see
+/// LOOP
+static constexpr int32_t HotLoopIterations = 1000;
+
+/// Threaded code translated while the program runs
+struct ThreadedFragment {
+  std::vector<Slot> slots;
+  /// Bytecode offset of the operation starting at the slot, -1 for operands
+  std::vector<int32_t> sourceOffsets;
+};
+
+/// Bytecode translated into direct-threaded code.
+struct ThreadedCode {
+  std::vector<Slot> slots;
+  /// Bytecode offset of the operation starting at the slot, -1 for operands
+  std::vector<int32_t> sourceOffsets;
+  /// In the order of CodeInfo::functions, the main one first. Entries are
+  /// slot pointers. Never resized after translation starts, as CALL and
+  /// CLOSURE point into it.
+  std::vector<FunctionDescriptor> functions;
+  /// Slot index of the operation translated from each bytecode offset, -1
+  /// for offsets translated as a part of another operation. Nothing is
+  /// cached where a block starts.
+  std::vector<int32_t> slotOf;
+  /// Slot indices of the targets of the jumps to each LOOP, by the slot
+  /// index of the LOOP. The trace of the loop takes them over.
+  std::unordered_map<int32_t, std::vector<int32_t>> loopJumps;
+  /// Recording copies and traces. Each stays where it is, as they jump
+  /// into each other and into #slots.
+  std::vector<std::unique_ptr<ThreadedFragment>> fragments;
+  /// What the code was translated from, kept for translating fragments
+  ByteFile *byteFile = nullptr;
+  const CodeInfo *codeInfo = nullptr;
+  /// Iterations a loop runs before it is traced, see LOOP
+  int32_t hotLoopIterations = HotLoopIterations;
+
+  /// \pre \p ip points past the handler of an operation being executed
+  /// \return offset of that operation in the bytefile as loaded
+  int32_t sourceOffsetOf(const Slot *ip) const;
+};
+
+/// Translates all reachable code of a verified bytefile.
+/// \param hotLoopIterations see ThreadedCode::hotLoopIterations
+ThreadedCode translate(ByteFile &byteFile, const CodeInfo &codeInfo,
+                       int32_t hotLoopIterations = HotLoopIterations);
+
+/// Translates the function at \p index once more into a new fragment of
+/// \p code, starting each block with a RECORD
+const ThreadedFragment &translateForRecording(ThreadedCode &code,
+                                              int32_t index);
+
+/// Variables holding numbers where an iteration of a loop starts, see
+/// translateTrace()
+struct TraceKinds {
+  std::vector<bool> intGlobals;
+  std::vector<bool> intArgs;
+  std::vector<bool> intLocals;
+};
+
+/// Translates the path an iteration of a loop took into a new fragment of
+/// \p code. Jumps along the path disappear, conditional jumps leave the
+/// trace for the code of \p code where the path did not go, and blocks are
+/// joined without flushing the cached operands.
+///
+/// \param index of the function of the loop in CodeInfo::functions
+/// \param path bytecode offsets of the blocks the iteration went through,
+/// from the loop header up to the last block before the header again
+/// \param kinds variables that held numbers both when the iteration
+/// started and when it ended, the ones the trace reads get guarded
+/// \return nullptr if the path can not be traced
+const ThreadedFragment *translateTrace(ThreadedCode &code, int32_t index,
+                                       const std::vector<int32_t> &path,
+                                       const TraceKinds &kinds);
+
+/// \return handler addresses indexed by #ThreadedOp
+const void *const *threadedHandlers();
+
+/// Quickening rewrites handlers of \p code as it runs
+void interpret(ThreadedCode &code);
+
+} // namespace lama
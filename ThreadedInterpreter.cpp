@@ -0,0 +1,963 @@
+#include "ByteFile.h"
+#include "Error.h"
+#include "Inst.h"
+#include "Runtime.h"
+#include "Stack.h"
+#include "ThreadedCode.h"
+#include "Value.h"
+#include "Verifier.h"
+#include <algorithm>
+#include <unordered_map>
+
+using namespace lama;
+
+static const void *handlers[T_Count];
+
+static Value &accessVar(int32_t designation, int32_t index) {
+  switch (designation) {
+  case LOC_Global:
+    return accessGlobal(index);
+  case LOC_Local:
+    return Stack::accessLocal(index);
+  case LOC_Arg:
+    return Stack::accessArg(index);
+  case LOC_Access:
+    Value *closure = valueToPointer<Value>(Stack::getClosure());
+    return closure[index + 1];
+  }
+  runtimeError("unsupported variable designation {:#x}", designation);
+}
+
+/// \return how far the variant of a quickened ELEM or STA for
+/// \p aggregate is from its _Array variant
+static int quickenedKindOf(Value aggregate, Value index) {
+  if (valueIsInt(index) && valueIsPtr(aggregate)) {
+    switch (TAG(dataOf(aggregate)->data_header)) {
+    case ARRAY_TAG:
+      return 0;
+    case SEXP_TAG:
+      return 1;
+    case STRING_TAG:
+      return 2;
+    }
+  }
+  return 3;
+}
+
+/// Rewrites the handler of an operation, so the code must be mutable
+static void quicken(const Slot *handlerSlot, ThreadedOp op) {
+  const_cast<Slot *>(handlerSlot)->handler = handlers[op];
+}
+
+/// \return descriptor of the closure called with \p nargs arguments
+static const FunctionDescriptor *closureFunction(int32_t nargs) {
+  Value closure = Stack::top()[nargs + 1];
+  return valueToPointer<const FunctionDescriptor>(
+      *valueToPointer<Value>(closure));
+}
+
+static Value genericElement(Value aggregate, Value index) {
+  return pointerToValue(Belem(valueToPointer(aggregate), index));
+}
+
+namespace {
+
+/// Tracing of a loop is given up after failing that many times
+constexpr int MaxTraceAttempts = 4;
+/// Longest path traced, in blocks
+constexpr size_t MaxTraceBlocks = 64;
+
+/// Records the path an iteration of a hot loop takes and installs the trace
+/// translated from it, see LOOP and RECORD. One loop is recorded at a time.
+class Tracer {
+public:
+  /// Starts recording the loop whose LOOP is at \p loop, as it got hot
+  /// \return where to go on, in the recording copy unless given up
+  const Slot *startRecording(ThreadedCode &code, const Slot *loop);
+  /// Called by a RECORD whose operands are at \p operands
+  /// \return where to go on
+  const Slot *record(ThreadedCode &code, const Slot *operands);
+
+private:
+  /// Makes the jumps and the calls to the header of the loop whose LOOP is
+  /// at \p loop go to \p entry instead
+  static void redirect(ThreadedCode &code, const Slot *loop, int32_t function,
+                       const Slot *entry);
+  /// Notes which variables of the recorded frame hold numbers, keeping
+  /// only the ones noted before unless \p first
+  void noteKinds(const ThreadedCode &code, bool first);
+
+  /// Recording copies by function index
+  std::unordered_map<int32_t, const ThreadedFragment *> copies;
+  /// Recordings started by LOOP
+  std::unordered_map<const Slot *, int> attempts;
+
+  /// LOOP of the loop being recorded, nullptr if none is
+  const Slot *loop = nullptr;
+  int32_t function;
+  /// Frame of the recorded iteration, blocks of other frames are not on
+  /// the path
+  const Value *frame;
+  std::vector<int32_t> path;
+  /// Variables holding numbers when the recorded iteration started
+  TraceKinds kinds;
+} tracer;
+
+} // namespace
+
+void Tracer::redirect(ThreadedCode &code, const Slot *loop, int32_t function,
+                      const Slot *entry) {
+  for (int32_t index : code.loopJumps[loop - code.slots.data()])
+    code.slots[index].target = entry;
+  FunctionDescriptor &descriptor = code.functions[function];
+  if (descriptor.entry == loop)
+    descriptor.entry = entry;
+}
+
+static void noteKind(std::vector<bool> &isInt, size_t index, Value value,
+                     bool first) {
+  if (first)
+    isInt[index] = valueIsInt(value);
+  else
+    isInt[index] = isInt[index] && valueIsInt(value);
+}
+
+void Tracer::noteKinds(const ThreadedCode &code, bool first) {
+  const FunctionDescriptor &descriptor = code.functions[function];
+  if (first) {
+    kinds.intGlobals.resize(code.byteFile->getGlobalAreaSize());
+    kinds.intArgs.resize(descriptor.nargs);
+    kinds.intLocals.resize(descriptor.nlocals);
+  }
+  for (size_t i = 0; i < kinds.intGlobals.size(); ++i)
+    noteKind(kinds.intGlobals, i, accessGlobal(i), first);
+  for (size_t i = 0; i < kinds.intArgs.size(); ++i)
+    noteKind(kinds.intArgs, i, Stack::accessArg(i), first);
+  for (size_t i = 0; i < kinds.intLocals.size(); ++i)
+    noteKind(kinds.intLocals, i, Stack::accessLocal(i), first);
+}
+
+const Slot *Tracer::startRecording(ThreadedCode &code, const Slot *loop) {
+  Slot *operands = const_cast<Slot *>(loop + 1);
+  int32_t index = operands[1].word;
+  int &attempt = attempts[loop];
+  if (++attempt > MaxTraceAttempts) {
+    quicken(loop, T_LOOP_Cold);
+    redirect(code, loop, index, loop + 3);
+    return loop + 3;
+  }
+  // Backs off, so that a loop failing to trace only rarely pays for it
+  operands[0].word = code.hotLoopIterations << attempt;
+  const ThreadedFragment *&copy = copies[index];
+  if (!copy)
+    copy = &translateForRecording(code, index);
+  // The RECORD of the header is the first operation translated from it
+  int32_t header = code.sourceOffsets[loop - code.slots.data()];
+  auto found = std::find(copy->sourceOffsets.begin(),
+                         copy->sourceOffsets.end(), header);
+  if (found == copy->sourceOffsets.end())
+    return loop + 3;
+  this->loop = loop;
+  function = index;
+  frame = Stack::currentFrame();
+  path.assign(1, header);
+  noteKinds(code, true);
+  // Past the RECORD and its operands
+  return &copy->slots[found - copy->sourceOffsets.begin() + 3];
+}
+
+const Slot *Tracer::record(ThreadedCode &code, const Slot *operands) {
+  int32_t ioffset = operands[0].word;
+  const Slot *original = operands[1].target;
+  if (!loop || Stack::currentFrame() != frame)
+    return original;
+  if (ioffset == path.front()) {
+    const Slot *header = loop;
+    loop = nullptr;
+    noteKinds(code, false);
+    const ThreadedFragment *trace =
+        translateTrace(code, function, path, kinds);
+    if (!trace)
+      return original;
+    const Slot *entry = trace->slots.data();
+    const_cast<Slot *>(header)[1].target = entry;
+    quicken(header, T_LOOP_Trace);
+    redirect(code, header, function, entry);
+    return entry;
+  }
+  // Inner loops are traced on their own
+  if (path.size() == MaxTraceBlocks ||
+      code.codeInfo->instInfo[ioffset].isLoopHeader()) {
+    loop = nullptr;
+    return original;
+  }
+  path.push_back(ioffset);
+  return operands + 2;
+}
+
+/// Runs \p code until the outermost function ends.
+///
+/// Called with nullptr, only publishes the handler addresses into #handlers.
+static void execute(ThreadedCode *code) {
+  if (!code) {
+#define LAMA_THREADED_OP_HANDLER(name) handlers[T_##name] = &&L_##name;
+    LAMA_THREADED_OPS(LAMA_THREADED_OP_HANDLER)
+#undef LAMA_THREADED_OP_HANDLER
+    return;
+  }
+
+  const Slot *ip = static_cast<const Slot *>(code->functions[0].entry);
+  // Cached topmost operands, r0 on top
+  Value r0 = 0;
+  Value r1 = 0;
+
+#define DISPATCH() goto *(ip++)->handler
+
+  try {
+    DISPATCH();
+
+  L_BINOP_Eq: {
+    Value rhs = Stack::popOperand();
+    Value lhs = Stack::popOperand();
+    Stack::pushOperand(boxInt(lhs == rhs));
+    DISPATCH();
+  }
+  L_BINOP_Eq_S1:
+  L_BINOP_Eq_Int_S1: {
+    r0 = boxInt(Stack::popOperand() == r0);
+    DISPATCH();
+  }
+  L_BINOP_Eq_S2:
+  L_BINOP_Eq_Int_S2: {
+    r0 = boxInt(r1 == r0);
+    DISPATCH();
+  }
+// Operands stay boxed, see boxedAdd and the others
+#define BINOP(name, result)                                                    \
+  L_BINOP_##name : {                                                           \
+    Value rhs = Stack::popOperand();                                           \
+    Value lhs = Stack::popOperand();                                           \
+    Stack::checkIntOperands(lhs, rhs);                                         \
+    Stack::pushOperand(result);                                                \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_S1 : {                                                      \
+    Value rhs = r0;                                                            \
+    Value lhs = Stack::popOperand();                                           \
+    Stack::checkIntOperands(lhs, rhs);                                         \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_S2 : {                                                      \
+    Value rhs = r0;                                                            \
+    Value lhs = r1;                                                            \
+    Stack::checkIntOperands(lhs, rhs);                                         \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_Int_S1 : {                                                  \
+    Value rhs = r0;                                                            \
+    Value lhs = Stack::popOperand();                                           \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_Int_S2 : {                                                  \
+    Value rhs = r0;                                                            \
+    Value lhs = r1;                                                            \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }
+#define DIVISION_BINOP(name, result)                                           \
+  L_BINOP_##name : {                                                           \
+    Value rhs = Stack::popOperand();                                           \
+    Value lhs = Stack::popOperand();                                           \
+    Stack::checkIntOperands(lhs, rhs);                                         \
+    if (rhs == boxInt(0))                                                      \
+      runtimeError("division by zero");                                        \
+    Stack::pushOperand(result);                                                \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_S1 : {                                                      \
+    Value rhs = r0;                                                            \
+    Value lhs = Stack::popOperand();                                           \
+    Stack::checkIntOperands(lhs, rhs);                                         \
+    if (rhs == boxInt(0))                                                      \
+      runtimeError("division by zero");                                        \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_S2 : {                                                      \
+    Value rhs = r0;                                                            \
+    Value lhs = r1;                                                            \
+    Stack::checkIntOperands(lhs, rhs);                                         \
+    if (rhs == boxInt(0))                                                      \
+      runtimeError("division by zero");                                        \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_Int_S1 : {                                                  \
+    Value rhs = r0;                                                            \
+    Value lhs = Stack::popOperand();                                           \
+    if (rhs == boxInt(0))                                                      \
+      runtimeError("division by zero");                                        \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_BINOP_##name##_Int_S2 : {                                                  \
+    Value rhs = r0;                                                            \
+    Value lhs = r1;                                                            \
+    if (rhs == boxInt(0))                                                      \
+      runtimeError("division by zero");                                        \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }
+    BINOP(Add, boxedAdd(lhs, rhs))
+    BINOP(Sub, boxedSub(lhs, rhs))
+    BINOP(Mul, boxedMul(lhs, rhs))
+    DIVISION_BINOP(Div, boxedDiv(lhs, rhs))
+    DIVISION_BINOP(Mod, boxedMod(lhs, rhs))
+    BINOP(Lt, boxInt(lhs < rhs))
+    BINOP(Leq, boxInt(lhs <= rhs))
+    BINOP(Gt, boxInt(lhs > rhs))
+    BINOP(Geq, boxInt(lhs >= rhs))
+    BINOP(Neq, boxInt(lhs != rhs))
+    BINOP(And, boxedAnd(lhs, rhs))
+    BINOP(Or, boxedOr(lhs, rhs))
+// The constant is a number already
+#define CONST_BINOP(name, result)                                              \
+  L_CONST_BINOP_##name##_S1 : Stack::unboxIntOperand(r0);                      \
+  L_CONST_BINOP_##name##_Int_S1 : {                                            \
+    Value rhs = (ip++)->value;                                                 \
+    Value lhs = r0;                                                            \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }
+#define CONST_DIVISION_BINOP(name, result)                                     \
+  L_CONST_BINOP_##name##_S1 : Stack::unboxIntOperand(r0);                      \
+  L_CONST_BINOP_##name##_Int_S1 : {                                            \
+    Value rhs = (ip++)->value;                                                 \
+    Value lhs = r0;                                                            \
+    if (rhs == boxInt(0))                                                      \
+      runtimeError("division by zero");                                        \
+    r0 = result;                                                               \
+    DISPATCH();                                                                \
+  }
+  L_CONST_BINOP_Eq_S1:
+  L_CONST_BINOP_Eq_Int_S1: {
+    r0 = boxInt(r0 == (ip++)->value);
+    DISPATCH();
+  }
+  CONST_BINOP(Add, boxedAdd(lhs, rhs))
+  CONST_BINOP(Sub, boxedSub(lhs, rhs))
+  CONST_BINOP(Mul, boxedMul(lhs, rhs))
+  CONST_DIVISION_BINOP(Div, boxedDiv(lhs, rhs))
+  CONST_DIVISION_BINOP(Mod, boxedMod(lhs, rhs))
+  CONST_BINOP(Lt, boxInt(lhs < rhs))
+  CONST_BINOP(Leq, boxInt(lhs <= rhs))
+  CONST_BINOP(Gt, boxInt(lhs > rhs))
+  CONST_BINOP(Geq, boxInt(lhs >= rhs))
+  CONST_BINOP(Neq, boxInt(lhs != rhs))
+  CONST_BINOP(And, boxedAnd(lhs, rhs))
+  CONST_BINOP(Or, boxedOr(lhs, rhs))
+#undef CONST_DIVISION_BINOP
+#undef CONST_BINOP
+#undef DIVISION_BINOP
+#undef BINOP
+  L_CONST: {
+    Stack::pushOperand((ip++)->value);
+    DISPATCH();
+  }
+// Pushes \p value into the cache, spilling the bottom cached operand
+// if there are two of them already
+#define CACHED_PUSH(name, value)                                               \
+  L_##name##_S0 : {                                                            \
+    r0 = value;                                                                \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_##name##_S1 : {                                                            \
+    r1 = r0;                                                                   \
+    r0 = value;                                                                \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_##name##_S2 : {                                                            \
+    Stack::pushOperand(r1);                                                    \
+    r1 = r0;                                                                   \
+    r0 = value;                                                                \
+    DISPATCH();                                                                \
+  }
+    CACHED_PUSH(CONST, (ip++)->value)
+    CACHED_PUSH(LD_Global, accessGlobal((ip++)->word))
+    CACHED_PUSH(LD_Local, Stack::accessLocal((ip++)->word))
+    CACHED_PUSH(LD_Arg, Stack::accessArg((ip++)->word))
+    CACHED_PUSH(LD_Access, accessVar(LOC_Access, (ip++)->word))
+#undef CACHED_PUSH
+  L_STRING: {
+    Stack::pushOperand(createString((ip++)->string));
+    DISPATCH();
+  }
+  L_STRING_Shared: {
+    Value &cache = accessGlobal(ip[0].word);
+    const char *string = ip[1].string;
+    ip += 2;
+    Stack::pushOperand(createSharedString(cache, string));
+    DISPATCH();
+  }
+  L_SEXP: {
+    Value tagHash = ip[0].value;
+    int32_t nargs = ip[1].word;
+    ip += 2;
+
+    Value sexp = createSexp(tagHash, nargs);
+    Stack::popNOperands(nargs);
+    Stack::pushOperand(sexp);
+    DISPATCH();
+  }
+  // Each handler first remembers its own slot for quickening
+#define QUICKENED_STA(kind, check, store)                                      \
+  L_STA_##kind : {                                                             \
+    const Slot *handlerSlot = ip - 1;                                          \
+    Value value = Stack::popOperand();                                         \
+    Value index = Stack::popOperand();                                         \
+    Value aggregate = Stack::popOperand();                                     \
+    if (valueIsInt(index) && isObjectOf(aggregate, check)) {                   \
+      store;                                                                   \
+      Stack::pushOperand(value);                                               \
+      DISPATCH();                                                              \
+    }                                                                          \
+    quicken(handlerSlot, T_STA_Generic);                                       \
+    Stack::pushOperand(pointerToValue(                                         \
+        Bsta(valueToPointer(value), index, valueToPointer(aggregate))));       \
+    DISPATCH();                                                                \
+  }
+  L_STA: {
+    const Slot *handlerSlot = ip - 1;
+    Value value = Stack::popOperand();
+    Value index = Stack::popOperand();
+    Value aggregate = Stack::popOperand();
+    quicken(handlerSlot, static_cast<ThreadedOp>(
+                             T_STA_Array + quickenedKindOf(aggregate, index)));
+    Stack::pushOperand(pointerToValue(
+        Bsta(valueToPointer(value), index, valueToPointer(aggregate))));
+    DISPATCH();
+  }
+  QUICKENED_STA(Array, ARRAY_TAG, wordsOf(aggregate)[unboxInt(index)] = value)
+  QUICKENED_STA(Sexp, SEXP_TAG,
+                wordsOf(aggregate)[unboxInt(index) + 1] = value)
+  // Bsta does not check the character is a number either
+  QUICKENED_STA(String, STRING_TAG,
+                charsOf(aggregate)[unboxInt(index)] = value >> 1)
+  L_STA_Generic: {
+    Value value = Stack::popOperand();
+    Value index = Stack::popOperand();
+    Value aggregate = Stack::popOperand();
+    Stack::pushOperand(pointerToValue(
+        Bsta(valueToPointer(value), index, valueToPointer(aggregate))));
+    DISPATCH();
+  }
+#undef QUICKENED_STA
+  L_JMP: {
+    ip = ip->target;
+    DISPATCH();
+  }
+  L_END: {
+    const void *returnAddress = Stack::endFunction();
+    if (Stack::isEmpty())
+      return;
+    ip = static_cast<const Slot *>(returnAddress);
+    DISPATCH();
+  }
+  L_DROP: {
+    Stack::popOperand();
+    DISPATCH();
+  }
+  L_DROP_DROP: {
+    Stack::popNOperands(2);
+    DISPATCH();
+  }
+  L_DROP_S2: {
+    r0 = r1;
+    DISPATCH();
+  }
+  L_DUP: {
+    Stack::pushOperand(Stack::peakOperand());
+    DISPATCH();
+  }
+  L_DUP_S1: {
+    r1 = r0;
+    DISPATCH();
+  }
+  L_DUP_S2: {
+    Stack::pushOperand(r1);
+    r1 = r0;
+    DISPATCH();
+  }
+  L_SWAP: {
+    Value top = Stack::popOperand();
+    Value next = Stack::popOperand();
+    Stack::pushOperand(top);
+    Stack::pushOperand(next);
+    DISPATCH();
+  }
+  L_SWAP_S2: {
+    std::swap(r0, r1);
+    DISPATCH();
+  }
+// The operations taking an element differ in where they find the
+// aggregate and the index, see ELEM_LOAD_x, and where they put the result,
+// see ELEM_STORE_x
+#define QUICKENED_ELEM(name, suffix, load, store)                              \
+  L_##name##suffix : {                                                         \
+    const Slot *handlerSlot = ip - 1;                                          \
+    load;                                                                      \
+    quicken(handlerSlot,                                                       \
+            static_cast<ThreadedOp>(T_##name##_Array##suffix +                 \
+                                    quickenedKindOf(aggregate, index)));       \
+    store(genericElement(aggregate, index));                                   \
+    DISPATCH();                                                                \
+  }                                                                            \
+  QUICKENED_ELEM_KIND(name, Array, suffix, load, store, ARRAY_TAG,             \
+                      wordsOf(aggregate)[unboxInt(index)])                     \
+  QUICKENED_ELEM_KIND(name, Sexp, suffix, load, store, SEXP_TAG,               \
+                      wordsOf(aggregate)[unboxInt(index) + 1])                 \
+  QUICKENED_ELEM_KIND(name, String, suffix, load, store, STRING_TAG,           \
+                      boxInt(charsOf(aggregate)[unboxInt(index)]))             \
+  L_##name##_Generic##suffix : {                                               \
+    load;                                                                      \
+    store(genericElement(aggregate, index));                                   \
+    DISPATCH();                                                                \
+  }
+#define QUICKENED_ELEM_KIND(name, kind, suffix, load, store, check, element)   \
+  L_##name##_##kind##suffix : {                                                \
+    const Slot *handlerSlot = ip - 1;                                          \
+    load;                                                                      \
+    if (valueIsInt(index) && isObjectOf(aggregate, check)) {                   \
+      store(element);                                                          \
+      DISPATCH();                                                              \
+    }                                                                          \
+    quicken(handlerSlot, T_##name##_Generic##suffix);                          \
+    store(genericElement(aggregate, index));                                   \
+    DISPATCH();                                                                \
+  }
+#define ELEM_LOAD_S0                                                           \
+  Value index = Stack::popOperand();                                           \
+  Value aggregate = Stack::popOperand()
+#define ELEM_LOAD_S2                                                           \
+  Value index = r0;                                                            \
+  Value aggregate = r1
+#define ELEM_LOAD_CONST_S1                                                     \
+  Value index = (ip++)->value;                                                 \
+  Value aggregate = r0
+#define ELEM_LOAD_DUP_CONST_S0                                                 \
+  Value index = (ip++)->value;                                                 \
+  Value aggregate = Stack::peakOperand()
+#define ELEM_LOAD_DUP_CONST_S1                                                 \
+  r1 = r0;                                                                     \
+  Value index = (ip++)->value;                                                 \
+  Value aggregate = r1
+#define ELEM_LOAD_DUP_CONST_S2                                                 \
+  Stack::pushOperand(r1);                                                      \
+  r1 = r0;                                                                     \
+  Value index = (ip++)->value;                                                 \
+  Value aggregate = r1
+#define ELEM_STORE_STACK(element) Stack::pushOperand(element)
+#define ELEM_STORE_CACHE(element) r0 = (element)
+    QUICKENED_ELEM(ELEM, , ELEM_LOAD_S0, ELEM_STORE_STACK)
+    QUICKENED_ELEM(ELEM, _S2, ELEM_LOAD_S2, ELEM_STORE_CACHE)
+    QUICKENED_ELEM(CONST_ELEM, _S1, ELEM_LOAD_CONST_S1, ELEM_STORE_CACHE)
+    QUICKENED_ELEM(DUP_CONST_ELEM, _S0, ELEM_LOAD_DUP_CONST_S0,
+                   ELEM_STORE_CACHE)
+    QUICKENED_ELEM(DUP_CONST_ELEM, _S1, ELEM_LOAD_DUP_CONST_S1,
+                   ELEM_STORE_CACHE)
+    QUICKENED_ELEM(DUP_CONST_ELEM, _S2, ELEM_LOAD_DUP_CONST_S2,
+                   ELEM_STORE_CACHE)
+#undef ELEM_STORE_CACHE
+#undef ELEM_STORE_STACK
+#undef ELEM_LOAD_DUP_CONST_S2
+#undef ELEM_LOAD_DUP_CONST_S1
+#undef ELEM_LOAD_DUP_CONST_S0
+#undef ELEM_LOAD_CONST_S1
+#undef ELEM_LOAD_S2
+#undef ELEM_LOAD_S0
+#undef QUICKENED_ELEM_KIND
+#undef QUICKENED_ELEM
+  L_LD_Global: {
+    Stack::pushOperand(accessGlobal((ip++)->word));
+    DISPATCH();
+  }
+  L_LD_Local: {
+    Stack::pushOperand(Stack::accessLocal((ip++)->word));
+    DISPATCH();
+  }
+  L_LD_Arg: {
+    Stack::pushOperand(Stack::accessArg((ip++)->word));
+    DISPATCH();
+  }
+  L_LD_Access: {
+    Stack::pushOperand(accessVar(LOC_Access, (ip++)->word));
+    DISPATCH();
+  }
+#define LDA(designation)                                                       \
+  L_LDA_##designation : {                                                      \
+    Value *address = &accessVar(LOC_##designation, (ip++)->word);              \
+    Stack::pushOperand(pointerToValue(address));                               \
+    Stack::pushOperand(pointerToValue(address));                               \
+    DISPATCH();                                                                \
+  }
+    LDA(Global)
+    LDA(Local)
+    LDA(Arg)
+    LDA(Access)
+#undef LDA
+  L_ST_Global: {
+    accessGlobal((ip++)->word) = Stack::peakOperand();
+    DISPATCH();
+  }
+  L_ST_Local: {
+    Stack::accessLocal((ip++)->word) = Stack::peakOperand();
+    DISPATCH();
+  }
+  L_ST_Arg: {
+    Stack::accessArg((ip++)->word) = Stack::peakOperand();
+    DISPATCH();
+  }
+  L_ST_Access: {
+    accessVar(LOC_Access, (ip++)->word) = Stack::peakOperand();
+    DISPATCH();
+  }
+  L_ST_Global_DROP: {
+    accessGlobal((ip++)->word) = Stack::popOperand();
+    DISPATCH();
+  }
+  L_ST_Local_DROP: {
+    Stack::accessLocal((ip++)->word) = Stack::popOperand();
+    DISPATCH();
+  }
+  L_ST_Arg_DROP: {
+    Stack::accessArg((ip++)->word) = Stack::popOperand();
+    DISPATCH();
+  }
+  L_ST_Access_DROP: {
+    accessVar(LOC_Access, (ip++)->word) = Stack::popOperand();
+    DISPATCH();
+  }
+  L_ST_Global_S1: {
+    accessGlobal((ip++)->word) = r0;
+    DISPATCH();
+  }
+  L_ST_Local_S1: {
+    Stack::accessLocal((ip++)->word) = r0;
+    DISPATCH();
+  }
+  L_ST_Arg_S1: {
+    Stack::accessArg((ip++)->word) = r0;
+    DISPATCH();
+  }
+  L_ST_Access_S1: {
+    accessVar(LOC_Access, (ip++)->word) = r0;
+    DISPATCH();
+  }
+  L_CJMPz: {
+    const Slot *target = (ip++)->target;
+    if (!Stack::popIntOperand())
+      ip = target;
+    DISPATCH();
+  }
+  L_CJMPnz: {
+    const Slot *target = (ip++)->target;
+    if (Stack::popIntOperand())
+      ip = target;
+    DISPATCH();
+  }
+  L_CJMPz_S1: {
+    const Slot *target = (ip++)->target;
+    if (!Stack::unboxIntOperand(r0))
+      ip = target;
+    DISPATCH();
+  }
+  L_CJMPnz_S1: {
+    const Slot *target = (ip++)->target;
+    if (Stack::unboxIntOperand(r0))
+      ip = target;
+    DISPATCH();
+  }
+  L_CJMPz_Int_S1: {
+    const Slot *target = (ip++)->target;
+    if (r0 == boxInt(0))
+      ip = target;
+    DISPATCH();
+  }
+  L_CJMPnz_Int_S1: {
+    const Slot *target = (ip++)->target;
+    if (r0 != boxInt(0))
+      ip = target;
+    DISPATCH();
+  }
+  L_FLUSH_S1: {
+    Stack::pushOperand(r0);
+    DISPATCH();
+  }
+  L_FLUSH_S2: {
+    Stack::pushOperand(r1);
+    Stack::pushOperand(r0);
+    DISPATCH();
+  }
+  L_SPILL_S2: {
+    Stack::pushOperand(r1);
+    DISPATCH();
+  }
+  L_CLOSURE: {
+    const FunctionDescriptor *function = ip[0].function;
+    int32_t n = ip[1].word;
+    ip += 2;
+
+    Stack::allocateNOperands(n);
+    for (int i = 0; i < n; ++i) {
+      Value value = accessVar(ip[0].word, ip[1].word);
+      ip += 2;
+      Stack::top()[i + 1] = value;
+    }
+
+    Value closure = createClosure(function, n);
+
+    Stack::popNOperands(n);
+    Stack::pushOperand(closure);
+    DISPATCH();
+  }
+  L_CALLC: {
+    const Slot *handlerSlot = ip - 1;
+    const FunctionDescriptor *function = closureFunction(ip[0].word);
+    if (Stack::isPlain(*function)) {
+      const_cast<Slot *>(ip)[1].function = function;
+      quicken(handlerSlot, T_CALLC_Mono);
+    } else {
+      quicken(handlerSlot, T_CALLC_Generic);
+    }
+    ip += 2;
+    Stack::beginFunction(*function, ip);
+    ip = static_cast<const Slot *>(function->entry);
+    DISPATCH();
+  }
+  L_CALLC_Mono: {
+    const Slot *handlerSlot = ip - 1;
+    const FunctionDescriptor *function = closureFunction(ip[0].word);
+    const FunctionDescriptor *cached = ip[1].function;
+    ip += 2;
+    if (function == cached) {
+      Stack::beginPlainFunction(*cached, ip);
+      ip = static_cast<const Slot *>(cached->entry);
+      DISPATCH();
+    }
+    quicken(handlerSlot, T_CALLC_Generic);
+    Stack::beginFunction(*function, ip);
+    ip = static_cast<const Slot *>(function->entry);
+    DISPATCH();
+  }
+  L_CALLC_Generic: {
+    const FunctionDescriptor *function = closureFunction(ip[0].word);
+    ip += 2;
+    Stack::beginFunction(*function, ip);
+    ip = static_cast<const Slot *>(function->entry);
+    DISPATCH();
+  }
+  L_CALL: {
+    const FunctionDescriptor *function = (ip++)->function;
+    Stack::beginFunction(*function, ip);
+    ip = static_cast<const Slot *>(function->entry);
+    DISPATCH();
+  }
+  L_TAIL_CALLC: {
+    const FunctionDescriptor *function = closureFunction((ip++)->word);
+    Stack::tailCall(*function);
+    ip = static_cast<const Slot *>(function->entry);
+    DISPATCH();
+  }
+  L_TAIL_CALL: {
+    const FunctionDescriptor *function = (ip++)->function;
+    Stack::tailCall(*function);
+    ip = static_cast<const Slot *>(function->entry);
+    DISPATCH();
+  }
+  L_TAIL_CALL_Self: {
+    Stack::tailCallSelf(*ip[0].function);
+    ip = ip[1].target;
+    DISPATCH();
+  }
+  L_LOOP: {
+    if (--const_cast<Slot *>(ip)->word > 0) {
+      ip += 2;
+      DISPATCH();
+    }
+    ip = tracer.startRecording(*code, ip - 1);
+    DISPATCH();
+  }
+  L_LOOP_Trace: {
+    ip = ip->target;
+    DISPATCH();
+  }
+  L_LOOP_Cold: {
+    ip += 2;
+    DISPATCH();
+  }
+  L_RECORD: {
+    ip = tracer.record(*code, ip);
+    DISPATCH();
+  }
+  L_GUARD_Int_Global: {
+    ip = valueIsInt(accessGlobal(ip[0].word)) ? ip + 2 : ip[1].target;
+    DISPATCH();
+  }
+  L_GUARD_Int_Local: {
+    ip = valueIsInt(Stack::accessLocal(ip[0].word)) ? ip + 2 : ip[1].target;
+    DISPATCH();
+  }
+  L_GUARD_Int_Arg: {
+    ip = valueIsInt(Stack::accessArg(ip[0].word)) ? ip + 2 : ip[1].target;
+    DISPATCH();
+  }
+// Checks the tag of the stack top, leaving it on the stack
+#define DUP_TAG_CJMP(name, jumpIf)                                             \
+  L_DUP_TAG_##name##_S1 : Stack::pushOperand(r0);                             \
+  L_DUP_TAG_##name : {                                                         \
+    Value tag = ip[0].value;                                                   \
+    int32_t nargs = ip[1].word;                                                \
+    const Slot *target = ip[2].target;                                         \
+    ip += 3;                                                                   \
+    if (isSexpOf(Stack::peakOperand(), tag, nargs) == jumpIf)                  \
+      ip = target;                                                             \
+    DISPATCH();                                                                \
+  }
+    DUP_TAG_CJMP(CJMPz, false)
+    DUP_TAG_CJMP(CJMPnz, true)
+#undef DUP_TAG_CJMP
+  L_TAGSWITCH: {
+    int32_t narms = ip[0].word;
+    const Slot *arm = ip + 2;
+    ip = ip[1].target;
+    Value tagHash;
+    int32_t nfields;
+    if (sexpShapeOf(Stack::peakOperand(), tagHash, nfields)) {
+      for (int32_t i = 0; i < narms; ++i, arm += 3) {
+        if (arm[0].value == tagHash && arm[1].word == nfields) {
+          ip = arm[2].target;
+          break;
+        }
+      }
+    }
+    DISPATCH();
+  }
+  L_FAIL: {
+    int32_t line = ip[0].word;
+    int32_t col = ip[1].word;
+    Value v = Stack::popOperand();
+    Bmatch_failure(valueToPointer(v), const_cast<char *>(unknownFile), line,
+                   col); // noreturn
+  }
+  L_PATT_StrCmp: {
+    Value x = Stack::popOperand();
+    Value y = Stack::popOperand();
+    Value result = Bstring_patt(valueToPointer(x), valueToPointer(y));
+    Stack::pushOperand(result);
+    DISPATCH();
+  }
+// Tests the operand on top, and may jump on the result right away.
+// See PATTERN_LOAD_x for the operands taken from the code.
+#define PATTERN(name, load, test)                                              \
+  L_##name : {                                                                 \
+    load;                                                                      \
+    Value operand = Stack::popOperand();                                       \
+    Stack::pushOperand(boxInt(test));                                          \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_##name##_S1 : {                                                            \
+    load;                                                                      \
+    Value operand = r0;                                                        \
+    r0 = boxInt(test);                                                         \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_##name##_CJMPz_S1 : {                                                      \
+    load;                                                                      \
+    Value operand = r0;                                                        \
+    const Slot *target = (ip++)->target;                                       \
+    if (!(test))                                                               \
+      ip = target;                                                             \
+    DISPATCH();                                                                \
+  }                                                                            \
+  L_##name##_CJMPnz_S1 : {                                                     \
+    load;                                                                      \
+    Value operand = r0;                                                        \
+    const Slot *target = (ip++)->target;                                       \
+    if (test)                                                                  \
+      ip = target;                                                             \
+    DISPATCH();                                                                \
+  }
+#define PATTERN_LOAD_NONE
+#define PATTERN_LOAD_TAG                                                       \
+  Value tagHash = ip[0].value;                                                 \
+  int32_t nfields = ip[1].word;                                                \
+  ip += 2
+#define PATTERN_LOAD_ARRAY int32_t nelems = (ip++)->word
+    PATTERN(TAG, PATTERN_LOAD_TAG, isSexpOf(operand, tagHash, nfields))
+    PATTERN(ARRAY, PATTERN_LOAD_ARRAY, isArrayOf(operand, nelems))
+    PATTERN(PATT_String, PATTERN_LOAD_NONE, isObjectOf(operand, STRING_TAG))
+    PATTERN(PATT_Array, PATTERN_LOAD_NONE, isObjectOf(operand, ARRAY_TAG))
+    PATTERN(PATT_Sexp, PATTERN_LOAD_NONE, isObjectOf(operand, SEXP_TAG))
+    PATTERN(PATT_Boxed, PATTERN_LOAD_NONE, valueIsPtr(operand))
+    PATTERN(PATT_UnBoxed, PATTERN_LOAD_NONE, valueIsInt(operand))
+    PATTERN(PATT_Closure, PATTERN_LOAD_NONE, isObjectOf(operand, CLOSURE_TAG))
+#undef PATTERN_LOAD_ARRAY
+#undef PATTERN_LOAD_TAG
+#undef PATTERN_LOAD_NONE
+#undef PATTERN
+  L_CALL_Lread: {
+    Stack::pushOperand(Lread());
+    DISPATCH();
+  }
+  L_CALL_Lwrite: {
+    Lwrite(Stack::popOperand());
+    Stack::pushIntOperand(0);
+    DISPATCH();
+  }
+  L_CALL_Llength: {
+    Value string = Stack::popOperand();
+    Value length = Llength(valueToPointer(string));
+    Stack::pushOperand(length);
+    DISPATCH();
+  }
+  L_CALL_Lstring: {
+    Value operand = Stack::popOperand();
+    Value rendered = renderToString(operand);
+    Stack::pushOperand(rendered);
+    DISPATCH();
+  }
+  L_CALL_Barray: {
+    int32_t nargs = (ip++)->word;
+    Value array = createArray(nargs);
+    Stack::popNOperands(nargs);
+    Stack::pushOperand(array);
+    DISPATCH();
+  }
+  } catch (std::runtime_error &e) {
+    runtimeError("runtime error at {:#x}: {}", code->sourceOffsetOf(ip),
+                 e.what());
+  }
+
+#undef DISPATCH
+}
+
+const void *const *lama::threadedHandlers() {
+  if (!handlers[0])
+    execute(nullptr);
+  return handlers;
+}
+
+void lama::interpret(ThreadedCode &code) {
+  initGlobalArea();
+  __gc_init();
+  if (sigsetjmp(Stack::overflowJmpBuf, 1)) {
+    runtimeError("runtime error: stack exhausted");
+  }
+  Stack::init();
+  // The main function returns to nowhere
+  Stack::beginFunction(code.functions[0], nullptr);
+  execute(&code);
+}
@@ -0,0 +1,1192 @@
+#include "ByteFile.h"
+#include "Error.h"
+#include "Inst.h"
+#include "ThreadedCode.h"
+#include "Value.h"
+#include "Verifier.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace lama;
+
+namespace {
+
+class Translator {
+public:
+  Translator(ByteFile &byteFile, const CodeInfo &codeInfo,
+             int32_t hotLoopIterations);
+  /// Translates fragments of \p program
+  explicit Translator(ThreadedCode &program);
+
+  ThreadedCode translate();
+  const ThreadedFragment &translateForRecording(int32_t index);
+  const ThreadedFragment *translateTrace(int32_t index,
+                                        const std::vector<int32_t> &path,
+                                        const TraceKinds &kinds);
+
+private:
+  enum class Mode {
+    Program,
+    /// A copy of a function, see lama::translateForRecording()
+    Recording,
+    /// A path through a function, see lama::translateTrace()
+    Trace,
+  };
+
+  void translateFunction(const FunctionInfo &function);
+  /// \pre #ip points to a reachable instruction
+  /// \post #ip points right after the instruction
+  /// \return whether control may fall through to the next instruction
+  bool translateInst();
+  /// Translates TAG, ARRAY or a PATT testing the kind of the operand,
+  /// fusing it with a CJMPz/CJMPnz right after it
+  void translatePattern(uint8_t byte);
+
+  void resolveTargets();
+  /// Resolves the targets of a fragment, #slotOf only knowing its offsets
+  void resolveFragmentTargets(ThreadedFragment &fragment);
+  /// Moves the code translated so far into a new fragment of #program
+  ThreadedFragment &addFragment();
+
+  /// Emits the variant of an operation pushing one operand for the current
+  /// cache state. Its variant expecting nothing cached is \p base, the ones
+  /// expecting one and two operands follow it every \p stride operations.
+  /// If nothing was cached, \p flushed is the equivalent operation pushing
+  /// to the stack, used when the operand is flushed right away.
+  void emitCachedPush(ThreadedOp base, int stride = 1,
+                      ThreadedOp flushed = T_Count);
+  /// Pushes all cached operands to the stack
+  void flush();
+  /// Pushes cached operands to the stack until at most \p n stay cached
+  void spillTo(int n);
+
+  void emitOp(ThreadedOp op);
+  void emitWord(int32_t word);
+  void emitValue(Value value);
+  void emitString(int32_t offset);
+  void emitTarget(int32_t ioffset);
+  /// Emits the descriptor of the function whose BEGIN is at \p ioffset
+  void emitFunction(int32_t ioffset);
+  /// Emits the LOOP of the loop header being translated
+  void emitLoop();
+  /// Emits the RECORD of the block being translated
+  void emitRecord();
+
+  /// \return the opcode of the conditional jump at \p jump to translate.
+  /// In a trace going on at its target, the opposite one, so that the jump
+  /// leaves the trace where the path fell through.
+  uint8_t branchCode(const uint8_t *jump) const;
+  /// \return bytecode offset the jump translated as branchCode() goes to
+  int32_t branchTarget(const uint8_t *jump) const;
+  bool isTakenInTrace(const uint8_t *jump) const;
+  /// Notes that a conditional jump at \p jump was translated
+  void noteBranch(const uint8_t *jump);
+
+  /// Emits a GUARD_Int for each variable of \p kinds the traced path reads
+  /// before assigning it
+  void emitGuards(const TraceKinds &kinds);
+  /// Updates #intVars and #intOperands over the instructions of the traced
+  /// function from \p from up to \p to
+  void interpretKinds(const uint8_t *from, const uint8_t *to);
+  /// Notes the arguments a tail call of the traced function to itself
+  /// passes, \p nargs topmost operands
+  void noteSelfTailCall(int32_t nargs);
+  /// \return whether the \p n topmost operands are known to be numbers at
+  /// the current point of a trace
+  bool knowsInt(size_t n) const;
+  /// \return whether the guarded variables of a trace still hold numbers
+  bool guardsHold() const;
+
+  /// \return bytecode offset of the block the traced path goes on at after
+  /// the current one, the loop header after the last one
+  int32_t successor() const {
+    return nextBlock < path->size() ? (*path)[nextBlock] : path->front();
+  }
+
+  /// \return the instruction at \p next, skipping LINEs, if it may be fused
+  /// with the instruction right before it, nullptr otherwise
+  const uint8_t *peekFusible(const uint8_t *next) const;
+
+  uint8_t readByte();
+  int32_t readWord();
+
+  int32_t ioffsetOf(const uint8_t *ip) const {
+    return ip - byteFile.getCode();
+  }
+
+private:
+  ByteFile &byteFile;
+  const CodeInfo &codeInfo;
+  const void *const *handlers;
+  Mode mode = Mode::Program;
+  /// Code fragments are translated for, nullptr when translating it
+  ThreadedCode *program = nullptr;
+
+  ThreadedCode code;
+  /// Slot index of the operation translated from each bytecode offset
+  std::vector<int32_t> slotOf;
+  /// Slots holding bytecode offsets of jump targets until resolved
+  std::vector<size_t> unresolvedTargets;
+
+  const uint8_t *ip;
+  int32_t currentInstOffset;
+  /// Index of the function being translated in CodeInfo::functions
+  int32_t currentFunction = 0;
+  /// Whether the last translated instruction was a conditional jump, so
+  /// that a block starts at the next one
+  bool branched = false;
+  /// The last conditional jump translated, nullptr if a trace left it out
+  const uint8_t *lastBranch = nullptr;
+
+  /// Blocks of the traced path, see lama::translateTrace()
+  const std::vector<int32_t> *path = nullptr;
+  /// Index in #path of the block after the current one
+  size_t nextBlock = 0;
+  /// Set once the traced path turns out to be untraceable
+  bool untraceable = false;
+  /// Slots of a trace holding slot indices of the trace to jump to, rather
+  /// than bytecode offsets, until resolved
+  std::vector<size_t> traceTargets;
+  /// Whether each variable holds a number at the current point of a
+  /// trace, by designation and index
+  std::vector<bool> intVars[LOC_Access];
+  /// Arguments and locals of the traced function whose address is taken,
+  /// they may be changed through it
+  std::vector<bool> isAddressTaken[LOC_Access];
+  /// Whether each of the topmost operands is a number at the current
+  /// point of a trace, the ones below are not known to be
+  std::vector<bool> intOperands;
+  /// Variables a trace guards, by designation and index
+  std::vector<std::pair<int32_t, int32_t>> guards;
+  /// Slot index right after the guards of a trace
+  int32_t bodySlot = 0;
+  /// Reachable instructions of the traced function, sorted
+  std::vector<const uint8_t *> traceInsts;
+  /// Slot of the last emitted operation if it pushed a constant in a
+  /// trace, the constant and the cache state before it
+  size_t constSlot = SIZE_MAX;
+  Value constValue;
+  int constCacheState;
+  /// How many topmost operands are cached in registers at the current
+  /// point of translation, 0, 1 or 2
+  int cacheState = 0;
+  /// Slot of the last emitted operation if it pushed into the empty cache,
+  /// and its equivalent pushing to the stack
+  size_t lastPushSlot = SIZE_MAX;
+  ThreadedOp lastPushFlushed;
+};
+
+} // namespace
+
+Translator::Translator(ByteFile &byteFile, const CodeInfo &codeInfo,
+                       int32_t hotLoopIterations)
+    : byteFile(byteFile), codeInfo(codeInfo), handlers(threadedHandlers()),
+      slotOf(byteFile.getCodeSizeBytes(), -1) {
+  code.functions.reserve(codeInfo.functions.size());
+  for (const FunctionInfo &info : codeInfo.functions) {
+    code.functions.push_back(FunctionDescriptor{
+        nullptr, (uint32_t)info.nargs, (uint32_t)info.nlocals,
+        (uint32_t)info.nprefilledLocals, (uint32_t)info.maxOperandStackSize,
+        info.isClosure(),
+        Stack::needsRoomCheck(info.nlocals, info.maxOperandStackSize)});
+  }
+  code.byteFile = &byteFile;
+  code.codeInfo = &codeInfo;
+  code.hotLoopIterations = hotLoopIterations;
+}
+
+Translator::Translator(ThreadedCode &program)
+    : byteFile(*program.byteFile), codeInfo(*program.codeInfo),
+      handlers(threadedHandlers()), program(&program),
+      slotOf(byteFile.getCodeSizeBytes(), -1) {}
+
+static int32_t wordAt(const uint8_t *ip) {
+  int32_t word;
+  memcpy(&word, ip, sizeof(int32_t));
+  return word;
+}
+
+const uint8_t *Translator::peekFusible(const uint8_t *next) const {
+  const uint8_t *codeEnd = byteFile.getCode() + byteFile.getCodeSizeBytes();
+  for (; next < codeEnd; next += 1 + sizeof(int32_t)) {
+    // Control may come here from elsewhere. A trace only comes to a label
+    // from the instruction before it, unless it begins the loop again.
+    if (mode == Mode::Trace ? ioffsetOf(next) == path->front()
+                            : codeInfo.instInfo[ioffsetOf(next)].isLabel())
+      return nullptr;
+    if (*next != I_LINE)
+      return next;
+  }
+  return nullptr;
+}
+
+uint8_t Translator::readByte() { return *ip++; }
+
+int32_t Translator::readWord() {
+  int32_t word;
+  memcpy(&word, ip, sizeof(int32_t));
+  ip += sizeof(int32_t);
+  return word;
+}
+
+void Translator::emitOp(ThreadedOp op) {
+  lastPushSlot = SIZE_MAX;
+  constSlot = SIZE_MAX;
+  Slot slot;
+  slot.handler = handlers[op];
+  code.slots.push_back(slot);
+  code.sourceOffsets.push_back(currentInstOffset);
+}
+
+void Translator::emitWord(int32_t word) {
+  Slot slot;
+  slot.word = word;
+  code.slots.push_back(slot);
+  code.sourceOffsets.push_back(-1);
+}
+
+void Translator::emitValue(Value value) {
+  Slot slot;
+  slot.value = value;
+  code.slots.push_back(slot);
+  code.sourceOffsets.push_back(-1);
+}
+
+void Translator::emitString(int32_t offset) {
+  Slot slot;
+  slot.string = byteFile.getStringTable() + offset;
+  code.slots.push_back(slot);
+  code.sourceOffsets.push_back(-1);
+}
+
+void Translator::emitTarget(int32_t ioffset) {
+  if (mode == Mode::Trace && ioffset == successor() &&
+      ioffset != path->front()) {
+    // Goes on along the path, right after the current operation
+    traceTargets.push_back(code.slots.size());
+    emitWord(-1);
+    return;
+  }
+  if (mode == Mode::Trace && ioffset == path->front() && guardsHold()) {
+    // Back to the header, past the guards
+    traceTargets.push_back(code.slots.size());
+    emitWord(bodySlot);
+    return;
+  }
+  unresolvedTargets.push_back(code.slots.size());
+  emitWord(ioffset);
+}
+
+void Translator::emitFunction(int32_t ioffset) {
+  std::vector<FunctionDescriptor> &functions =
+      program ? program->functions : code.functions;
+  Slot slot;
+  slot.function = &functions[codeInfo.functionIndex[ioffset]];
+  code.slots.push_back(slot);
+  code.sourceOffsets.push_back(-1);
+}
+
+void Translator::emitLoop() {
+  emitOp(T_LOOP);
+  emitWord(code.hotLoopIterations);
+  emitWord(currentFunction);
+}
+
+void Translator::emitRecord() {
+  emitOp(T_RECORD);
+  emitWord(currentInstOffset);
+  // Where to go on once the iteration is not recorded
+  Slot slot;
+  slot.target = &program->slots[program->slotOf[currentInstOffset]];
+  code.slots.push_back(slot);
+  code.sourceOffsets.push_back(-1);
+}
+
+bool Translator::isTakenInTrace(const uint8_t *jump) const {
+  int32_t target = wordAt(jump + 1);
+  int32_t fallthrough = ioffsetOf(jump) + 1 + sizeof(int32_t);
+  // Jumping back to the header stays in the trace either way
+  return mode == Mode::Trace && target == successor() &&
+         target != fallthrough && target != path->front();
+}
+
+uint8_t Translator::branchCode(const uint8_t *jump) const {
+  return isTakenInTrace(jump) ? *jump ^ (I_CJMPz ^ I_CJMPnz) : *jump;
+}
+
+int32_t Translator::branchTarget(const uint8_t *jump) const {
+  return isTakenInTrace(jump) ? ioffsetOf(jump) + 1 + sizeof(int32_t)
+                              : wordAt(jump + 1);
+}
+
+void Translator::noteBranch(const uint8_t *jump) {
+  branched = true;
+  lastBranch = jump;
+}
+
+void Translator::emitGuards(const TraceKinds &kinds) {
+  const std::vector<bool> *recorded[] = {&kinds.intGlobals, &kinds.intLocals,
+                                         &kinds.intArgs};
+  std::vector<bool> isAccessed[LOC_Access];
+  for (int32_t designation = 0; designation < LOC_Access; ++designation) {
+    intVars[designation].assign(recorded[designation]->size(), false);
+    isAccessed[designation].assign(recorded[designation]->size(), false);
+  }
+  const uint8_t *codeBegin = byteFile.getCode();
+  for (int32_t block : *path) {
+    auto inst = std::lower_bound(traceInsts.begin(), traceInsts.end(),
+                                 codeBegin + block);
+    for (; inst != traceInsts.end(); ++inst) {
+      int32_t ioffset = ioffsetOf(*inst);
+      if (ioffset != block && codeInfo.instInfo[ioffset].isLabel())
+        break;
+      uint8_t byte = **inst;
+      if ((I_LD_Global <= byte && byte <= I_LD_Arg) ||
+          (I_ST_Global <= byte && byte <= I_ST_Arg)) {
+        int32_t designation = byte & 0x0F;
+        int32_t index = wordAt(*inst + 1);
+        // Only the first access tells whether the value comes from before
+        if (!isAccessed[designation][index] && byte <= I_LD_Arg &&
+            (*recorded[designation])[index] &&
+            !isAddressTaken[designation][index]) {
+          guards.emplace_back(designation, index);
+          intVars[designation][index] = true;
+        }
+        isAccessed[designation][index] = true;
+      }
+      if (byte == I_JMP || byte == I_CJMPz || byte == I_CJMPnz ||
+          byte == I_END || byte == I_FAIL || byte == I_TAGSWITCH)
+        break;
+    }
+  }
+  // Failing guards go on after the LOOP, as if the loop was never traced
+  const Slot *exit = &program->slots[program->slotOf[path->front()] + 3];
+  for (auto [designation, index] : guards) {
+    emitOp(static_cast<ThreadedOp>(T_GUARD_Int_Global + designation));
+    emitWord(index);
+    Slot slot;
+    slot.target = exit;
+    code.slots.push_back(slot);
+    code.sourceOffsets.push_back(-1);
+  }
+  bodySlot = code.slots.size();
+}
+
+void Translator::interpretKinds(const uint8_t *from, const uint8_t *to) {
+  auto pop = [&](size_t n) {
+    intOperands.resize(intOperands.size() - std::min(n, intOperands.size()));
+  };
+  auto push = [&](bool isInt) { intOperands.push_back(isInt); };
+  auto top = [&]() { return !intOperands.empty() && intOperands.back(); };
+  // Callees and STA may assign any global
+  auto forgetGlobals = [&]() {
+    intVars[LOC_Global].assign(intVars[LOC_Global].size(), false);
+  };
+  auto inst = std::lower_bound(traceInsts.begin(), traceInsts.end(), from);
+  for (; inst != traceInsts.end() && *inst < to; ++inst) {
+    const uint8_t *operands = *inst + 1;
+    uint8_t byte = **inst;
+    uint8_t low = 0x0F & byte;
+    switch (byte) {
+    case I_BINOP_Add:
+    case I_BINOP_Sub:
+    case I_BINOP_Mul:
+    case I_BINOP_Div:
+    case I_BINOP_Mod:
+    case I_BINOP_Lt:
+    case I_BINOP_Leq:
+    case I_BINOP_Gt:
+    case I_BINOP_Geq:
+    case I_BINOP_Eq:
+    case I_BINOP_Neq:
+    case I_BINOP_And:
+    case I_BINOP_Or:
+    case I_PATT_StrCmp:
+      pop(2);
+      push(true);
+      break;
+    case I_CONST:
+    case I_CALL_Lread:
+      push(true);
+      break;
+    case I_STRING:
+    case I_CLOSURE:
+      push(false);
+      break;
+    case I_SEXP:
+      pop(wordAt(operands + sizeof(int32_t)));
+      push(false);
+      break;
+    case I_STA:
+      forgetGlobals();
+      pop(3);
+      push(false);
+      break;
+    case I_DROP:
+    case I_CJMPz:
+    case I_CJMPnz:
+      pop(1);
+      break;
+    case I_DUP:
+      push(top());
+      break;
+    case I_SWAP:
+      if (intOperands.size() < 2)
+        intOperands.clear();
+      else
+        std::vector<bool>::swap(intOperands.back(),
+                                intOperands[intOperands.size() - 2]);
+      break;
+    case I_ELEM:
+      pop(2);
+      push(false);
+      break;
+    case I_LD_Global:
+    case I_LD_Local:
+    case I_LD_Arg:
+      push(intVars[low][wordAt(operands)]);
+      break;
+    case I_LD_Access:
+      push(false);
+      break;
+    case I_LDA_Global:
+    case I_LDA_Local:
+    case I_LDA_Arg:
+    case I_LDA_Access:
+      push(false);
+      push(false);
+      break;
+    case I_ST_Global:
+    case I_ST_Local:
+    case I_ST_Arg: {
+      int32_t index = wordAt(operands);
+      intVars[low][index] = top() && !isAddressTaken[low][index];
+      break;
+    }
+    case I_CALLC:
+      forgetGlobals();
+      pop(wordAt(operands) + 1);
+      push(false);
+      break;
+    case I_CALL:
+      forgetGlobals();
+      pop(wordAt(operands + sizeof(int32_t)));
+      push(false);
+      break;
+    case I_TAG:
+    case I_ARRAY:
+    case I_PATT_String:
+    case I_PATT_Array:
+    case I_PATT_Sexp:
+    case I_PATT_Boxed:
+    case I_PATT_UnBoxed:
+    case I_PATT_Closure:
+    case I_CALL_Lwrite:
+    case I_CALL_Llength:
+      pop(1);
+      push(true);
+      break;
+    case I_CALL_Lstring:
+      pop(1);
+      push(false);
+      break;
+    case I_CALL_Barray:
+      pop(wordAt(operands));
+      push(false);
+      break;
+    }
+  }
+}
+
+void Translator::noteSelfTailCall(int32_t nargs) {
+  std::vector<bool> &args = intVars[LOC_Arg];
+  for (int32_t i = nargs - 1; i >= 0; --i) {
+    args[i] = !intOperands.empty() && intOperands.back() &&
+              !isAddressTaken[LOC_Arg][i];
+    if (!intOperands.empty())
+      intOperands.pop_back();
+  }
+  // The frame starts over
+  intVars[LOC_Local].assign(intVars[LOC_Local].size(), false);
+}
+
+bool Translator::knowsInt(size_t n) const {
+  return mode == Mode::Trace && intOperands.size() >= n &&
+         std::all_of(intOperands.end() - n, intOperands.end(),
+                     [](bool isInt) { return isInt; });
+}
+
+bool Translator::guardsHold() const {
+  return std::all_of(guards.begin(), guards.end(), [&](const auto &guard) {
+    return intVars[guard.first][guard.second];
+  });
+}
+
+void Translator::emitCachedPush(ThreadedOp base, int stride,
+                                ThreadedOp flushed) {
+  emitOp(static_cast<ThreadedOp>(base + stride * cacheState));
+  if (cacheState == 0 && flushed != T_Count) {
+    lastPushSlot = code.slots.size() - 1;
+    lastPushFlushed = flushed;
+  }
+  cacheState = std::min(cacheState + 1, 2);
+}
+
+void Translator::flush() { spillTo(0); }
+
+void Translator::spillTo(int n) {
+  if (cacheState <= n)
+    return;
+  if (cacheState == 2) {
+    emitOp(n == 1 ? T_SPILL_S2 : T_FLUSH_S2);
+  } else if (lastPushSlot != SIZE_MAX) {
+    // Push to the stack in the first place, e.g. for `LD x; CALL f`
+    code.slots[lastPushSlot].handler = handlers[lastPushFlushed];
+    lastPushSlot = SIZE_MAX;
+  } else {
+    emitOp(T_FLUSH_S1);
+  }
+  cacheState = n;
+}
+
+bool Translator::translateInst() {
+  currentInstOffset = ioffsetOf(ip);
+  const InstInfo &info = codeInfo.instInfo[currentInstOffset];
+  bool startsBlock =
+      info.isLabel() || branched || *ip == I_BEGIN || *ip == I_BEGINcl;
+  branched = false;
+  // Control may come here from elsewhere, so nothing is cached
+  if (info.isLabel() && mode != Mode::Trace)
+    flush();
+  slotOf[currentInstOffset] = code.slots.size();
+  if (mode == Mode::Program && info.isLoopHeader())
+    emitLoop();
+  else if (mode == Mode::Recording && startsBlock)
+    emitRecord();
+  uint8_t byte = readByte();
+  uint8_t low = 0x0F & byte;
+  switch (byte) {
+  case I_BINOP_Add:
+  case I_BINOP_Sub:
+  case I_BINOP_Mul:
+  case I_BINOP_Div:
+  case I_BINOP_Mod:
+  case I_BINOP_Lt:
+  case I_BINOP_Leq:
+  case I_BINOP_Gt:
+  case I_BINOP_Geq:
+  case I_BINOP_Eq:
+  case I_BINOP_Neq:
+  case I_BINOP_And:
+  case I_BINOP_Or: {
+    int binop = byte - I_BINOP_Add;
+    if (cacheState == 0) {
+      emitOp(static_cast<ThreadedOp>(T_BINOP_Add + binop));
+    } else {
+      ThreadedOp base = cacheState == 1 ? T_BINOP_Add_S1 : T_BINOP_Add_S2;
+      if (codeInfo.instInfo[currentInstOffset].hasIntOperands() ||
+          knowsInt(2))
+        base = cacheState == 1 ? T_BINOP_Add_Int_S1 : T_BINOP_Add_Int_S2;
+      emitOp(static_cast<ThreadedOp>(base + binop));
+      cacheState = 1;
+    }
+    return true;
+  }
+  case I_CONST: {
+    Value value = boxInt(readWord());
+    const uint8_t *next = peekFusible(ip);
+    if (cacheState > 0 && next && I_BINOP_Add <= *next &&
+        *next <= I_BINOP_Or) {
+      // The cached operand is the left-hand side, in both cache states
+      currentInstOffset = ioffsetOf(next);
+      ThreadedOp base = T_CONST_BINOP_Add_S1;
+      if (codeInfo.instInfo[currentInstOffset].hasIntOperands() ||
+          knowsInt(1))
+        base = T_CONST_BINOP_Add_Int_S1;
+      emitOp(static_cast<ThreadedOp>(base + (*next - I_BINOP_Add)));
+      emitValue(value);
+      ip = next + 1;
+      return true;
+    }
+    if (cacheState > 0 && next && *next == I_ELEM) {
+      currentInstOffset = ioffsetOf(next);
+      emitOp(T_CONST_ELEM_S1);
+      emitValue(value);
+      ip = next + 1;
+      return true;
+    }
+    size_t slot = code.slots.size();
+    int previousCacheState = cacheState;
+    emitCachedPush(T_CONST_S0, 1, T_CONST);
+    emitValue(value);
+    if (mode == Mode::Trace) {
+      constSlot = slot;
+      constValue = value;
+      constCacheState = previousCacheState;
+    }
+    return true;
+  }
+  case I_STRING: {
+    flush();
+    int32_t offset = readWord();
+    if (codeInfo.instInfo[currentInstOffset].isSharedString()) {
+      emitOp(T_STRING_Shared);
+      emitWord(codeInfo.sharedStringGlobals.at(offset));
+    } else {
+      emitOp(T_STRING);
+    }
+    emitString(offset);
+    return true;
+  }
+  case I_SEXP: {
+    flush();
+    emitOp(T_SEXP);
+    readWord();
+    emitValue(codeInfo.tagHashes.at(currentInstOffset));
+    emitWord(readWord());
+    return true;
+  }
+  case I_STA: {
+    flush();
+    emitOp(T_STA);
+    return true;
+  }
+  case I_JMP: {
+    int32_t target = readWord();
+    if (mode == Mode::Trace) {
+      if (target != successor())
+        untraceable = true;
+      if (target != path->front())
+        return false;
+    }
+    flush();
+    emitOp(T_JMP);
+    emitTarget(target);
+    return false;
+  }
+  case I_END: {
+    // The traced frame never ends on the path
+    untraceable |= mode == Mode::Trace;
+    flush();
+    emitOp(T_END);
+    return false;
+  }
+  case I_DROP: {
+    const uint8_t *next = peekFusible(ip);
+    if (cacheState == 0 && next && *next == I_DROP) {
+      emitOp(T_DROP_DROP);
+      ip = next + 1;
+      return true;
+    }
+    if (cacheState == 2) {
+      emitOp(T_DROP_S2);
+    } else if (cacheState == 0) {
+      emitOp(T_DROP);
+    }
+    cacheState = std::max(cacheState - 1, 0);
+    return true;
+  }
+  case I_DUP: {
+    const uint8_t *second = peekFusible(ip);
+    const uint8_t *third =
+        second ? peekFusible(second + 1 + sizeof(int32_t)) : nullptr;
+    if (second && *second == I_CONST && third && *third == I_ELEM) {
+      ip = second + 1;
+      Value index = boxInt(readWord());
+      currentInstOffset = ioffsetOf(third);
+      emitCachedPush(T_DUP_CONST_ELEM_S0);
+      emitValue(index);
+      ip = third + 1;
+      return true;
+    }
+    third = second && *second == I_TAG
+                ? peekFusible(second + 1 + 2 * sizeof(int32_t))
+                : nullptr;
+    if (third && (*third == I_CJMPz || *third == I_CJMPnz)) {
+      // Both successors expect nothing cached
+      spillTo(1);
+      uint8_t jump = branchCode(third);
+      ThreadedOp op = jump == I_CJMPz ? T_DUP_TAG_CJMPz : T_DUP_TAG_CJMPnz;
+      if (cacheState == 1)
+        op = jump == I_CJMPz ? T_DUP_TAG_CJMPz_S1 : T_DUP_TAG_CJMPnz_S1;
+      cacheState = 0;
+      emitOp(op);
+      emitValue(codeInfo.tagHashes.at(ioffsetOf(second)));
+      ip = second + 1 + sizeof(int32_t);
+      emitWord(readWord());
+      emitTarget(branchTarget(third));
+      ip = third + 1 + sizeof(int32_t);
+      noteBranch(third);
+      return true;
+    }
+    if (cacheState == 0) {
+      emitOp(T_DUP);
+      return true;
+    }
+    emitOp(cacheState == 1 ? T_DUP_S1 : T_DUP_S2);
+    cacheState = 2;
+    return true;
+  }
+  case I_SWAP: {
+    if (cacheState == 2) {
+      emitOp(T_SWAP_S2);
+      return true;
+    }
+    flush();
+    emitOp(T_SWAP);
+    return true;
+  }
+  case I_ELEM: {
+    if (cacheState == 2) {
+      emitOp(T_ELEM_S2);
+      cacheState = 1;
+      return true;
+    }
+    flush();
+    emitOp(T_ELEM);
+    return true;
+  }
+  case I_LD_Global:
+  case I_LD_Local:
+  case I_LD_Arg:
+  case I_LD_Access: {
+    emitCachedPush(static_cast<ThreadedOp>(T_LD_Global_S0 + low), 4,
+                   static_cast<ThreadedOp>(T_LD_Global + low));
+    emitWord(readWord());
+    return true;
+  }
+  case I_LDA_Global:
+  case I_LDA_Local:
+  case I_LDA_Arg:
+  case I_LDA_Access: {
+    flush();
+    emitOp(static_cast<ThreadedOp>(T_LDA_Global + low));
+    emitWord(readWord());
+    return true;
+  }
+  case I_ST_Global:
+  case I_ST_Local:
+  case I_ST_Arg:
+  case I_ST_Access: {
+    // The cached variant only reads the top, so it serves both cache states
+    const uint8_t *next = peekFusible(ip + sizeof(int32_t));
+    if (cacheState == 0 && next && *next == I_DROP) {
+      emitOp(static_cast<ThreadedOp>(T_ST_Global_DROP + low));
+      emitWord(readWord());
+      ip = next + 1;
+      return true;
+    }
+    if (cacheState == 0) {
+      emitOp(static_cast<ThreadedOp>(T_ST_Global + low));
+    } else {
+      emitOp(static_cast<ThreadedOp>(T_ST_Global_S1 + low));
+    }
+    emitWord(readWord());
+    return true;
+  }
+  case I_CJMPz:
+  case I_CJMPnz: {
+    const uint8_t *jump = ip - 1;
+    ip += sizeof(int32_t);
+    if (constSlot != SIZE_MAX) {
+      // A trace knows where the constant leads, the path went there
+      bool jumps = (constValue == boxInt(0)) == (byte == I_CJMPz);
+      if ((jumps ? wordAt(jump + 1) : ioffsetOf(ip)) != successor())
+        untraceable = true;
+      code.slots.resize(constSlot);
+      code.sourceOffsets.resize(constSlot);
+      cacheState = constCacheState;
+      lastPushSlot = SIZE_MAX;
+      constSlot = SIZE_MAX;
+      branched = true;
+      lastBranch = nullptr;
+      return true;
+    }
+    // Both successors expect nothing cached
+    byte = branchCode(jump);
+    if (cacheState == 0) {
+      emitOp(byte == I_CJMPz ? T_CJMPz : T_CJMPnz);
+    } else {
+      spillTo(1);
+      if (codeInfo.instInfo[currentInstOffset].hasIntOperands() ||
+          knowsInt(1))
+        emitOp(byte == I_CJMPz ? T_CJMPz_Int_S1 : T_CJMPnz_Int_S1);
+      else
+        emitOp(byte == I_CJMPz ? T_CJMPz_S1 : T_CJMPnz_S1);
+      cacheState = 0;
+    }
+    emitTarget(branchTarget(jump));
+    noteBranch(jump);
+    return true;
+  }
+  case I_BEGIN:
+  case I_BEGINcl: {
+    // Calls set up the frame from the function descriptor
+    readWord();
+    readWord();
+    return true;
+  }
+  case I_CLOSURE: {
+    flush();
+    emitOp(T_CLOSURE);
+    emitFunction(readWord());
+    int32_t n = readWord();
+    emitWord(n);
+    for (int i = 0; i < n; ++i) {
+      emitWord(readByte());
+      emitWord(readWord());
+    }
+    return true;
+  }
+  case I_CALLC: {
+    flush();
+    bool isTail = codeInfo.instInfo[currentInstOffset].isTailCall();
+    // Leaves the traced frame
+    untraceable |= isTail && mode == Mode::Trace;
+    emitOp(isTail ? T_TAIL_CALLC : T_CALLC);
+    emitWord(readWord());
+    if (!isTail) {
+      // Inline cache, see CALLC_Mono
+      Slot slot;
+      slot.function = nullptr;
+      code.slots.push_back(slot);
+      code.sourceOffsets.push_back(-1);
+    }
+    return !isTail;
+  }
+  case I_CALL: {
+    flush();
+    bool isTail = codeInfo.instInfo[currentInstOffset].isTailCall();
+    int32_t callee = readWord();
+    int32_t nargs = readWord();
+    int32_t begin = ioffsetOf(codeInfo.functions[currentFunction].beginIp);
+    if (mode == Mode::Trace && isTail &&
+        (callee != path->front() || successor() != callee)) {
+      // Leaves the traced frame
+      untraceable = true;
+    }
+    if (mode != Mode::Program && isTail && callee == begin) {
+      // Stays in the recording copy, or closes the traced loop
+      if (mode == Mode::Trace)
+        noteSelfTailCall(nargs);
+      emitOp(T_TAIL_CALL_Self);
+      emitFunction(callee);
+      emitTarget(callee);
+      return false;
+    }
+    emitOp(isTail ? T_TAIL_CALL : T_CALL);
+    emitFunction(callee);
+    return !isTail;
+  }
+  case I_TAG:
+  case I_ARRAY:
+  case I_PATT_String:
+  case I_PATT_Array:
+  case I_PATT_Sexp:
+  case I_PATT_Boxed:
+  case I_PATT_UnBoxed:
+  case I_PATT_Closure: {
+    translatePattern(byte);
+    return true;
+  }
+  case I_FAIL: {
+    untraceable |= mode == Mode::Trace;
+    flush();
+    emitOp(T_FAIL);
+    emitWord(readWord());
+    emitWord(readWord());
+    return false;
+  }
+  case I_LINE: {
+    // Nothing to execute, jumps here land on the next operation
+    readWord();
+    return true;
+  }
+  case I_TAGSWITCH: {
+    // All targets expect nothing cached
+    flush();
+    emitOp(T_TAGSWITCH);
+    int32_t narms = readWord();
+    emitWord(narms);
+    emitTarget(readWord());
+    for (int32_t i = 0; i < narms; ++i) {
+      emitValue(codeInfo.tagHashes.at(ioffsetOf(ip)));
+      readWord();
+      emitWord(readWord());
+      emitTarget(readWord());
+    }
+    return false;
+  }
+  case I_PATT_StrCmp: {
+    flush();
+    emitOp(T_PATT_StrCmp);
+    return true;
+  }
+  case I_CALL_Lread:
+  case I_CALL_Lwrite:
+  case I_CALL_Llength:
+  case I_CALL_Lstring: {
+    flush();
+    emitOp(static_cast<ThreadedOp>(T_CALL_Lread + (byte - I_CALL_Lread)));
+    return true;
+  }
+  case I_CALL_Barray: {
+    flush();
+    emitOp(T_CALL_Barray);
+    emitWord(readWord());
+    return true;
+  }
+  }
+  runtimeError("unsupported instruction code {:#04x} at {:#x}", byte,
+               currentInstOffset);
+}
+
+void Translator::translatePattern(uint8_t byte) {
+  ThreadedOp flushed;
+  ThreadedOp cached;
+  switch (byte) {
+  case I_TAG:
+    flushed = T_TAG;
+    cached = T_TAG_S1;
+    break;
+  case I_ARRAY:
+    flushed = T_ARRAY;
+    cached = T_ARRAY_S1;
+    break;
+  default:
+    flushed = static_cast<ThreadedOp>(T_PATT_String + (byte - I_PATT_String));
+    cached = static_cast<ThreadedOp>(T_PATT_String_S1 +
+                                     3 * (byte - I_PATT_String));
+    break;
+  }
+  const uint8_t *operands = ip;
+  if (byte == I_TAG)
+    ip += 2 * sizeof(int32_t);
+  else if (byte == I_ARRAY)
+    ip += sizeof(int32_t);
+  const uint8_t *next = cacheState > 0 ? peekFusible(ip) : nullptr;
+  bool jumps = next && (*next == I_CJMPz || *next == I_CJMPnz);
+  if (cacheState == 0) {
+    emitOp(flushed);
+  } else if (jumps) {
+    // Both successors expect nothing cached
+    spillTo(1);
+    cacheState = 0;
+    emitOp(static_cast<ThreadedOp>(cached +
+                                   (branchCode(next) == I_CJMPz ? 1 : 2)));
+  } else {
+    // The cached variant only replaces the top, so it serves both states
+    emitOp(cached);
+  }
+  ip = operands;
+  if (byte == I_TAG) {
+    readWord();
+    emitValue(codeInfo.tagHashes.at(currentInstOffset));
+    emitWord(readWord());
+  } else if (byte == I_ARRAY) {
+    emitWord(readWord());
+  }
+  if (jumps) {
+    emitTarget(branchTarget(next));
+    ip = next + 1 + sizeof(int32_t);
+    noteBranch(next);
+  }
+}
+
+void Translator::translateFunction(const FunctionInfo &function) {
+  std::vector<const uint8_t *> insts = function.insts;
+  insts.push_back(function.beginIp);
+  std::sort(insts.begin(), insts.end());
+  for (size_t i = 0; i < insts.size(); ++i) {
+    ip = insts[i];
+    bool fallsThrough = translateInst();
+    // Skip instructions fused into the translated one
+    while (i + 1 < insts.size() && insts[i + 1] < ip)
+      ++i;
+    // The next instruction may be translated elsewhere, e.g. as a part of
+    // another function reaching it first
+    if (fallsThrough && (i + 1 == insts.size() || insts[i + 1] != ip)) {
+      flush();
+      emitOp(T_JMP);
+      emitTarget(ioffsetOf(ip));
+    }
+  }
+}
+
+void Translator::resolveTargets() {
+  for (size_t index : unresolvedTargets) {
+    int32_t ioffset = code.slots[index].word;
+    int32_t targetIndex = slotOf[ioffset];
+    if (targetIndex < 0) {
+      runtimeError("jump to untranslated instruction at {:#x}", ioffset);
+    }
+    code.slots[index].target = &code.slots[targetIndex];
+    if (codeInfo.instInfo[ioffset].isLoopHeader())
+      code.loopJumps[targetIndex].push_back(index);
+  }
+  for (size_t index = 0; index < code.functions.size(); ++index) {
+    int32_t ioffset = ioffsetOf(codeInfo.functions[index].beginIp);
+    code.functions[index].entry = &code.slots[slotOf[ioffset]];
+  }
+}
+
+ThreadedCode Translator::translate() {
+  for (; currentFunction < (int32_t)codeInfo.functions.size();
+       ++currentFunction)
+    translateFunction(codeInfo.functions[currentFunction]);
+  resolveTargets();
+  if (slotOf.empty() || slotOf[0] < 0) {
+    runtimeError("no function to start from at {:#x}", 0);
+  }
+  code.slotOf = std::move(slotOf);
+  // Frame records and closures keep slot and descriptor addresses in values
+  checkAddressable(code.slots.data(), code.slots.size() * sizeof(Slot));
+  checkAddressable(code.functions.data(),
+                   code.functions.size() * sizeof(FunctionDescriptor));
+  return std::move(code);
+}
+
+ThreadedFragment &Translator::addFragment() {
+  auto fragment = std::make_unique<ThreadedFragment>();
+  fragment->slots = std::move(code.slots);
+  fragment->sourceOffsets = std::move(code.sourceOffsets);
+  checkAddressable(fragment->slots.data(),
+                   fragment->slots.size() * sizeof(Slot));
+  program->fragments.push_back(std::move(fragment));
+  return *program->fragments.back();
+}
+
+void Translator::resolveFragmentTargets(ThreadedFragment &fragment) {
+  for (size_t index : unresolvedTargets) {
+    int32_t ioffset = fragment.slots[index].word;
+    const Slot *target;
+    if (mode == Mode::Trace && ioffset == path->front())
+      target = &fragment.slots[0];
+    else if (mode == Mode::Recording && slotOf[ioffset] >= 0)
+      target = &fragment.slots[slotOf[ioffset]];
+    else
+      target = &program->slots[program->slotOf[ioffset]];
+    fragment.slots[index].target = target;
+  }
+  for (size_t index : traceTargets)
+    fragment.slots[index].target = &fragment.slots[fragment.slots[index].word];
+}
+
+const ThreadedFragment &Translator::translateForRecording(int32_t index) {
+  mode = Mode::Recording;
+  currentFunction = index;
+  translateFunction(codeInfo.functions[index]);
+  ThreadedFragment &fragment = addFragment();
+  resolveFragmentTargets(fragment);
+  return fragment;
+}
+
+const ThreadedFragment *
+Translator::translateTrace(int32_t index, const std::vector<int32_t> &blocks,
+                           const TraceKinds &kinds) {
+  mode = Mode::Trace;
+  currentFunction = index;
+  path = &blocks;
+  nextBlock = 1;
+  int32_t header = blocks.front();
+  const FunctionInfo &function = codeInfo.functions[index];
+  traceInsts = function.insts;
+  traceInsts.push_back(function.beginIp);
+  std::sort(traceInsts.begin(), traceInsts.end());
+  isAddressTaken[LOC_Global].assign(kinds.intGlobals.size(), false);
+  isAddressTaken[LOC_Local].assign(function.nlocals, false);
+  isAddressTaken[LOC_Arg].assign(function.nargs, false);
+  for (const uint8_t *inst : traceInsts) {
+    if (*inst == I_LDA_Local || *inst == I_LDA_Arg)
+      isAddressTaken[0x0F & *inst][wordAt(inst + 1)] = true;
+  }
+  currentInstOffset = header;
+  emitGuards(kinds);
+  ip = byteFile.getCode() + header;
+  while (true) {
+    int32_t start = ioffsetOf(ip);
+    bool fallsThrough = translateInst();
+    if (untraceable)
+      return nullptr;
+    interpretKinds(byteFile.getCode() + start, ip);
+    // Blocks the operation was fused over
+    while (nextBlock < blocks.size() && start < blocks[nextBlock] &&
+           blocks[nextBlock] < ioffsetOf(ip))
+      ++nextBlock;
+    // Operations going on along the path go on right after themselves
+    for (size_t index : traceTargets) {
+      if (code.slots[index].word < 0)
+        code.slots[index].word = code.slots.size();
+    }
+    if (branched || !fallsThrough) {
+      if (nextBlock == blocks.size()) {
+        if (branched) {
+          // Back to the header, unless the jump went there already
+          bool backwards = lastBranch && branchTarget(lastBranch) == header;
+          flush();
+          emitOp(T_JMP);
+          emitTarget(backwards ? ioffsetOf(lastBranch) + 1 + sizeof(int32_t)
+                               : header);
+        }
+        break;
+      }
+      ip = byteFile.getCode() + blocks[nextBlock++];
+      continue;
+    }
+    int32_t next = ioffsetOf(ip);
+    if (next == header && nextBlock == blocks.size()) {
+      flush();
+      emitOp(T_JMP);
+      emitTarget(header);
+      break;
+    }
+    if (codeInfo.instInfo[next].isLabel()) {
+      // Where the path went on, unless the recording went wrong
+      if (nextBlock == blocks.size() || blocks[nextBlock] != next)
+        return nullptr;
+      ++nextBlock;
+    }
+  }
+  ThreadedFragment &fragment = addFragment();
+  resolveFragmentTargets(fragment);
+  return &fragment;
+}
+
+static int32_t sourceOffsetIn(const std::vector<int32_t> &sourceOffsets,
+                              size_t index) {
+  do {
+    --index;
+  } while (index > 0 && sourceOffsets[index] < 0);
+  return sourceOffsets[index];
+}
+
+int32_t ThreadedCode::sourceOffsetOf(const Slot *ip) const {
+  for (const auto &fragment : fragments) {
+    const std::vector<Slot> &code = fragment->slots;
+    if (code.data() < ip && ip <= code.data() + code.size())
+      return byteFile->sourceOffsetOf(
+          sourceOffsetIn(fragment->sourceOffsets, ip - code.data()));
+  }
+  return byteFile->sourceOffsetOf(
+      sourceOffsetIn(sourceOffsets, ip - slots.data()));
+}
+
+ThreadedCode lama::translate(ByteFile &byteFile, const CodeInfo &codeInfo,
+                             int32_t hotLoopIterations) {
+  Translator translator(byteFile, codeInfo, hotLoopIterations);
+  return translator.translate();
+}
+
+const ThreadedFragment &lama::translateForRecording(ThreadedCode &code,
+                                                    int32_t index) {
+  Translator translator(code);
+  return translator.translateForRecording(index);
+}
+
+const ThreadedFragment *
+lama::translateTrace(ThreadedCode &code, int32_t index,
+                     const std::vector<int32_t> &path,
+                     const TraceKinds &kinds) {
+  Translator translator(code);
+  return translator.translateTrace(index, path, kinds);
+}
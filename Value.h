@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Error.h"
 #include "fmt/format.h"
 #include <assert.h>
 #include <cstdint>
@@ -12,11 +13,78 @@ inline bool valueIsInt(Value value) { return value & 1; }
 
 inline bool valueIsPtr(Value value) { return !(value & 1); }
 
-inline Value boxInt(int32_t num) { return (num << 1) | 1; }
+/// Values referring to the heap, the stack or code hold the address itself.
+/// 64-bit builds keep all of those in the low 4 GiB of the address space,
+/// checked with checkAddressable() once they are allocated.
+inline Value pointerToValue(const void *pointer) {
+  assert(reinterpret_cast<uintptr_t>(pointer) <= UINT32_MAX);
+  return static_cast<Value>(reinterpret_cast<uintptr_t>(pointer));
+}
+
+template <typename T = void> inline T *valueToPointer(Value value) {
+  return reinterpret_cast<T *>(
+      static_cast<uintptr_t>(static_cast<uint32_t>(value)));
+}
+
+/// Checks that values may refer to the \p size bytes at \p pointer. The
+/// allocator only serves low addresses as long as the break can grow.
+inline void checkAddressable(const void *pointer, size_t size) {
+  uint64_t end = uint64_t{reinterpret_cast<uintptr_t>(pointer)} + size;
+  if (end > uint64_t{UINT32_MAX} + 1) {
+    runtimeError("{} bytes at {} are out of reach of values", size, pointer);
+  }
+}
+
+/// Numbers are 31-bit, the top bit is lost on overflow
+inline Value boxInt(int32_t num) {
+  return static_cast<Value>((static_cast<uint32_t>(num) << 1) | 1);
+}
 
 inline int32_t unboxInt(Value value) {
   assert(valueIsInt(value));
   return value >> 1;
 }
 
+/// Whether both values are numbers, in a single test
+inline bool valuesAreInts(Value lhs, Value rhs) { return lhs & rhs & 1; }
+
+// Arithmetic on boxed numbers, without unboxing where possible. Results
+// wrap around on overflow the same way as in code compiled by `lamac -s`,
+// computing in unsigned avoids undefined behaviour on the way.
+// Comparisons need nothing special, boxing preserves the order.
+
+inline Value boxedAdd(Value lhs, Value rhs) {
+  return static_cast<Value>(static_cast<uint32_t>(lhs) +
+                            static_cast<uint32_t>(rhs) - 1);
+}
+
+inline Value boxedSub(Value lhs, Value rhs) {
+  return static_cast<Value>(static_cast<uint32_t>(lhs) -
+                            static_cast<uint32_t>(rhs) + 1);
+}
+
+inline Value boxedMul(Value lhs, Value rhs) {
+  return static_cast<Value>(static_cast<uint32_t>(unboxInt(lhs)) *
+                                (static_cast<uint32_t>(rhs) - 1) +
+                            1);
+}
+
+/// \pre \p rhs is not zero
+inline Value boxedDiv(Value lhs, Value rhs) {
+  return boxInt(unboxInt(lhs) / unboxInt(rhs));
+}
+
+/// \pre \p rhs is not zero
+inline Value boxedMod(Value lhs, Value rhs) {
+  return boxInt(unboxInt(lhs) % unboxInt(rhs));
+}
+
+inline Value boxedAnd(Value lhs, Value rhs) {
+  return boxInt(lhs != boxInt(0) && rhs != boxInt(0));
+}
+
+inline Value boxedOr(Value lhs, Value rhs) {
+  return boxInt(lhs != boxInt(0) || rhs != boxInt(0));
+}
+
 } // namespace lama
@@ -1,19 +1,25 @@
 #include "Verifier.h"
 #include "ByteFile.h"
 #include "Inst.h"
+#include "Runtime.h"
 #include "fmt/format.h"
 #include <assert.h>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <string>
 #include <vector>
 
 using namespace lama;
 
-static constexpr int32_t LAMA_INT_MIN = -(1 << 30);
-static constexpr int32_t LAMA_INT_MAX = (1 << 30) - 1;
 static constexpr int32_t LAMA_INT_WIDTH = 31;
+/// Characters allowed in sexp tags, in the order the runtime hashes them
+static constexpr char LAMA_TAG_CHARS[] =
+    "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'";
+/// Only that many first characters of a tag are hashed
+static constexpr int LAMA_TAG_HASHED_LENGTH = 5;
 
 template <typename... A>
 [[noreturn]] static void invalidByteFileError(A &&...args) {
@@ -21,35 +27,8 @@ template <typename... A>
       fmt::format(std::forward<decltype(args)>(args)...));
 }
 
-static constexpr int32_t II_REACHED = (1 << 0);
-
-static constexpr int32_t FI_IS_CLOSURE = (1 << 0);
-
-using FunctionIndex = int32_t;
-static constexpr FunctionIndex InvalidFunctionIndex = -1;
-
 namespace {
 
-struct FunctionInfo {
-  int8_t flags = 0;
-  int16_t nclosurevars = 0;
-  const uint8_t *beginIp;
-  std::vector<const uint8_t *> insts;
-
-  bool isClosure() const noexcept { return flags & FI_IS_CLOSURE; }
-  bool isNonClosure() const noexcept { return !isClosure(); }
-  void setClosure() noexcept { flags |= FI_IS_CLOSURE; }
-  void setNonClosure() noexcept { flags &= ~FI_IS_CLOSURE; }
-};
-
-struct InstInfo {
-  int8_t flags = 0;
-  int16_t operandStackSize;
-
-  bool isReached() const noexcept { return flags & II_REACHED; }
-  void setReached() noexcept { flags |= II_REACHED; }
-};
-
 class Verifier {
 public:
   Verifier(ByteFile &file);
@@ -59,6 +38,8 @@ public:
 
   void augument() noexcept;
 
+  CodeInfo takeCodeInfo() noexcept;
+
 private:
   void verifyStringTable();
   /// \throws InvalidByteFileError on invalid public symbol table
@@ -68,6 +49,16 @@ private:
   void parseFunction(FunctionIndex functionIndex);
 
   void augumentFunction(FunctionIndex functionIndex);
+  /// Marks the instructions whose operands are proven to be numbers
+  void inferKinds(FunctionIndex functionIndex);
+  /// Marks the STRING at \p ip shared if its result is only read
+  void shareString(const uint8_t *ip) noexcept;
+  /// Marks the CALL or CALLC at \p ip a tail call if only LINEs and JMPs
+  /// lead from it to an END
+  void markTailCall(const uint8_t *ip) noexcept;
+  /// \return the instruction at \p ip, skipping LINEs, if control reaches it
+  /// only from the instruction before, nullptr otherwise
+  const uint8_t *nextInChain(const uint8_t *ip) noexcept;
 
   void enqueuePublicSymbols();
   /// \pre #ip is valid
@@ -83,6 +74,9 @@ private:
 
   const uint8_t *lookUpIp(int32_t ioffset);
   const char *lookUpString(int32_t soffset);
+  /// Hashes the tag of the SEXP, TAG or TAGSWITCH arm at \p ip the way
+  /// LtagHash does
+  void hashTag(const uint8_t *ip, const char *tag);
 
   void verifyIp(int32_t ioffset);
   void verifyString(int32_t offset);
@@ -101,6 +95,7 @@ private:
   }
 
   friend class InstParser;
+  friend class KindInference;
 
 private:
   ByteFile &file;
@@ -108,6 +103,8 @@ private:
   std::unique_ptr<FunctionIndex[]> functionIndex;
   std::vector<const uint8_t *> instStack;
   std::vector<FunctionInfo> functions;
+  std::unordered_map<int32_t, Value> tagHashes;
+  std::unordered_map<int32_t, int32_t> sharedStringGlobals;
   const uint8_t *const codeBegin;
   const uint8_t *const codeEnd;
 
@@ -126,7 +123,9 @@ public:
   /// \throws InvalidByteFileError
   void parse();
 
-  const uint8_t *getJumpTarget() const noexcept { return jumpTarget; }
+  const std::vector<const uint8_t *> &getJumpTargets() const noexcept {
+    return jumpTargets;
+  }
   bool doesStop() const noexcept { return stop; }
   const uint8_t *getNextIp() const noexcept { return ip; }
   int32_t getNextOperandStackSize() const noexcept {
@@ -155,10 +154,65 @@ private:
 
   int32_t currentOperandStackSize;
 
-  const uint8_t *jumpTarget = nullptr;
+  std::vector<const uint8_t *> jumpTargets;
   bool stop = false;
 };
 
+/// What is known about a value: the set of kinds it may be of.
+/// Facts coming from several predecessors are joined by union.
+enum ValueKind : uint8_t {
+  VK_None = 0,
+  VK_Int = (1 << 0),
+  VK_Ref = (1 << 1),
+  VK_Any = VK_Int | VK_Ref,
+  /// A local that may not be assigned yet, never on the operand stack
+  VK_Unassigned = (1 << 2),
+};
+
+/// Kinds of the operands and variables at some point of a function
+struct KindState {
+  std::vector<uint8_t> operands;
+  /// Arguments, then locals
+  std::vector<uint8_t> vars;
+
+  /// \return whether \p other added anything
+  bool join(const KindState &other);
+};
+
+/// Infers which operands of a verified function are numbers, and which
+/// locals the function or the GC may see before they are assigned.
+///
+/// Interprets the function over #ValueKind like InstParser does over the
+/// operand stack size, but repeats until the states at labels stop
+/// changing, as a loop may make a variable a non-number after its head.
+class KindInference {
+public:
+  KindInference(Verifier &verifier, FunctionInfo &function);
+
+  void run();
+
+private:
+  /// Interprets straight-line code from \p ip until control stops or
+  /// reaches a label
+  void interpretFrom(const uint8_t *ip, KindState state);
+  /// Joins \p state into the state at the label \p ip
+  void joinAt(const uint8_t *ip, const KindState &state);
+
+  int32_t readWord(const uint8_t *&ip);
+
+private:
+  Verifier &verifier;
+  FunctionInfo &function;
+  int32_t nargs;
+  int32_t nlocals;
+  /// Locals read, captured or scanned by the GC while maybe unassigned
+  std::vector<bool> isObserved;
+  /// Variables whose address is taken by LDA, they may be changed by STA
+  std::vector<bool> isAddressTaken;
+  std::unordered_map<int32_t, KindState> labelStates;
+  std::vector<const uint8_t *> worklist;
+};
+
 } // namespace
 
 InstParser::InstParser(const uint8_t *ip, Verifier &verifier)
@@ -261,6 +315,7 @@ void InstParser::parse() {
     if (nargs < 0) {
       invalidByteFileError("invalid nargs {} in SEXP {}", nargs, str);
     }
+    verifier.hashTag(beginIp, str);
     operandStackPop(nargs);
     operandStackPush(1);
     return;
@@ -271,8 +326,7 @@ void InstParser::parse() {
     return;
   }
   case I_JMP: {
-    const uint8_t *ip = nextIp();
-    jumpTarget = ip;
+    jumpTargets.push_back(nextIp());
     stop = true;
     return;
   }
@@ -325,7 +379,7 @@ void InstParser::parse() {
   }
   case I_CJMPz:
   case I_CJMPnz: {
-    jumpTarget = nextIp();
+    jumpTargets.push_back(nextIp());
     operandStackPop(1);
     return;
   }
@@ -344,6 +398,9 @@ void InstParser::parse() {
     }
     verifier.currentFunction.nargs = nargs;
     verifier.currentFunction.nlocals = nlocals;
+    FunctionInfo &function = verifier.functions[verifier.currentFunction.index];
+    function.nargs = nargs;
+    function.nlocals = nlocals;
     return;
   }
   case I_CLOSURE: {
@@ -387,6 +444,7 @@ void InstParser::parse() {
     if (nargs < 0) {
       invalidByteFileError("negative nargs {} in TAG {}", nargs, str);
     }
+    verifier.hashTag(beginIp, str);
     operandStackPop(1);
     operandStackPush(1);
     return;
@@ -411,6 +469,28 @@ void InstParser::parse() {
     nextSigned();
     return;
   }
+  case I_TAGSWITCH: {
+    int32_t narms = nextSigned();
+    if (narms <= 0) {
+      invalidByteFileError("invalid narms {} in TAGSWITCH", narms);
+    }
+    jumpTargets.push_back(nextIp());
+    for (int32_t i = 0; i < narms; ++i) {
+      const uint8_t *arm = ip;
+      const char *str = nextString();
+      int32_t nargs = nextSigned();
+      if (nargs < 0) {
+        invalidByteFileError("negative nargs {} in TAGSWITCH {}", nargs, str);
+      }
+      verifier.hashTag(arm, str);
+      jumpTargets.push_back(nextIp());
+    }
+    // The operand is left for the arm
+    operandStackPop(1);
+    operandStackPush(1);
+    stop = true;
+    return;
+  }
   case I_PATT_StrCmp: {
     operandStackPop(2);
     operandStackPush(1);
@@ -515,6 +595,26 @@ const char *Verifier::lookUpString(int32_t soffset) {
   return file.getStringTable() + soffset;
 }
 
+void Verifier::hashTag(const uint8_t *ip, const char *tag) {
+  uint32_t hash = 0;
+  for (int i = 0; i < LAMA_TAG_HASHED_LENGTH && tag[i]; ++i) {
+    const char *position = strchr(LAMA_TAG_CHARS, tag[i]);
+    if (!position) {
+      invalidByteFileError("invalid character '{}' in tag {}", tag[i], tag);
+    }
+    hash = (hash << 6) | (position - LAMA_TAG_CHARS);
+  }
+  // Leading underscores are lost in the hash, the runtime rejects tags it
+  // can not restore from the hash
+  std::string restored;
+  for (uint32_t rest = hash; rest; rest >>= 6)
+    restored.insert(restored.begin(), LAMA_TAG_CHARS[rest & 0x3F]);
+  if (strncmp(tag, restored.c_str(), LAMA_TAG_HASHED_LENGTH) != 0) {
+    invalidByteFileError("tag {} has no unique hash", tag);
+  }
+  tagHashes[ioffsetOf(ip)] = boxInt(hash);
+}
+
 const uint8_t *Verifier::lookUpIp(int32_t ioffset) {
   verifyIp(ioffset);
   return codeBegin + ioffset;
@@ -523,8 +623,11 @@ const uint8_t *Verifier::lookUpIp(int32_t ioffset) {
 void Verifier::parseAt(const uint8_t *ip) {
   InstParser parser(ip, *this);
   parser.parse();
-  if (parser.getJumpTarget()) {
-    enqueueInst(parser.getJumpTarget(), parser.getNextOperandStackSize());
+  for (const uint8_t *target : parser.getJumpTargets()) {
+    enqueueInst(target, parser.getNextOperandStackSize());
+    instInfoOf(target)->setLabel();
+    if (target <= ip)
+      instInfoOf(target)->setLoopHeader();
   }
   if (!parser.doesStop()) {
     enqueueInst(parser.getNextIp(), parser.getNextOperandStackSize());
@@ -588,6 +691,7 @@ void Verifier::enqueueInst(const uint8_t *ip, int16_t currentOperandStackSize) {
   }
   InstInfo *info = instInfoOf(ip);
   if (info->isReached()) {
+    info->setLabel();
     if (info->operandStackSize != currentOperandStackSize) {
       invalidByteFileError(
           "operand stack size inconsistency at instruction {:#x}; {} vs. {}",
@@ -610,18 +714,374 @@ void Verifier::enqueuePublicSymbols() {
   }
 }
 
+bool KindState::join(const KindState &other) {
+  bool changed = false;
+  auto joinAll = [&](std::vector<uint8_t> &kinds,
+                     const std::vector<uint8_t> &others) {
+    for (size_t i = 0; i < kinds.size(); ++i) {
+      uint8_t joined = kinds[i] | others[i];
+      changed |= joined != kinds[i];
+      kinds[i] = joined;
+    }
+  };
+  joinAll(operands, other.operands);
+  joinAll(vars, other.vars);
+  return changed;
+}
+
+KindInference::KindInference(Verifier &verifier, FunctionInfo &function)
+    : verifier(verifier), function(function) {}
+
+int32_t KindInference::readWord(const uint8_t *&ip) {
+  int32_t word;
+  memcpy(&word, ip, sizeof(word));
+  ip += sizeof(word);
+  return word;
+}
+
+void KindInference::run() {
+  const uint8_t *ip = function.beginIp + 1;
+  nargs = readWord(ip);
+  nlocals = readWord(ip);
+  isAddressTaken.assign(nargs + nlocals, false);
+  isObserved.assign(nlocals, false);
+  for (const uint8_t *inst : function.insts) {
+    const uint8_t *operand = inst + 1;
+    if (*inst == I_LDA_Local) {
+      // STA may assign it at any time later
+      int32_t local = readWord(operand);
+      isAddressTaken[nargs + local] = true;
+      isObserved[local] = true;
+    } else if (*inst == I_LDA_Arg) {
+      isAddressTaken[readWord(operand)] = true;
+    }
+  }
+  // Nothing is known about the arguments, and locals are better not read
+  // before they are assigned
+  KindState entryState;
+  entryState.vars.assign(nargs + nlocals, VK_Any | VK_Unassigned);
+  std::fill_n(entryState.vars.begin(), nargs, VK_Any);
+  interpretFrom(function.beginIp, std::move(entryState));
+  while (!worklist.empty()) {
+    const uint8_t *label = worklist.back();
+    worklist.pop_back();
+    interpretFrom(label, labelStates.at(verifier.ioffsetOf(label)));
+  }
+  // The stack prefills the locals nearest to the arguments
+  function.nprefilledLocals = 0;
+  for (int32_t local = 0; local < nlocals; ++local) {
+    if (isObserved[local])
+      function.nprefilledLocals = local + 1;
+  }
+}
+
+void KindInference::joinAt(const uint8_t *ip, const KindState &state) {
+  auto [it, inserted] = labelStates.try_emplace(verifier.ioffsetOf(ip), state);
+  if (inserted || it->second.join(state))
+    worklist.push_back(ip);
+}
+
+void KindInference::interpretFrom(const uint8_t *ip, KindState state) {
+  std::vector<uint8_t> &operands = state.operands;
+  auto pop = [&](int32_t n) { operands.resize(operands.size() - n); };
+  auto push = [&](uint8_t kind) { operands.push_back(kind); };
+  auto top = [&](int32_t i) { return operands[operands.size() - 1 - i]; };
+  auto store = [&](int32_t var) {
+    state.vars[var] = isAddressTaken[var] ? VK_Any : top(0);
+  };
+  auto load = [&](int32_t var) {
+    if (state.vars[var] & VK_Unassigned)
+      isObserved[var - nargs] = true;
+    push(state.vars[var] & VK_Any);
+  };
+  // Whatever may allocate may run the GC, which scans all locals
+  auto collect = [&]() {
+    for (int32_t local = 0; local < nlocals; ++local) {
+      if (state.vars[nargs + local] & VK_Unassigned)
+        isObserved[local] = true;
+    }
+  };
+  for (bool first = true;; first = false) {
+    if (!first && verifier.instInfoOf(ip)->isLabel()) {
+      joinAt(ip, state);
+      return;
+    }
+    InstInfo *info = verifier.instInfoOf(ip);
+    uint8_t byte = *ip++;
+    switch (byte) {
+    case I_BINOP_Add:
+    case I_BINOP_Sub:
+    case I_BINOP_Mul:
+    case I_BINOP_Div:
+    case I_BINOP_Mod:
+    case I_BINOP_Lt:
+    case I_BINOP_Leq:
+    case I_BINOP_Gt:
+    case I_BINOP_Geq:
+    case I_BINOP_Eq:
+    case I_BINOP_Neq:
+    case I_BINOP_And:
+    case I_BINOP_Or:
+      info->proveIntOperands(top(0) == VK_Int && top(1) == VK_Int);
+      pop(2);
+      push(VK_Int);
+      break;
+    case I_CONST:
+      readWord(ip);
+      push(VK_Int);
+      break;
+    case I_STRING:
+      collect();
+      readWord(ip);
+      push(VK_Ref);
+      break;
+    case I_SEXP:
+      collect();
+      readWord(ip);
+      pop(readWord(ip));
+      push(VK_Ref);
+      break;
+    case I_STA:
+      pop(3);
+      push(VK_Any);
+      break;
+    case I_JMP:
+      joinAt(verifier.codeBegin + readWord(ip), state);
+      return;
+    case I_END:
+      return;
+    case I_FAIL:
+      collect();
+      return;
+    case I_DROP:
+      pop(1);
+      break;
+    case I_DUP:
+      push(top(0));
+      break;
+    case I_SWAP:
+      std::swap(operands[operands.size() - 1], operands[operands.size() - 2]);
+      break;
+    case I_ELEM:
+      info->proveIntOperands(top(0) == VK_Int);
+      pop(2);
+      push(VK_Any);
+      break;
+    case I_LD_Local:
+      load(nargs + readWord(ip));
+      break;
+    case I_LD_Arg:
+      load(readWord(ip));
+      break;
+    case I_LD_Global:
+    case I_LD_Access:
+      readWord(ip);
+      push(VK_Any);
+      break;
+    case I_LDA_Global:
+    case I_LDA_Local:
+    case I_LDA_Arg:
+    case I_LDA_Access:
+      readWord(ip);
+      push(VK_Any);
+      push(VK_Any);
+      break;
+    case I_ST_Local:
+      store(nargs + readWord(ip));
+      break;
+    case I_ST_Arg:
+      store(readWord(ip));
+      break;
+    case I_ST_Global:
+    case I_ST_Access:
+      readWord(ip);
+      break;
+    case I_CJMPz:
+    case I_CJMPnz:
+      info->proveIntOperands(top(0) == VK_Int);
+      pop(1);
+      joinAt(verifier.codeBegin + readWord(ip), state);
+      break;
+    case I_BEGIN:
+    case I_BEGINcl:
+      readWord(ip);
+      readWord(ip);
+      break;
+    case I_CLOSURE: {
+      collect();
+      readWord(ip);
+      int32_t n = readWord(ip);
+      for (int32_t i = 0; i < n; ++i) {
+        uint8_t designation = *ip++;
+        int32_t index = readWord(ip);
+        if (designation == LOC_Local &&
+            (state.vars[nargs + index] & VK_Unassigned))
+          isObserved[index] = true;
+      }
+      push(VK_Ref);
+      break;
+    }
+    case I_CALLC:
+      collect();
+      pop(readWord(ip) + 1);
+      push(VK_Any);
+      break;
+    case I_CALL:
+      collect();
+      readWord(ip);
+      pop(readWord(ip));
+      push(VK_Any);
+      break;
+    case I_TAG:
+      readWord(ip);
+      readWord(ip);
+      pop(1);
+      push(VK_Int);
+      break;
+    case I_ARRAY:
+      readWord(ip);
+      pop(1);
+      push(VK_Int);
+      break;
+    case I_LINE:
+      readWord(ip);
+      break;
+    case I_TAGSWITCH: {
+      int32_t narms = readWord(ip);
+      joinAt(verifier.codeBegin + readWord(ip), state);
+      for (int32_t i = 0; i < narms; ++i) {
+        readWord(ip);
+        readWord(ip);
+        joinAt(verifier.codeBegin + readWord(ip), state);
+      }
+      return;
+    }
+    case I_PATT_StrCmp:
+      pop(2);
+      push(VK_Int);
+      break;
+    case I_PATT_String:
+    case I_PATT_Array:
+    case I_PATT_Sexp:
+    case I_PATT_Boxed:
+    case I_PATT_UnBoxed:
+    case I_PATT_Closure:
+    case I_CALL_Lwrite:
+    case I_CALL_Llength:
+      pop(1);
+      push(VK_Int);
+      break;
+    case I_CALL_Lread:
+      push(VK_Int);
+      break;
+    case I_CALL_Lstring:
+      collect();
+      pop(1);
+      push(VK_Ref);
+      break;
+    case I_CALL_Barray:
+      collect();
+      pop(readWord(ip));
+      push(VK_Ref);
+      break;
+    }
+  }
+}
+
+void Verifier::inferKinds(FunctionIndex functionIndex) {
+  KindInference inference(*this, functions[functionIndex]);
+  inference.run();
+}
+
 void Verifier::augumentFunction(FunctionIndex functionIndex) {
+  inferKinds(functionIndex);
   auto &function = functions[functionIndex];
-  int16_t maxOperandStackSize = 0;
   for (const uint8_t *ip : function.insts) {
     InstInfo *info = instInfoOf(ip);
-    maxOperandStackSize = std::max(maxOperandStackSize, info->operandStackSize);
+    function.maxOperandStackSize =
+        std::max<int32_t>(function.maxOperandStackSize, info->operandStackSize);
+    if (*ip == I_STRING)
+      shareString(ip);
+    else if (*ip == I_CALL || *ip == I_CALLC)
+      markTailCall(ip);
+    if (*ip == I_CALL && info->isTailCall()) {
+      int32_t callee;
+      memcpy(&callee, ip + 1, sizeof(callee));
+      if (callee == ioffsetOf(function.beginIp))
+        instInfoOf(function.beginIp)->setLoopHeader();
+    }
   }
-  const uint8_t *beginIp = function.beginIp;
-  int32_t nargs;
-  memcpy(&nargs, beginIp + 1, sizeof(nargs));
-  nargs |= ((int32_t)maxOperandStackSize << 16);
-  memcpy(const_cast<uint8_t *>(beginIp) + 1, &nargs, sizeof(nargs));
+}
+
+const uint8_t *Verifier::nextInChain(const uint8_t *ip) noexcept {
+  for (; ip < codeEnd; ip += 1 + sizeof(int32_t)) {
+    if (instInfoOf(ip)->isLabel())
+      return nullptr;
+    if (*ip != I_LINE)
+      return ip;
+  }
+  return nullptr;
+}
+
+void Verifier::markTailCall(const uint8_t *ip) noexcept {
+  const uint8_t *next = ip + 1 + (*ip == I_CALL ? 2 : 1) * sizeof(int32_t);
+  // Bounded, as JMPs may form a loop
+  for (int njumps = 0; njumps < 8 && next < codeEnd;) {
+    if (*next == I_END) {
+      instInfoOf(ip)->setTailCall();
+      return;
+    }
+    if (*next == I_LINE) {
+      next += 1 + sizeof(int32_t);
+    } else if (*next == I_JMP) {
+      int32_t offset;
+      memcpy(&offset, next + 1, sizeof(offset));
+      next = file.getCode() + offset;
+      ++njumps;
+    } else {
+      return;
+    }
+  }
+}
+
+void Verifier::shareString(const uint8_t *ip) noexcept {
+  const uint8_t *next = nextInChain(ip + 1 + sizeof(int32_t));
+  if (!next)
+    return;
+  switch (*next) {
+  case I_CONST:
+  case I_LD_Global:
+  case I_LD_Local:
+  case I_LD_Arg:
+  case I_LD_Access: {
+    // Only a string index or a string to compare with may come in between
+    next = nextInChain(next + 1 + sizeof(int32_t));
+    if (!next || (*next != I_ELEM && *next != I_PATT_StrCmp))
+      return;
+    break;
+  }
+  case I_PATT_StrCmp:
+  case I_PATT_String:
+  case I_PATT_Array:
+  case I_PATT_Sexp:
+  case I_PATT_Boxed:
+  case I_PATT_UnBoxed:
+  case I_PATT_Closure:
+  case I_CALL_Llength:
+  case I_CALL_Lstring:
+    break;
+  default:
+    return;
+  }
+  int32_t soffset;
+  memcpy(&soffset, ip + 1, sizeof(soffset));
+  if (!sharedStringGlobals.count(soffset)) {
+    size_t index = file.getGlobalAreaSize() + sharedStringGlobals.size();
+    if (index >= globalAreaCapacity())
+      return;
+    sharedStringGlobals[soffset] = index;
+  }
+  instInfoOf(ip)->setSharedString();
 }
 
 void Verifier::parseFunction(FunctionIndex functionIndex) {
@@ -648,8 +1108,10 @@ void Verifier::parseFunction(FunctionIndex functionIndex) {
 
 void Verifier::parse() {
   enqueuePublicSymbols();
+  // Parsing a function may enqueue more of them
   for (FunctionIndex currentFunctionIndex = 0;
-       currentFunctionIndex < functions.size(); ++currentFunctionIndex) {
+       currentFunctionIndex < FunctionIndex(functions.size());
+       ++currentFunctionIndex) {
     try {
       parseFunction(currentFunctionIndex);
     } catch (InvalidByteFileError &e) {
@@ -691,12 +1153,20 @@ void Verifier::verify() {
 }
 
 void Verifier::augument() noexcept {
-  for (FunctionIndex index = 0; index < functions.size(); ++index)
+  FunctionIndex nfunctions = functions.size();
+  for (FunctionIndex index = 0; index < nfunctions; ++index)
     augumentFunction(index);
 }
 
-void lama::verify(ByteFile &file) {
+CodeInfo Verifier::takeCodeInfo() noexcept {
+  return CodeInfo{std::move(instInfo), std::move(functions),
+                  std::move(functionIndex), std::move(tagHashes),
+                  std::move(sharedStringGlobals)};
+}
+
+CodeInfo lama::verify(ByteFile &file) {
   Verifier verifier(file);
   verifier.verify();
   verifier.augument();
+  return verifier.takeCodeInfo();
 }
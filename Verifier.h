@@ -1,6 +1,11 @@
 #pragma once
 
+#include "Value.h"
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 namespace lama {
 
@@ -11,7 +16,95 @@ public:
   using std::runtime_error::runtime_error;
 };
 
+static constexpr int32_t II_REACHED = (1 << 0);
+static constexpr int32_t II_LABEL = (1 << 1);
+static constexpr int32_t II_SHARED_STRING = (1 << 2);
+static constexpr int32_t II_INT_OPERANDS = (1 << 3);
+static constexpr int32_t II_MAYBE_NOT_INT_OPERANDS = (1 << 4);
+static constexpr int32_t II_TAIL_CALL = (1 << 5);
+static constexpr int32_t II_LOOP_HEADER = (1 << 6);
+
+static constexpr int32_t FI_IS_CLOSURE = (1 << 0);
+
+/// CONST operands are accepted from LAMA_INT_MIN up to, not including,
+/// LAMA_INT_MAX
+static constexpr int32_t LAMA_INT_MIN = -(1 << 30);
+static constexpr int32_t LAMA_INT_MAX = (1 << 30) - 1;
+
+using FunctionIndex = int32_t;
+static constexpr FunctionIndex InvalidFunctionIndex = -1;
+
+struct FunctionInfo {
+  int8_t flags = 0;
+  int16_t nclosurevars = 0;
+  const uint8_t *beginIp;
+  int32_t nargs = 0;
+  int32_t nlocals = 0;
+  /// Operands the function may keep on the stack at once
+  int32_t maxOperandStackSize = 0;
+  /// Locals, from the first one, that must be filled with a number on
+  /// entry, as they may be read or scanned by the GC before assigned
+  int32_t nprefilledLocals = 0;
+  /// Reachable instructions of the function, except the BEGIN/CBEGIN
+  std::vector<const uint8_t *> insts;
+
+  bool isClosure() const noexcept { return flags & FI_IS_CLOSURE; }
+  bool isNonClosure() const noexcept { return !isClosure(); }
+  void setClosure() noexcept { flags |= FI_IS_CLOSURE; }
+  void setNonClosure() noexcept { flags &= ~FI_IS_CLOSURE; }
+};
+
+struct InstInfo {
+  int8_t flags = 0;
+  int16_t operandStackSize;
+
+  bool isReached() const noexcept { return flags & II_REACHED; }
+  void setReached() noexcept { flags |= II_REACHED; }
+  /// Reached by a jump, or from several instructions
+  bool isLabel() const noexcept { return flags & II_LABEL; }
+  void setLabel() noexcept { flags |= II_LABEL; }
+  /// A STRING whose result is only read, and never escapes the instruction
+  /// consuming it, so the literal may be shared between executions
+  bool isSharedString() const noexcept { return flags & II_SHARED_STRING; }
+  void setSharedString() noexcept { flags |= II_SHARED_STRING; }
+  /// The operands the instruction expects to be numbers are proven to be
+  /// numbers: both operands of BINOP, the condition of CJMPz/CJMPnz and
+  /// the index of ELEM. Code shared by several functions has to be proven
+  /// in all of them.
+  bool hasIntOperands() const noexcept {
+    return (flags & (II_INT_OPERANDS | II_MAYBE_NOT_INT_OPERANDS)) ==
+           II_INT_OPERANDS;
+  }
+  void proveIntOperands(bool proven) noexcept {
+    flags |= proven ? II_INT_OPERANDS : II_MAYBE_NOT_INT_OPERANDS;
+  }
+  /// A CALL or CALLC whose result is returned right away, so the callee
+  /// may take over the frame of the caller
+  bool isTailCall() const noexcept { return flags & II_TAIL_CALL; }
+  void setTailCall() noexcept { flags |= II_TAIL_CALL; }
+  /// Target of a backward jump, or the BEGIN of a function calling itself
+  /// as a tail call, so that a loop may run through it
+  bool isLoopHeader() const noexcept { return flags & II_LOOP_HEADER; }
+  void setLoopHeader() noexcept { flags |= II_LOOP_HEADER; }
+};
+
+/// What the verifier has learned about the code of a bytefile.
+struct CodeInfo {
+  /// Indexed by instruction offset
+  std::unique_ptr<InstInfo[]> instInfo;
+  std::vector<FunctionInfo> functions;
+  /// Indexed by instruction offset, the function beginning there or
+  /// InvalidFunctionIndex
+  std::unique_ptr<FunctionIndex[]> functionIndex;
+  /// Boxed hashes of the tags of SEXP and TAG, by instruction offset, and
+  /// of the arms of TAGSWITCH, by the offset of the arm
+  std::unordered_map<int32_t, Value> tagHashes;
+  /// Global variable indices caching the shared string literals, by string
+  /// table offset. They follow the globals of the bytefile.
+  std::unordered_map<int32_t, int32_t> sharedStringGlobals;
+};
+
 /// \throws InvalidByteFileError
-void verify(ByteFile &file);
+CodeInfo verify(ByteFile &file);
 
 } // namespace lama
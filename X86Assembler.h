@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace lama {
+
+enum X86Reg : uint8_t {
+  EAX = 0,
+  ECX = 1,
+  EDX = 2,
+  EBX = 3,
+  ESP = 4,
+  EBP = 5,
+  ESI = 6,
+  EDI = 7,
+};
+
+enum X86Cond : uint8_t {
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_L = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G = 0xF,
+};
+
+/// Opcodes of the `op r/m32, r32` form of two-operand ALU instructions
+enum X86AluOp : uint8_t {
+  ALU_Add = 0x01,
+  ALU_Or = 0x09,
+  ALU_And = 0x21,
+  ALU_Sub = 0x29,
+  ALU_Xor = 0x31,
+  ALU_Cmp = 0x39,
+};
+
+/// Minimal IA-32 machine code emitter.
+class X86Assembler {
+public:
+  const std::vector<uint8_t> &getCode() const { return code; }
+  size_t size() const { return code.size(); }
+
+  /// mov r32, [base + disp]
+  void movLoad(X86Reg reg, X86Reg base, int32_t disp) {
+    byte(0x8B);
+    modrmMem(reg, base, disp);
+  }
+  /// mov [base + disp], r32
+  void movStore(X86Reg base, int32_t disp, X86Reg reg) {
+    byte(0x89);
+    modrmMem(reg, base, disp);
+  }
+  /// mov dword [base + disp], imm32
+  void movStoreImm(X86Reg base, int32_t disp, int32_t imm) {
+    byte(0xC7);
+    modrmMem(0, base, disp);
+    imm32(imm);
+  }
+  /// mov dword [base + index * 4 + disp], imm32
+  void movStoreImmIndexed(X86Reg base, X86Reg index, int32_t disp,
+                          int32_t imm) {
+    byte(0xC7);
+    byte(0x84); // mod = 10, r/m = SIB
+    byte(0x80 | (index << 3) | base);
+    imm32(disp);
+    imm32(imm);
+  }
+  /// mov r32, imm32
+  /// \return position of the immediate
+  size_t movImm(X86Reg reg, int32_t imm) {
+    byte(0xB8 + reg);
+    size_t position = size();
+    imm32(imm);
+    return position;
+  }
+  /// mov r32, r32
+  void mov(X86Reg dst, X86Reg src) {
+    if (dst == src)
+      return;
+    byte(0x89);
+    modrmReg(src, dst);
+  }
+
+  /// mov r32, address
+  void movPtrImm(X86Reg reg, const void *pointer) {
+    movImm(reg, static_cast<int32_t>(reinterpret_cast<uintptr_t>(pointer)));
+  }
+  /// lea r32, [base + disp]
+  void lea(X86Reg reg, X86Reg base, int32_t disp) {
+    byte(0x8D);
+    modrmMem(reg, base, disp);
+  }
+  /// lea r32, [base + index + disp]
+  void lea(X86Reg reg, X86Reg base, X86Reg index, int8_t disp) {
+    byte(0x8D);
+    byte(0x44 | (reg << 3)); // mod = 01, r/m = SIB
+    byte((index << 3) | base);
+    byte(disp);
+  }
+  /// add r32, imm8
+  void addImm(X86Reg reg, int8_t imm) {
+    byte(0x83);
+    modrmReg(0, reg);
+    byte(imm);
+  }
+  /// sub r32, imm8
+  void subImm(X86Reg reg, int8_t imm) {
+    byte(0x83);
+    modrmReg(5, reg);
+    byte(imm);
+  }
+  /// cmp r32, [base + disp]
+  void cmpLoad(X86Reg reg, X86Reg base, int32_t disp) {
+    byte(0x3B);
+    modrmMem(reg, base, disp);
+  }
+
+  /// mov r32, [address]
+  void movLoadAbs(X86Reg reg, const void *address) {
+    byte(0x8B);
+    modrmAbs(reg, address);
+  }
+  /// mov [address], r32
+  void movStoreAbs(const void *address, X86Reg reg) {
+    byte(0x89);
+    modrmAbs(reg, address);
+  }
+
+  /// op r32, r32
+  void alu(X86AluOp op, X86Reg dst, X86Reg src) {
+    byte(op);
+    modrmReg(src, dst);
+  }
+  /// cmp r32, imm
+  void cmpImm(X86Reg reg, int32_t imm) {
+    if (imm >= -128 && imm <= 127) {
+      byte(0x83);
+      modrmReg(7, reg);
+      byte(imm);
+      return;
+    }
+    byte(0x81);
+    modrmReg(7, reg);
+    imm32(imm);
+  }
+  /// test r8, imm8, only for eax, ecx, edx and ebx
+  void testImm8(X86Reg reg, uint8_t imm) {
+    byte(0xF6);
+    modrmReg(0, reg);
+    byte(imm);
+  }
+  /// sar r32, 1
+  void sar1(X86Reg reg) {
+    byte(0xD1);
+    modrmReg(7, reg);
+  }
+  /// imul r32, r32
+  void imul(X86Reg dst, X86Reg src) {
+    byte(0x0F);
+    byte(0xAF);
+    modrmReg(dst, src);
+  }
+  void cdq() { byte(0x99); }
+  /// idiv r32
+  void idiv(X86Reg reg) {
+    byte(0xF7);
+    modrmReg(7, reg);
+  }
+  void inc(X86Reg reg) {
+    byte(0xFF);
+    modrmReg(0, reg);
+  }
+  void dec(X86Reg reg) {
+    byte(0xFF);
+    modrmReg(1, reg);
+  }
+  /// setcc r8, only for eax, ecx, edx and ebx
+  void setcc(X86Cond cond, X86Reg reg) {
+    byte(0x0F);
+    byte(0x90 + cond);
+    modrmReg(0, reg);
+  }
+  /// movzx r32, r8, only for eax, ecx, edx and ebx
+  void movzx8(X86Reg dst, X86Reg src) {
+    byte(0x0F);
+    byte(0xB6);
+    modrmReg(dst, src);
+  }
+
+  void push(X86Reg reg) { byte(0x50 + reg); }
+  void pop(X86Reg reg) { byte(0x58 + reg); }
+  void ret() { byte(0xC3); }
+
+  /// \return position of the unpatched rel32
+  size_t jmp() {
+    byte(0xE9);
+    return rel32();
+  }
+  /// \return position of the unpatched rel32
+  size_t jcc(X86Cond cond) {
+    byte(0x0F);
+    byte(0x80 + cond);
+    return rel32();
+  }
+  /// \return position of the unpatched rel32
+  size_t call() {
+    byte(0xE8);
+    return rel32();
+  }
+  /// call r
+  void callReg(X86Reg reg) {
+    byte(0xFF);
+    modrmReg(2, reg);
+  }
+  /// jmp r
+  void jmpReg(X86Reg reg) {
+    byte(0xFF);
+    modrmReg(4, reg);
+  }
+
+  /// Points the rel32 at \p position to \p target, both are positions
+  /// in the code
+  void patchRel32(size_t position, size_t target) {
+    int32_t rel = static_cast<int32_t>(target - (position + 4));
+    memcpy(code.data() + position, &rel, sizeof(rel));
+  }
+
+private:
+  void byte(uint8_t b) { code.push_back(b); }
+  void bytes(const void *data, size_t n) {
+    const uint8_t *begin = static_cast<const uint8_t *>(data);
+    code.insert(code.end(), begin, begin + n);
+  }
+  void imm32(int32_t imm) { bytes(&imm, sizeof(imm)); }
+  size_t rel32() {
+    size_t position = size();
+    imm32(0);
+    return position;
+  }
+  void modrmReg(uint8_t reg, X86Reg rm) { byte(0xC0 | (reg << 3) | rm); }
+  void modrmMem(uint8_t reg, X86Reg base, int32_t disp) {
+    bool isShort = disp >= -128 && disp <= 127;
+    byte((isShort ? 0x40 : 0x80) | (reg << 3) | base);
+    if (base == ESP)
+      byte(0x24);
+    if (isShort)
+      byte(disp);
+    else
+      imm32(disp);
+  }
+  /// mod = 00, r/m = 101 is disp32
+  void modrmAbs(uint8_t reg, const void *address) {
+    byte(0x05 | (reg << 3));
+    imm32(static_cast<int32_t>(reinterpret_cast<uintptr_t>(address)));
+  }
+
+private:
+  std::vector<uint8_t> code;
+};
+
+} // namespace lama
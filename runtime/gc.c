@@ -5,6 +5,7 @@
 #include "runtime_common.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <execinfo.h>
 #include <signal.h>
 #include <stdio.h>
@@ -16,22 +17,28 @@
 
 static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
 
+#ifdef __x86_64__
+// values hold addresses zero-extended from 32 bits, so the heap is reserved
+// once in the upper half of the low 4 GiB, clear of the break and of
+// MAP_32BIT mappings, and grows in place inside the reservation
+#  define HEAP_RESERVATION_BEGIN ((void *)0x80000000UL)
+#  define HEAP_RESERVATION_SIZE ((size_t)0x80000000UL)
+#endif
+
 #ifdef DEBUG_VERSION
 size_t cur_id = 0;
 #endif
 
 static extra_roots_pool extra_roots;
 
+static inline bool is_valid_pointer (const size_t *);
+
 size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 #ifdef LAMA_ENV
 extern const size_t __start_custom_data, __stop_custom_data;
 #endif
 
-#ifdef DEBUG_VERSION
 memory_chunk heap;
-#else
-static memory_chunk heap;
-#endif
 
 #ifdef DEBUG_VERSION
 void dump_heap ();
@@ -223,8 +230,9 @@ void *gc_alloc (size_t size) {
 }
 
 static void gc_root_scan_stack () {
-  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
-    gc_test_and_mark_root((size_t **)p);
+  for (unsigned int *p = (unsigned int *)(__gc_stack_top + 4); p < (unsigned int *)__gc_stack_bottom;
+       ++p) {
+    mark(LOAD_PTR(p));
   }
 }
 
@@ -255,6 +263,20 @@ void mark_phase (void) {
 #endif
 }
 
+// grows the heap in bytes, in place on x86-64
+static void *remap_heap (void *old, size_t old_size, size_t new_size) {
+  if (new_size == old_size) { return old; }
+#ifdef __x86_64__
+  if (new_size > HEAP_RESERVATION_SIZE
+      || mprotect(old, new_size, PROT_READ | PROT_WRITE) != 0) {
+    return MAP_FAILED;
+  }
+  return old;
+#else
+  return mremap(old, old_size, new_size, MREMAP_MAYMOVE);
+#endif
+}
+
 void compact_phase (size_t additional_size) {
   size_t live_size = compute_locations();
 
@@ -262,10 +284,16 @@ void compact_phase (size_t additional_size) {
   size_t next_heap_size =
       MAX(live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size, MINIMUM_HEAP_CAPACITY);
   size_t next_heap_pseudo_size = MAX(next_heap_size, heap.size);
+#ifdef __x86_64__
+  // the reservation is enough as long as what has to fit does
+  if (live_size + additional_size <= BYTES_TO_WORDS(HEAP_RESERVATION_SIZE)) {
+    next_heap_pseudo_size = MIN(next_heap_pseudo_size, BYTES_TO_WORDS(HEAP_RESERVATION_SIZE));
+  }
+#endif
 
   memory_chunk old_heap = heap;
-  heap.begin            = mremap(
-      heap.begin, WORDS_TO_BYTES(heap.size), WORDS_TO_BYTES(next_heap_pseudo_size), MREMAP_MAYMOVE);
+  heap.begin            = remap_heap(
+      heap.begin, WORDS_TO_BYTES(heap.size), WORDS_TO_BYTES(next_heap_pseudo_size));
   if (heap.begin == MAP_FAILED) {
     perror("ERROR: compact_phase: mremap failed\n");
     exit(1);
@@ -309,8 +337,8 @@ void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region started\n");
 #endif
-  for (size_t *ptr = (size_t *)start; ptr < (size_t *)end; ++ptr) {
-    size_t ptr_value = *ptr;
+  for (unsigned int *ptr = (unsigned int *)start; ptr < (unsigned int *)end; ++ptr) {
+    size_t ptr_value = (size_t)LOAD_PTR(ptr);
     // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
     // heap
     if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
@@ -319,7 +347,7 @@ void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
       void *new_addr =
           (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
       size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
+      STORE_PTR(ptr, new_addr + content_offset);
     }
   }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
@@ -409,11 +437,11 @@ void update_references (memory_chunk *old_heap) {
            !field_is_done_iterator(&field_iter);
            obj_next_ptr_field_iterator(&field_iter)) {
 
-        size_t *field_value = *(size_t **)field_iter.cur_field;
+        size_t *field_value = LOAD_PTR(field_iter.cur_field);
         if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
         // this pointer should also be modified according to old_heap->begin
         void *field_obj_content_addr =
-            (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
+            (void *)heap.begin + (LOAD_PTR(field_iter.cur_field) - (void *)old_heap->begin);
         // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
         void *new_addr =
             heap.begin
@@ -432,7 +460,7 @@ void update_references (memory_chunk *old_heap) {
           exit(1);
         }
 #endif
-        *(void **)field_iter.cur_field = new_addr + content_offset;
+        STORE_PTR(field_iter.cur_field, new_addr + content_offset);
       }
     }
     heap_next_obj_iterator(&it);
@@ -519,7 +547,7 @@ void mark (void *obj) {
     for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
          !field_is_done_iterator(&ptr_field_it);
          obj_next_ptr_field_iterator(&ptr_field_it)) {
-      void *field_value = *(void **)ptr_field_it.cur_field;
+      void *field_value = LOAD_PTR(ptr_field_it.cur_field);
       if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
           || is_enqueued(field_value)) {
         continue;
@@ -541,8 +569,10 @@ void scan_extra_roots (void) {
 #ifdef LAMA_ENV
 void scan_global_area (void) {
   // __start_custom_data is pointing to beginning of global area, thus all dereferencings are safe
-  for (size_t *ptr = (size_t *)&__start_custom_data; ptr < (size_t *)&__stop_custom_data; ++ptr) {
-    mark(*(void **)ptr);
+  for (unsigned int *ptr = (unsigned int *)&__start_custom_data;
+       ptr < (unsigned int *)&__stop_custom_data;
+       ++ptr) {
+    mark(LOAD_PTR(ptr));
   }
 }
 #endif
@@ -570,8 +600,26 @@ void __init (void) {
 
   srandom(time(NULL));
 
+#ifdef __x86_64__
+  heap.begin = mmap(HEAP_RESERVATION_BEGIN,
+                    HEAP_RESERVATION_SIZE,
+                    PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+                    -1,
+                    0);
+  if (heap.begin != MAP_FAILED && heap.begin != HEAP_RESERVATION_BEGIN) {
+    // kernels before 4.17 take the address as a hint only
+    munmap(heap.begin, HEAP_RESERVATION_SIZE);
+    heap.begin = MAP_FAILED;
+    errno      = EEXIST;
+  }
+  if (heap.begin != MAP_FAILED && mprotect(heap.begin, space_size, PROT_READ | PROT_WRITE) != 0) {
+    heap.begin = MAP_FAILED;
+  }
+#else
   heap.begin = mmap(
       NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+#endif
   if (heap.begin == MAP_FAILED) {
     perror("ERROR: __init: mmap failed\n");
     exit(1);
@@ -583,7 +631,11 @@ void __init (void) {
 }
 
 extern void __shutdown (void) {
+#ifdef __x86_64__
+  munmap(heap.begin, HEAP_RESERVATION_SIZE);
+#else
   munmap(heap.begin, heap.size);
+#endif
 #ifdef DEBUG_VERSION
   cur_id = 0;
 #endif
@@ -824,7 +876,7 @@ obj_field_iterator ptr_field_begin_iterator (void *obj) {
   obj_field_iterator it = field_begin_iterator(obj);
   // corner case when obj has no fields
   if (field_is_done_iterator(&it)) { return it; }
-  if (is_valid_pointer(*(size_t **)it.cur_field)) { return it; }
+  if (is_valid_pointer(LOAD_PTR(it.cur_field))) { return it; }
   obj_next_ptr_field_iterator(&it);
   return it;
 }
@@ -834,7 +886,7 @@ void obj_next_field_iterator (obj_field_iterator *it) { it->cur_field += MEMBER_
 void obj_next_ptr_field_iterator (obj_field_iterator *it) {
   do {
     obj_next_field_iterator(it);
-  } while (!field_is_done_iterator(it) && !is_valid_pointer(*(size_t **)it->cur_field));
+  } while (!field_is_done_iterator(it) && !is_valid_pointer(LOAD_PTR(it->cur_field)));
 }
 
 bool field_is_done_iterator (obj_field_iterator *it) {
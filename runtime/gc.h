@@ -23,18 +23,18 @@
 
 #include "runtime_common.h"
 
-#define GET_MARK_BIT(x) (((int)(x)) & 1)
-#define SET_MARK_BIT(x) (x = (((int)(x)) | 1))
-#define IS_ENQUEUED(x) (((int)(x)) & 2)
-#define MAKE_ENQUEUED(x) (x = (((int)(x)) | 2))
-#define MAKE_DEQUEUED(x) (x = (((int)(x)) & (~2)))
-#define RESET_MARK_BIT(x) (x = (((int)(x)) & (~1)))
+#define GET_MARK_BIT(x) (((size_t)(x)) & 1)
+#define SET_MARK_BIT(x) (x = (((size_t)(x)) | 1))
+#define IS_ENQUEUED(x) (((size_t)(x)) & 2)
+#define MAKE_ENQUEUED(x) (x = (((size_t)(x)) | 2))
+#define MAKE_DEQUEUED(x) (x = (((size_t)(x)) & (~(size_t)2)))
+#define RESET_MARK_BIT(x) (x = (((size_t)(x)) & (~(size_t)1)))
 // since last 2 bits are used for mark-bit and enqueued-bit and due to correct
 // alignment we can expect that last 2 bits don't influence address (they
 // should always be zero)
 #define GET_FORWARD_ADDRESS(x) (((size_t)(x)) & (~3))
 // take the last two bits as they are and make all others zero
-#define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((int)(addr))))
+#define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((size_t)(addr))))
 // if heap is full after gc shows in how many times it has to be extended
 #define EXTRA_ROOM_HEAP_COEFFICIENT 2
 #ifdef DEBUG_VERSION
@@ -75,6 +75,26 @@ void *gc_alloc(size_t);
 // takes number of words as a parameter
 void *gc_alloc_on_existing_heap(size_t);
 
+// ============================================================================
+//                          Inline allocation
+// ============================================================================
+// The heap is exposed so that callers building objects themselves, like the
+// interpreter, allocate by bumping heap.current right where they are, and
+// only call into the GC once the heap is full.
+extern memory_chunk heap;
+
+// takes number of words as a parameter, allocates them like alloc but does
+// not clear them: the caller has to set the header, the forward address and
+// every field before the next allocation
+static inline void *alloc_uncleared (size_t size) {
+  if (heap.current + size <= heap.end) {
+    void *p = (void *)heap.current;
+    heap.current += size;
+    return p;
+  }
+  return gc_alloc(size);
+}
+
 // specific for mark-and-compact_phase gc
 void mark (void *obj);
 void mark_phase (void);
@@ -134,7 +154,6 @@ extern void __shutdown (void);
 // ============================================================================
 extern void        gc_test_and_mark_root (size_t **root);
 bool               is_valid_heap_pointer (const size_t *);
-static inline bool is_valid_pointer (const size_t *);
 
 
 // ============================================================================
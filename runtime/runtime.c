@@ -324,8 +324,8 @@ static void printValue (void *p) {
 
         printStringBuf("<closure ");
         for (i = 0; i < LEN(a->data_header); i++) {
-          if (i) printValue((void *)((int *)a->contents)[i]);
-          else printStringBuf("0x%x", (void *)((int *)a->contents)[i]);
+          if (i) printValue(LOAD_PTR((int *)a->contents + i));
+          else printStringBuf("0x%x", ((int *)a->contents)[i]);
           if (i != LEN(a->data_header) - 1) printStringBuf(", ");
         }
         printStringBuf(">");
@@ -334,7 +334,7 @@ static void printValue (void *p) {
       case ARRAY_TAG: {
         printStringBuf("[");
         for (i = 0; i < LEN(a->data_header); i++) {
-          printValue((void *)((int *)a->contents)[i]);
+          printValue(LOAD_PTR((int *)a->contents + i));
           if (i != LEN(a->data_header) - 1) printStringBuf(", ");
         }
         printStringBuf("]");
@@ -348,11 +348,11 @@ static void printValue (void *p) {
           sexp *sb = sa;
           printStringBuf("{");
           while (LEN(sb->data_header)) {
-            printValue((void *)((int *)sb->contents)[0]);
+            printValue(LOAD_PTR(sb->contents));
             int list_next = ((int *)sb->contents)[1];
             if (!UNBOXED(list_next)) {
               printStringBuf(", ");
-              sb = TO_SEXP(list_next);
+              sb = TO_SEXP(VALUE_TO_PTR(list_next));
             } else break;
           }
           printStringBuf("}");
@@ -362,7 +362,7 @@ static void printValue (void *p) {
           if (LEN(a->data_header)) {
             printStringBuf(" (");
             for (i = 0; i < LEN(sexp_a->data_header); i++) {
-              printValue((void *)((int *)sexp_a->contents)[i]);
+              printValue(LOAD_PTR((int *)sexp_a->contents + i));
               if (i != LEN(sexp_a->data_header) - 1) printStringBuf(", ");
             }
             printStringBuf(")");
@@ -394,10 +394,10 @@ static void stringcat (void *p) {
           sexp *b = (sexp *)a;
 
           while (LEN(b->data_header)) {
-            stringcat((void *)((int *)b->contents)[0]);
+            stringcat(LOAD_PTR(b->contents));
             int next_b = ((int *)b->contents)[1];
             if (!UNBOXED(next_b)) {
-              b = TO_SEXP(next_b);
+              b = TO_SEXP(VALUE_TO_PTR(next_b));
             } else break;
           }
         } else printStringBuf("*** non-list data_header: %s ***", tag);
@@ -471,7 +471,7 @@ extern struct re_pattern_buffer *Lregexp (char *regexp) {
 
   memset(b, 0, sizeof(regex_t));
 
-  int n = (int)re_compile_pattern(regexp, strlen(regexp), b);
+  int n = (int)(intptr_t)re_compile_pattern(regexp, strlen(regexp), b);
 
   if (n != 0) { failure("%", strerror(n)); };
 
@@ -539,7 +539,8 @@ void *Lclone (void *p) {
 
 #define HASH_DEPTH 3
 #define HASH_APPEND(acc, x)                                                                        \
-  (((acc + (unsigned)x) << (WORD_SIZE / 2)) | ((acc + (unsigned)x) >> (WORD_SIZE / 2)))
+  (((acc + (unsigned)(uintptr_t)x) << (WORD_SIZE / 2))                                             \
+   | ((acc + (unsigned)(uintptr_t)x) >> (WORD_SIZE / 2)))
 
 int inner_hash (int depth, unsigned acc, void *p) {
   if (depth > HASH_DEPTH) return acc;
@@ -565,7 +566,7 @@ int inner_hash (int depth, unsigned acc, void *p) {
       }
 
       case CLOSURE_TAG:
-        acc = HASH_APPEND(acc, ((void **)a->contents)[0]);
+        acc = HASH_APPEND(acc, LOAD_PTR(a->contents));
         i   = 1;
         break;
 
@@ -582,7 +583,7 @@ int inner_hash (int depth, unsigned acc, void *p) {
       default: failure("invalid data_header %d in hash *****\n", t);
     }
 
-    for (; i < l; i++) acc = inner_hash(depth + 1, acc, ((void **)a->contents)[i]);
+    for (; i < l; i++) acc = inner_hash(depth + 1, acc, LOAD_PTR((int *)a->contents + i));
 
     return acc;
   } else return HASH_APPEND(acc, p);
@@ -591,7 +592,7 @@ int inner_hash (int depth, unsigned acc, void *p) {
 extern void *LstringInt (char *b) {
   int n;
   sscanf(b, "%d", &n);
-  return (void *)BOX(n);
+  return (void *)(intptr_t)BOX(n);
 }
 
 extern int Lhash (void *p) { return BOX(0x3fffff & inner_hash(0, 0, p)); }
@@ -633,7 +634,7 @@ extern int Lcompare (void *p, void *q) {
           case STRING_TAG: return BOX(strcmp(a->contents, b->contents));
 
           case CLOSURE_TAG:
-            COMPARE_AND_RETURN(((void **)a->contents)[0], ((void **)b->contents)[0]);
+            COMPARE_AND_RETURN(LOAD_PTR(a->contents), LOAD_PTR(b->contents));
             COMPARE_AND_RETURN(la, lb);
             i = 1;
             break;
@@ -656,7 +657,8 @@ extern int Lcompare (void *p, void *q) {
         }
 
         for (; i < la; i++) {
-          int c = Lcompare(((void **)a->contents)[i + shift], ((void **)b->contents)[i + shift]);
+          int c = Lcompare(LOAD_PTR((int *)a->contents + i + shift),
+                           LOAD_PTR((int *)b->contents + i + shift));
           if (c != BOX(0)) return c;
         }
         return BOX(0);
@@ -676,9 +678,9 @@ extern void *Belem (void *p, int i) {
   i = UNBOX(i);
 
   switch (TAG(a->data_header)) {
-    case STRING_TAG: return (void *)BOX(a->contents[i]);
-    case SEXP_TAG: return (void *)((int *)a->contents)[i + 1];
-    default: return (void *)((int *)a->contents)[i];
+    case STRING_TAG: return (void *)(intptr_t)BOX(a->contents[i]);
+    case SEXP_TAG: return LOAD_PTR((int *)a->contents + i + 1);
+    default: return LOAD_PTR((int *)a->contents + i);
   }
 }
 
@@ -775,19 +777,24 @@ extern void *Lstring (void *p) {
 extern void *Bclosure (int bn, void *entry, ...) {
   va_list       args;
   int           i, ai;
+#ifdef __i386__
+  // the captured values are pushed on the machine stack by the caller
   register int *ebp asm("ebp");
   size_t       *argss;
+#endif
   data         *r;
   int           n = UNBOX(bn);
 
   PRE_GC();
 
+#ifdef __i386__
   argss = (ebp + 12);
   for (i = 0; i < n; i++, argss++) { push_extra_root((void **)argss); }
+#endif
 
   r = (data *)alloc_closure(n + 1);
   push_extra_root((void **)&r);
-  ((void **)r->contents)[0] = entry;
+  STORE_PTR(r->contents, entry);
 
   va_start(args, entry);
 
@@ -801,8 +808,10 @@ extern void *Bclosure (int bn, void *entry, ...) {
   POST_GC();
 
   pop_extra_root((void **)&r);
+#ifdef __i386__
   argss--;
   for (i = 0; i < n; i++, argss--) { pop_extra_root((void **)argss); }
+#endif
   return r->contents;
 }
 
@@ -851,7 +860,7 @@ extern void *Bsexp (int bn, ...) {
 
   for (i = 1; i < n; i++) {
     ai                      = va_arg(args, int);
-    p                       = (size_t *)ai;
+    p                       = VALUE_TO_PTR(ai);
     ((int *)r->contents)[i] = ai;
   }
 
@@ -943,21 +952,23 @@ extern void *Bsta (void *v, int i, void *x) {
         break;
       }
       case SEXP_TAG: {
-        ((int *)x)[UNBOX(i) + 1] = (int)v;
+        ((int *)x)[UNBOX(i) + 1] = PTR_TO_VALUE(v);
         break;
       }
       default: {
-        ((int *)x)[UNBOX(i)] = (int)v;
+        ((int *)x)[UNBOX(i)] = PTR_TO_VALUE(v);
       }
     }
   } else {
-    *(void **)x = v;
+    STORE_PTR(x, v);
   }
 
   return v;
 }
 
 static void fix_unboxed (char *s, va_list va) {
+#ifdef __i386__
+  // the arguments follow each other on the stack only on i386
   size_t *p = (size_t *)va;
   int     i = 0;
 
@@ -969,6 +980,7 @@ static void fix_unboxed (char *s, va_list va) {
     }
     s++;
   }
+#endif
 }
 
 extern void Lfailure (char *s, ...) {
@@ -980,7 +992,7 @@ extern void Lfailure (char *s, ...) {
 }
 
 extern void LprintfPerror (char *s, ...) {
-  va_list args = (va_list)BOX(NULL);
+  va_list args;
 
   ASSERT_STRING("printfPerror:1", s);
 
@@ -1077,7 +1089,7 @@ extern void *LgetEnv (char *var) {
 extern int Lsystem (char *cmd) { return BOX(system(cmd)); }
 
 extern void Lfprintf (FILE *f, char *s, ...) {
-  va_list args = (va_list)BOX(NULL);
+  va_list args;
 
   ASSERT_BOXED("fprintf:1", f);
   ASSERT_STRING("fprintf:2", s);
@@ -1089,7 +1101,7 @@ extern void Lfprintf (FILE *f, char *s, ...) {
 }
 
 extern void Lprintf (char *s, ...) {
-  va_list args = (va_list)BOX(NULL);
+  va_list args;
 
   ASSERT_STRING("printf:1", s);
 
@@ -1250,7 +1262,7 @@ extern void set_args (int argc, char *argv[]) {
   p = LmakeArray(BOX(n));
   push_extra_root((void **)&p);
 
-  for (i = 0; i < n; i++) { ((int *)p)[i] = (int)Bstring(argv[i]); }
+  for (i = 0; i < n; i++) { ((int *)p)[i] = PTR_TO_VALUE(Bstring(argv[i])); }
 
   pop_extra_root((void **)&p);
   POST_GC();
@@ -1,6 +1,7 @@
 #ifndef __LAMA_RUNTIME_COMMON__
 #define __LAMA_RUNTIME_COMMON__
 #include <stddef.h>
+#include <stdint.h>
 
 // this flag makes GC behavior a bit different for testing purposes.
 //#define DEBUG_VERSION
@@ -17,20 +18,26 @@
 
 #define SEXP_ONLY_HEADER_SZ (sizeof(int))
 
-#ifndef DEBUG_VERSION
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(int))
-#else
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(size_t) + sizeof(int))
-#endif
+// the header is padded on 64-bit targets, so it is taken from the layout
+#define DATA_HEADER_SZ (offsetof(data, contents))
 
 #define MEMBER_SIZE sizeof(int)
 
+// Fields, stack slots and globals hold 32-bit values on every target. On
+// 64-bit targets the heap, the stack and the code are kept in the low 4 GiB
+// of the address space, so that a value zero-extended is the address itself.
+// The heap takes the upper 2 GiB of it, see __init.
+#define VALUE_TO_PTR(x) ((void *)(size_t)(unsigned int)(x))
+#define PTR_TO_VALUE(p) ((int)(size_t)(p))
+#define LOAD_PTR(addr) VALUE_TO_PTR(*(unsigned int *)(addr))
+#define STORE_PTR(addr, p) (*(unsigned int *)(addr) = (unsigned int)(size_t)(p))
+
 #define TO_DATA(x) ((data *)((char *)(x)-DATA_HEADER_SZ))
 #define TO_SEXP(x) ((sexp *)((char *)(x)-DATA_HEADER_SZ))
 
-#define UNBOXED(x) (((int)(x)) & 0x0001)
-#define UNBOX(x) (((int)(x)) >> 1)
-#define BOX(x) ((((int)(x)) << 1) | 0x0001)
+#define UNBOXED(x) (((int)(intptr_t)(x)) & 0x0001)
+#define UNBOX(x) (((int)(intptr_t)(x)) >> 1)
+#define BOX(x) ((((int)(intptr_t)(x)) << 1) | 0x0001)
 
 #define BYTES_TO_WORDS(bytes) (((bytes)-1) / sizeof(size_t) + 1)
 #define WORDS_TO_BYTES(words) ((words) * sizeof(size_t))